@@ -0,0 +1,452 @@
+// Headless benchmark of the cloth core: runs a number of substeps and prints
+// the timing, energy drift and peak memory as JSON.
+//
+// usage: proj__cloth_bench [--resolution N] [--substeps N] [--threads N]
+//                          [--integrator explicit|implicit|xpbd]
+//                          [--isa scalar|sse4|avx2] [--self-collision]
+//                          [--fixed-step] [--deterministic] [--multigrid] [--sleeping] [--membrane] [--tiled]
+//                          [--cloths N] [--disc RINGS] [--ensemble VARIANTS [--results FILE]]
+//                          [--load-state FILE] [--save-state FILE] [--record FILE]
+//   --deterministic gives the same checksum for any thread count, also
+//              with self-collision
+//   --multigrid preconditions the implicit solve with multigrid V-cycles
+//   --sleeping freezes the tiles of the grid that came to rest, explicit
+//              integrator only
+//   --membrane replaces the stretch and shear springs by StVK triangles,
+//              explicit integrator only
+//   --tiled    stores the nodes tile by tile instead of row by row, not with
+//              --membrane, --multigrid or --load-state
+//   --cloths   simulates N panels of the resolution together in a ClothWorld
+//              instead, explicit integrator only
+//   --disc     simulates a round triangle mesh cloth of RINGS rings instead,
+//              hanging from its top, explicit integrator only
+//   --ensemble simulates every variant of a CSV of mass, K[0], K[1], K[2],
+//              Cd and Cv together in a ClothEnsemble instead, explicit
+//              integrator only; --results writes how each one ended up
+//   --load-state starts from a checkpoint, with its resolution and settings
+//   --save-state writes a checkpoint after the run
+//   --record   writes every tick to a vertex cache, then reads it back
+
+#include "../cloth_simulation/cloth.h"
+#include "../cloth_simulation/cloth_ensemble.h"
+#include "../cloth_simulation/cloth_world.h"
+#include "../cloth_simulation/triangle_cloth.h"
+#include "../cloth_simulation/vertex_cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// peak resident set size in bytes
+static long long peakMemory() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return static_cast<long long>(counters.PeakWorkingSetSize);
+	return 0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return usage.ru_maxrss;
+#else
+	return usage.ru_maxrss * 1024ll;
+#endif
+#endif
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "usage: %s [--resolution N] [--substeps N] [--threads N]"
+		" [--integrator explicit|implicit|xpbd] [--isa scalar|sse4|avx2] [--self-collision]"
+		" [--fixed-step] [--deterministic] [--multigrid] [--sleeping] [--membrane] [--tiled] [--cloths N] [--disc RINGS] [--ensemble VARIANTS [--results FILE]] [--load-state FILE] [--save-state FILE] [--record FILE]\n", name);
+	exit(1);
+}
+
+static cloth_kernels::Isa pickIsa(const std::string& isa, cloth_kernels::Isa best) {
+	if (isa == "scalar")
+		return cloth_kernels::ISA_SCALAR;
+	if (isa == "sse4")
+		return std::min(best, cloth_kernels::ISA_SSE4);
+	if (isa == "avx2")
+		return std::min(best, cloth_kernels::ISA_AVX2);
+	return best;
+}
+
+// the panels stand side by side, each turned a little further about y
+static int benchWorld(int cloths, int resolution, int substeps, int threads, const std::string& isa) {
+	ClothWorld world;
+	world.setThreadCount(threads);
+	world.simdIsa = pickIsa(isa, world.bestIsa());
+	for (int c = 0; c < cloths; c++) {
+		glm::mat4 model(1.0f);
+		model[3] = glm::vec4(5.0f * c, 0.0f, 0.0f, 1.0f);
+		float angle = 0.3f * c;
+		model[0] = glm::vec4(cos(angle), 0.0f, -sin(angle), 0.0f);
+		model[2] = glm::vec4(sin(angle), 0.0f, cos(angle), 0.0f);
+		world.addCloth(resolution, model);
+	}
+
+	double initialEnergy = world.computeEnergy();
+	int done = 0, ticks = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	while (done < substeps) {
+		done += world.advance(world.simulationTick);
+		ticks++;
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	double finalEnergy = world.computeEnergy();
+
+	int nodes = world.nodeCount();
+	printf("{\n");
+	printf("  \"cloths\": %d,\n", world.clothCount());
+	printf("  \"resolution\": %d,\n", resolution);
+	printf("  \"nodes\": %d,\n", nodes);
+	printf("  \"integrator\": \"explicit\",\n");
+	printf("  \"isa\": \"%s\",\n", cloth_kernels::isaName(world.simdIsa));
+	printf("  \"threads\": %d,\n", world.threadCount());
+	printf("  \"substeps\": %d,\n", done);
+	printf("  \"ticks\": %d,\n", ticks);
+	printf("  \"simulated_seconds\": %.6f,\n", ticks * world.simulationTick);
+	printf("  \"seconds\": %.6f,\n", seconds);
+	printf("  \"ns_per_node_substep\": %.4f,\n", seconds * 1e9 / (static_cast<double>(nodes) * done));
+	printf("  \"initial_energy\": %.9g,\n", initialEnergy);
+	printf("  \"final_energy\": %.9g,\n", finalEnergy);
+	printf("  \"energy_drift\": %.9g,\n", finalEnergy - initialEnergy);
+	printf("  \"peak_rss_bytes\": %lld\n", peakMemory());
+	printf("}\n");
+	return 0;
+}
+
+// the disc hangs from the nodes along the top of its rim
+static int benchDisc(int rings, int substeps, int threads, const std::string& isa) {
+	std::vector<glm::vec3> vertices;
+	std::vector<unsigned int> indices;
+	makeDiscMesh(rings, vertices, indices);
+	TriangleCloth cloth;
+	cloth.setThreadCount(threads);
+	cloth.simdIsa = pickIsa(isa, cloth.bestIsa());
+	cloth.setMesh(vertices, indices);
+	cloth.pinTop(0.01f);
+
+	double initialEnergy = cloth.computeEnergy();
+	int done = 0, ticks = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	while (done < substeps) {
+		done += cloth.advance(cloth.simulationTick);
+		ticks++;
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	double finalEnergy = cloth.computeEnergy();
+
+	int nodes = cloth.nodeCount();
+	printf("{\n");
+	printf("  \"rings\": %d,\n", rings);
+	printf("  \"nodes\": %d,\n", nodes);
+	printf("  \"triangles\": %d,\n", static_cast<int>(cloth.triangles().size() / 3));
+	printf("  \"springs\": %d,\n", cloth.springCount());
+	printf("  \"pins\": %d,\n", cloth.pinCount());
+	printf("  \"integrator\": \"explicit\",\n");
+	printf("  \"isa\": \"%s\",\n", cloth_kernels::isaName(cloth.simdIsa));
+	printf("  \"threads\": %d,\n", cloth.threadCount());
+	printf("  \"substeps\": %d,\n", done);
+	printf("  \"ticks\": %d,\n", ticks);
+	printf("  \"simulated_seconds\": %.6f,\n", ticks * cloth.simulationTick);
+	printf("  \"seconds\": %.6f,\n", seconds);
+	printf("  \"ns_per_node_substep\": %.4f,\n", seconds * 1e9 / (static_cast<double>(nodes) * done));
+	printf("  \"initial_energy\": %.9g,\n", initialEnergy);
+	printf("  \"final_energy\": %.9g,\n", finalEnergy);
+	printf("  \"energy_drift\": %.9g,\n", finalEnergy - initialEnergy);
+	printf("  \"peak_rss_bytes\": %lld\n", peakMemory());
+	printf("}\n");
+	return 0;
+}
+
+// every variant hangs from its top corners like the single cloth
+static int benchEnsemble(const std::string& variantPath, const std::string& resultPath, int resolution, int substeps,
+	int threads, const std::string& isa) {
+	std::vector<ClothEnsemble::Variant> variants;
+	if (!loadVariants(variantPath, variants)) {
+		fprintf(stderr, "could not read variants from %s\n", variantPath.c_str());
+		return 1;
+	}
+	ClothEnsemble ensemble(resolution);
+	ensemble.setThreadCount(threads);
+	ensemble.simdIsa = pickIsa(isa, ensemble.bestIsa());
+	ensemble.setVariants(variants);
+
+	int done = 0, ticks = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	while (done < substeps) {
+		done += ensemble.advance(ensemble.simulationTick);
+		ticks++;
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::vector<ClothEnsemble::Result> results = ensemble.results();
+	if (!resultPath.empty() && !saveResults(resultPath, variants, results)) {
+		fprintf(stderr, "could not write %s\n", resultPath.c_str());
+		return 1;
+	}
+	int unstable = 0;
+	for (size_t v = 0; v < results.size(); v++)
+		unstable += !results[v].finite;
+
+	int nodes = ensemble.resolution() * ensemble.resolution();
+	printf("{\n");
+	printf("  \"variants\": %d,\n", ensemble.variantCount());
+	printf("  \"blocks\": %d,\n", ensemble.blockCount());
+	printf("  \"lanes\": %d,\n", ensembleLanes);
+	printf("  \"resolution\": %d,\n", ensemble.resolution());
+	printf("  \"nodes\": %d,\n", nodes);
+	printf("  \"integrator\": \"explicit\",\n");
+	printf("  \"isa\": \"%s\",\n", cloth_kernels::isaName(ensemble.simdIsa));
+	printf("  \"threads\": %d,\n", ensemble.threadCount());
+	printf("  \"substeps\": %d,\n", done);
+	printf("  \"ticks\": %d,\n", ticks);
+	printf("  \"simulated_seconds\": %.6f,\n", ticks * ensemble.simulationTick);
+	printf("  \"seconds\": %.6f,\n", seconds);
+	printf("  \"ns_per_node_substep\": %.4f,\n", seconds * 1e9 / (static_cast<double>(nodes) * ensemble.variantCount() * done));
+	printf("  \"unstable_variants\": %d,\n", unstable);
+	printf("  \"peak_rss_bytes\": %lld\n", peakMemory());
+	printf("}\n");
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	int resolution = 64;
+	int substeps = 1000;
+	int threads = 1;
+	int cloths = 0;
+	int disc = 0;
+	std::string integrator = "explicit";
+	std::string isa, loadState, saveState, record, ensemble, results;
+	bool selfCollision = false, fixedStep = false, deterministic = false, multigrid = false, sleeping = false;
+	bool membrane = false, tiled = false;
+	for (int a = 1; a < argc; a++) {
+		if (!strcmp(argv[a], "--self-collision")) {
+			selfCollision = true;
+			continue;
+		}
+		if (!strcmp(argv[a], "--fixed-step")) {
+			fixedStep = true;
+			continue;
+		}
+		if (!strcmp(argv[a], "--deterministic")) {
+			deterministic = true;
+			continue;
+		}
+		if (!strcmp(argv[a], "--multigrid")) {
+			multigrid = true;
+			continue;
+		}
+		if (!strcmp(argv[a], "--sleeping")) {
+			sleeping = true;
+			continue;
+		}
+		if (!strcmp(argv[a], "--membrane")) {
+			membrane = true;
+			continue;
+		}
+		if (!strcmp(argv[a], "--tiled")) {
+			tiled = true;
+			continue;
+		}
+		if (a + 1 >= argc)
+			usage(argv[0]);
+		if (!strcmp(argv[a], "--resolution"))
+			resolution = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "--substeps"))
+			substeps = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "--threads"))
+			threads = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "--integrator"))
+			integrator = argv[++a];
+		else if (!strcmp(argv[a], "--isa"))
+			isa = argv[++a];
+		else if (!strcmp(argv[a], "--cloths"))
+			cloths = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "--disc"))
+			disc = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "--load-state"))
+			loadState = argv[++a];
+		else if (!strcmp(argv[a], "--save-state"))
+			saveState = argv[++a];
+		else if (!strcmp(argv[a], "--record"))
+			record = argv[++a];
+		else if (!strcmp(argv[a], "--ensemble"))
+			ensemble = argv[++a];
+		else if (!strcmp(argv[a], "--results"))
+			results = argv[++a];
+		else
+			usage(argv[0]);
+	}
+	if (!isa.empty() && isa != "scalar" && isa != "sse4" && isa != "avx2")
+		usage(argv[0]);
+
+	if (!results.empty() && ensemble.empty())
+		usage(argv[0]);
+	if (!ensemble.empty()) {
+		if (integrator != "explicit" || cloths > 0 || disc > 0 || selfCollision || deterministic || multigrid || sleeping || membrane || tiled
+			|| !loadState.empty() || !saveState.empty() || !record.empty())
+			usage(argv[0]);
+		return benchEnsemble(ensemble, results, resolution, substeps, threads, isa);
+	}
+	if (cloths > 0) {
+		if (integrator != "explicit" || selfCollision || deterministic || multigrid || sleeping || membrane || tiled || !loadState.empty() || !saveState.empty() || !record.empty())
+			usage(argv[0]);
+		return benchWorld(cloths, resolution, substeps, threads, isa);
+	}
+	if (disc > 0) {
+		if (integrator != "explicit" || selfCollision || deterministic || multigrid || sleeping || membrane || tiled || !loadState.empty() || !saveState.empty() || !record.empty())
+			usage(argv[0]);
+		return benchDisc(disc, substeps, threads, isa);
+	}
+
+	if (tiled && (membrane || multigrid || !loadState.empty()))
+		usage(argv[0]);
+
+	Cloth cloth(resolution);
+	cloth.setThreadCount(threads);
+	if (tiled)
+		cloth.setLayout(Cloth::TILED);
+	cloth.selfCollision = selfCollision;
+	cloth.adaptiveTimeStep = !fixedStep;
+	cloth.deterministic = deterministic;
+	cloth.multigrid = multigrid;
+	cloth.sleeping = sleeping;
+	cloth.membrane = membrane;
+	if (integrator == "implicit")
+		cloth.integrator = Cloth::IMPLICIT_EULER;
+	else if (integrator == "xpbd")
+		cloth.integrator = Cloth::XPBD;
+	else if (integrator == "explicit")
+		cloth.integrator = Cloth::EXPLICIT_EULER;
+	else
+		usage(argv[0]);
+	cloth.simdIsa = pickIsa(isa, cloth.bestIsa());
+	double restoreSeconds = 0.0;
+	if (!loadState.empty()) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (!cloth.loadCheckpoint(loadState)) {
+			fprintf(stderr, "could not restore %s\n", loadState.c_str());
+			return 1;
+		}
+		restoreSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		selfCollision = cloth.selfCollision;
+		deterministic = cloth.deterministic;
+		multigrid = cloth.multigrid;
+		sleeping = cloth.sleeping;
+		membrane = cloth.membrane;
+		const char* names[] = { "explicit", "implicit", "xpbd" };
+		integrator = names[cloth.integrator];
+	}
+
+	// frames are copied out and encoded between ticks, off the clock of the
+	// simulation itself
+	VertexCacheWriter recorder;
+	std::vector<float> frame(cloth.resolution() * cloth.resolution() * 6);
+	double recordSeconds = 0.0;
+	if (!record.empty()) {
+		if (!recorder.open(record, cloth.resolution(), cloth.simulationTick)) {
+			fprintf(stderr, "could not write %s\n", record.c_str());
+			return 1;
+		}
+		cloth.copyVertices(frame.data());
+		recorder.append(frame.data());
+	}
+
+	// whole ticks, like the physics thread runs them
+	double initialEnergy = cloth.computeEnergy();
+	int done = 0, ticks = 0;
+	long long cgIterations = 0;
+	double seconds = 0.0;
+	while (done < substeps) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		done += cloth.advance(cloth.simulationTick);
+		ticks++;
+		cgIterations += cloth.solverIterations();
+		std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		seconds += std::chrono::duration<double>(end - start).count();
+		if (recorder.isOpen()) {
+			cloth.copyVertices(frame.data());
+			recorder.append(frame.data());
+			recordSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - end).count();
+		}
+	}
+	double finalEnergy = cloth.computeEnergy();
+	unsigned long long checksum = cloth.stateChecksum();
+	if (!saveState.empty() && !cloth.saveCheckpoint(saveState)) {
+		fprintf(stderr, "could not write %s\n", saveState.c_str());
+		return 1;
+	}
+
+	// the recording is read back front to back, as playback would
+	int frames = recorder.frameCount();
+	long long recordBytes = recorder.byteCount();
+	double playbackSeconds = 0.0;
+	if (!record.empty()) {
+		VertexCacheReader player;
+		bool ok = recorder.close() && player.open(record) && player.frameCount() == frames;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int f = 0; ok && f < frames; f++)
+			ok = player.readFrame(f, frame);
+		playbackSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (!ok) {
+			fprintf(stderr, "could not read back %s\n", record.c_str());
+			return 1;
+		}
+	}
+
+	int nodes = cloth.resolution() * cloth.resolution();
+	printf("{\n");
+	printf("  \"resolution\": %d,\n", cloth.resolution());
+	printf("  \"nodes\": %d,\n", nodes);
+	printf("  \"integrator\": \"%s\",\n", integrator.c_str());
+	printf("  \"isa\": \"%s\",\n", cloth_kernels::isaName(cloth.simdIsa));
+	printf("  \"threads\": %d,\n", cloth.threadCount());
+	printf("  \"layout\": \"%s\",\n", cloth.layout() == Cloth::TILED ? "tiled" : "rows");
+	printf("  \"self_collision\": %s,\n", selfCollision ? "true" : "false");
+	printf("  \"substeps\": %d,\n", done);
+	printf("  \"adaptive_step\": %s,\n", cloth.adaptiveTimeStep && cloth.integrator == Cloth::EXPLICIT_EULER ? "true" : "false");
+	printf("  \"ticks\": %d,\n", ticks);
+	if (cloth.integrator == Cloth::IMPLICIT_EULER) {
+		printf("  \"multigrid\": %s,\n", multigrid ? "true" : "false");
+		printf("  \"cg_iterations\": %.1f,\n", static_cast<double>(cgIterations) / ticks);
+	}
+	if (cloth.integrator == Cloth::EXPLICIT_EULER) {
+		printf("  \"sleeping\": %s,\n", sleeping ? "true" : "false");
+		printf("  \"awake_tiles\": %.3f,\n", cloth.awakeShare());
+		printf("  \"membrane\": %s,\n", membrane ? "true" : "false");
+	}
+	printf("  \"simulated_seconds\": %.6f,\n", ticks * cloth.simulationTick);
+	printf("  \"seconds\": %.6f,\n", seconds);
+	if (!loadState.empty())
+		printf("  \"restore_seconds\": %.6f,\n", restoreSeconds);
+	if (!record.empty()) {
+		printf("  \"recorded_frames\": %d,\n", frames);
+		printf("  \"recorded_bytes_per_frame\": %.1f,\n", static_cast<double>(recordBytes) / frames);
+		printf("  \"raw_bytes_per_frame\": %d,\n", nodes * 6 * static_cast<int>(sizeof(float)));
+		printf("  \"record_seconds\": %.6f,\n", recordSeconds);
+		printf("  \"playback_seconds\": %.6f,\n", playbackSeconds);
+	}
+	printf("  \"ns_per_node_substep\": %.4f,\n", seconds * 1e9 / (static_cast<double>(nodes) * done));
+	printf("  \"initial_energy\": %.9g,\n", initialEnergy);
+	printf("  \"final_energy\": %.9g,\n", finalEnergy);
+	printf("  \"energy_drift\": %.9g,\n", finalEnergy - initialEnergy);
+	printf("  \"deterministic\": %s,\n", deterministic ? "true" : "false");
+	printf("  \"checksum\": \"%016llx\",\n", checksum);
+	printf("  \"peak_rss_bytes\": %lld\n", peakMemory());
+	printf("}\n");
+	return 0;
+}
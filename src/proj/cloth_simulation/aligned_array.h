@@ -0,0 +1,93 @@
+#ifndef ALIGNED_ARRAY_H
+#define ALIGNED_ARRAY_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+// Fixed-size heap array whose storage starts on an Alignment-byte boundary,
+// so SIMD kernels can stream over it. Contents are zero-initialized. It can
+// also borrow memory it does not own, such as a mapped file.
+template <typename T, size_t Alignment = 32>
+class AlignedArray {
+public:
+	AlignedArray() : ptr(NULL), count(0), owned(false) {}
+	explicit AlignedArray(size_t n) : ptr(NULL), count(0), owned(false) { resize(n); }
+	~AlignedArray() { release(); }
+
+	// discards the previous contents
+	void resize(size_t n) {
+		release();
+		if (n == 0)
+			return;
+#ifdef _WIN32
+		ptr = static_cast<T*>(_aligned_malloc(n * sizeof(T), Alignment));
+#else
+		void* p = NULL;
+		if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0)
+			p = NULL;
+		ptr = static_cast<T*>(p);
+#endif
+		if (ptr == NULL)
+			throw std::bad_alloc();
+		std::memset(ptr, 0, n * sizeof(T));
+		count = n;
+		owned = true;
+	}
+
+	// uses the n values at memory, which must be aligned like the array's
+	// own storage and stay valid until the next resize
+	void borrow(T* memory, size_t n) {
+		release();
+		ptr = memory;
+		count = n;
+	}
+
+	// resizes to n and copies the values in
+	void assign(const T* values, size_t n) {
+		resize(n);
+		if (n > 0)
+			std::memcpy(ptr, values, n * sizeof(T));
+	}
+
+	void fill(const T& value) {
+		for (size_t i = 0; i < count; i++)
+			ptr[i] = value;
+	}
+
+	T* data() { return ptr; }
+	const T* data() const { return ptr; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	T& operator[](size_t i) { return ptr[i]; }
+	const T& operator[](size_t i) const { return ptr[i]; }
+
+private:
+	AlignedArray(const AlignedArray&);
+	AlignedArray& operator=(const AlignedArray&);
+
+	void release() {
+		if (ptr != NULL && owned) {
+#ifdef _WIN32
+			_aligned_free(ptr);
+#else
+			free(ptr);
+#endif
+		}
+		ptr = NULL;
+		count = 0;
+		owned = false;
+	}
+
+	T* ptr;
+	size_t count;
+	bool owned;
+};
+
+#endif
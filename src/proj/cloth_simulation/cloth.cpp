@@ -0,0 +1,1277 @@
+#include "cloth.h"
+#include "vertex_cache.h"
+
+#include <algorithm>
+#include <cmath>
+
+Cloth::Cloth(int resolution) {
+	checkpointMapping = NULL;
+	recorder = NULL;
+
+	meshResolution = std::max(resolution, 2);
+	nodeLayout = ROW_MAJOR;
+	mass = 1.0;
+	K[0] = K[1] = K[2] = 25000.0;
+	gravity = 9.8;
+	Cd = 0.5;
+	Cv = 0.5;
+	flowVelocity = glm::vec3(0.0f, 0.0f, 1.0f);
+	maxSimdIsa = simdIsa = cloth_kernels::detectIsa();
+	pool = NULL;
+	setThreadCount(std::thread::hardware_concurrency());
+	integrator = EXPLICIT_EULER;
+	explicitTimeStep = 0.001;
+	adaptiveTimeStep = true;
+	maxSubsteps = 50;
+	maxStrainPerStep = 0.01;
+	lastSubsteps = 0;
+	implicitTimeStep = 1.0 / 60.0;
+	multigrid = false;
+	simulationTick = 0.01;
+	pinned = true;
+	selfCollision = false;
+	continuousCollision = true;
+	impactPasses = 4;
+	horizontal = false;
+	deterministic = false;
+	sleeping = false;
+	sleepSpeed = 0.01;
+	sleepStrainRate = 0.25;
+	sleepSubsteps = 200;
+	// about what the structural and shear springs give together
+	membrane = false;
+	warpStiffness = 50000.0;
+	weftStiffness = 50000.0;
+	shearStiffness = 12500.0;
+	cgMaxIterations = 100;
+	cgTolerance = 1e-4;
+	cgIterations = 0;
+	xpbdTimeStep = 1.0 / 60.0;
+	xpbdIterations = 20;
+	compliance[0] = 1.0 / K[0];
+	compliance[1] = 1.0 / K[1];
+	compliance[2] = 1.0 / K[2];
+	initMesh();
+}
+
+Cloth::~Cloth() {
+	stopSimulation();
+	stopRecording();
+	releaseCheckpoint();
+	releaseGridLevels();
+	delete pool;
+}
+
+// rebuilds the cloth at a new grid size, the simulation starts over
+void Cloth::setResolution(int resolution) {
+	bool running = stopSimulation();
+	meshResolution = std::max(resolution, 2);
+	initMesh();
+	if (running)
+		startSimulation();
+}
+
+void Cloth::setLayout(Layout layout) {
+	bool running = stopSimulation();
+	nodeLayout = layout;
+	initMesh();
+	if (running)
+		startSimulation();
+}
+
+void Cloth::setThreadCount(int threads) {
+	bool running = stopSimulation();
+	delete pool;
+	pool = new ThreadPool(threads > 0 ? threads : 1);
+	if (running)
+		startSimulation();
+}
+
+// publishes the current state right away, so there is always a snapshot
+// of the current mesh to draw, and starts ticking. The settings may have
+// changed while it was stopped, so the whole cloth starts out awake.
+void Cloth::startSimulation() {
+	if (physics.isRunning())
+		return;
+	wakeAll();
+	publishSnapshot(false);
+	physics.start(simulationTick, [this] {
+		advance(simulationTick);
+		publishSnapshot(true);
+	});
+}
+
+// only finished ticks are recorded, the state a restarted simulation
+// publishes first already is
+void Cloth::publishSnapshot(bool finishedTick) {
+	physics.publish<Snapshot>(snapshots, [&](Snapshot& snapshot) {
+		snapshot.vertices.resize(meshResolution * meshResolution * 6);
+		copyVertices(snapshot.vertices.data());
+		snapshot.cgIterations = cgIterations;
+		snapshot.substeps = lastSubsteps;
+		snapshot.awake = awakeShare();
+		if (recorder && finishedTick)
+			recorder->append(snapshot.vertices.data());
+	});
+}
+
+// the snapshot is row by row whatever the layout
+void Cloth::copyVertices(float* vertices) {
+	parallelNodes([&](int begin, int end) {
+		if (nodeLayout == ROW_MAJOR) {
+			interleaveVertices(vertexPosition, vertexNormal, begin, end, vertices);
+			return;
+		}
+		for (int id = begin; id < end; id++) {
+			float* vertex = vertices + tiledNode[id] * 6;
+			vertex[0] = vertexPosition[0][id];
+			vertex[1] = vertexPosition[1][id];
+			vertex[2] = vertexPosition[2][id];
+			vertex[3] = vertexNormal[0][id];
+			vertex[4] = vertexNormal[1][id];
+			vertex[5] = vertexNormal[2][id];
+		}
+	});
+}
+
+bool Cloth::startRecording(const std::string& path) {
+	bool running = stopSimulation();
+	stopRecording();
+	recorder = new VertexCacheWriter();
+	if (!recorder->open(path, meshResolution, simulationTick)) {
+		stopRecording();
+		if (running)
+			startSimulation();
+		return false;
+	}
+	publishSnapshot(true);
+	if (running)
+		startSimulation();
+	return true;
+}
+
+// returns whether every frame made it to the file
+bool Cloth::stopRecording() {
+	if (!recorder)
+		return true;
+	bool running = stopSimulation();
+	bool ok = recorder->close();
+	delete recorder;
+	recorder = NULL;
+	if (running)
+		startSimulation();
+	return ok;
+}
+
+// the frame is split into substeps no longer than the integrator allows
+int Cloth::advance(float frameTime) {
+	float maxStep = explicitTimeStep;
+	if (integrator == IMPLICIT_EULER)
+		maxStep = implicitTimeStep;
+	else if (integrator == XPBD)
+		maxStep = xpbdTimeStep;
+	else if (adaptiveTimeStep)
+		maxStep = stableTimeStep();
+	int n = static_cast<int>(ceil(frameTime / maxStep - 1e-4));
+	if (integrator == EXPLICIT_EULER && adaptiveTimeStep)
+		n = std::min(std::max(n, 1), std::max(maxSubsteps, 1));
+	lastSubsteps = n;
+	float timeStep = frameTime / n;
+	for (int i = 0; i < n; i++) {
+		if (!collider.empty()) {
+			parallelNodes([&](int begin, int end) {
+				for (int c = 0; c < 3; c++)
+					std::copy(&vertexPosition[c][0] + begin, &vertexPosition[c][0] + end, &substepStart[c][0] + begin);
+			});
+		}
+		if (integrator == IMPLICIT_EULER)
+			simulateImplicit(timeStep);
+		else if (integrator == XPBD)
+			simulateXPBD(timeStep);
+		else
+			simulate(timeStep);
+		if (selfCollision)
+			resolveSelfCollisions(timeStep);
+		if (!collider.empty())
+			resolveColliderContacts();
+		if (!collider.empty() && continuousCollision) {
+			for (int pass = 0; pass < impactPasses && resolveColliderImpacts() > 0; pass++)
+				;
+		}
+		if (!colliderField.empty())
+			resolveFieldContacts();
+	}
+	computeNormals();
+	return n;
+}
+
+// kinetic plus gravitational plus spring energy. The pinned nodes do not
+// move, whatever the explicit integrator leaves in their velocity.
+double Cloth::computeEnergy() {
+	double energy = parallelSum([&](int begin, int end) {
+		double sum = 0.0;
+		for (int i = begin; i < end; i++) {
+			float v2 = vertexVelocity[0][i] * vertexVelocity[0][i] + vertexVelocity[1][i] * vertexVelocity[1][i]
+				+ vertexVelocity[2][i] * vertexVelocity[2][i];
+			if (!isPinned(i))
+				sum += 0.5 * mass * v2;
+			sum += mass * gravity * vertexPosition[1][i];
+		}
+		return sum;
+	});
+	bool triangles = hasMembrane() && integrator == EXPLICIT_EULER;
+	for (int s = 0; s < static_cast<int>(springA.size()); s++) {
+		if (triangles && springType[s] != 2)
+			continue;
+		int a = springA[s], b = springB[s];
+		glm::vec3 d(vertexPosition[0][a] - vertexPosition[0][b], vertexPosition[1][a] - vertexPosition[1][b],
+			vertexPosition[2][a] - vertexPosition[2][b]);
+		double stretch = glm::length(d) - springRest[s];
+		energy += 0.5 * K[springType[s]] * stretch * stretch;
+	}
+	if (!triangles)
+		return energy;
+	// the membrane energy of accumulateMembrane
+	int n = meshResolution;
+	for (int i = 0; i + 1 < n; i++) {
+		for (int j = 0; j + 1 < n; j++) {
+			int id = i * n + j;
+			glm::vec3 x[4] = { load3(vertexPosition, id), load3(vertexPosition, id + 1), load3(vertexPosition, id + n + 1),
+				load3(vertexPosition, id + n) };
+			int corner[2][3] = { { 0, 1, 2 }, { 0, 2, 3 } };
+			for (int t = 0; t < 2; t++) {
+				const AlignedArray<float>* rest = membraneRest + 5 * t;
+				glm::vec3 e1 = x[corner[t][1]] - x[corner[t][0]], e2 = x[corner[t][2]] - x[corner[t][0]];
+				glm::vec3 u = e1 * rest[0][id] + e2 * rest[2][id], v = e1 * rest[1][id] + e2 * rest[3][id];
+				double euu = 0.5 * (glm::dot(u, u) - 1.0), evv = 0.5 * (glm::dot(v, v) - 1.0), euv = 0.5 * glm::dot(u, v);
+				energy += rest[4][id] * (0.5 * warpStiffness * euu * euu + 0.5 * weftStiffness * evv * evv + 2.0 * shearStiffness * euv * euv);
+			}
+		}
+	}
+	return energy;
+}
+
+static unsigned long long hashBytes(unsigned long long hash, const void* data, size_t size) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t k = 0; k < size; k++)
+		hash = (hash ^ bytes[k]) * 1099511628211ull;
+	return hash;
+}
+
+// FNV-1a of every band, then of the band hashes in order; the nodes are
+// hashed row by row in either layout
+unsigned long long Cloth::stateChecksum() {
+	const unsigned long long basis = 14695981039346656037ull;
+	std::vector<unsigned long long> bandHash(bandCount());
+	parallelNodes([&](int begin, int end) {
+		unsigned long long hash = basis;
+		std::vector<float> rows;
+		auto byRows = [&](const AlignedArray<float>& values) {
+			if (nodeLayout == ROW_MAJOR)
+				return values.data() + begin;
+			rows.resize(end - begin);
+			for (int node = begin; node < end; node++)
+				rows[node - begin] = values[tiledIndex[node]];
+			return static_cast<const float*>(rows.data());
+		};
+		for (int c = 0; c < 3; c++) {
+			hash = hashBytes(hash, byRows(vertexPosition[c]), (end - begin) * sizeof(float));
+			hash = hashBytes(hash, byRows(vertexVelocity[c]), (end - begin) * sizeof(float));
+		}
+		bandHash[begin / (bandRows * meshResolution)] = hash;
+	});
+	return hashBytes(basis, bandHash.data(), bandHash.size() * sizeof(unsigned long long));
+}
+
+
+void Cloth::initMesh() {
+	// code
+	//std::cout << "build mesh" << std::endl;
+
+	restLength[0] = 4.0 / static_cast<float>(meshResolution - 1);
+	restLength[1] = sqrt(2.0) * 4.0 / static_cast<float>(meshResolution - 1);
+	restLength[2] = 2.0 * restLength[0];
+
+	for (int c = 0; c < 3; c++) {
+		vertexPosition[c].resize(meshResolution * meshResolution);
+		vertexVelocity[c].resize(meshResolution * meshResolution);
+		vertexNormal[c].resize(meshResolution * meshResolution);
+		vertexForce[c].resize(meshResolution * meshResolution);
+	}
+	for (int c = 0; c < 6; c++)
+		faceNormal[c].resize(meshResolution * meshResolution + meshResolution + 1);
+	initLayout();
+	for (int i = 0; i < meshResolution; i++) {
+		for (int j = 0; j < meshResolution; j++) {
+			glm::vec3 initPosition(-2.0 + 4.0*j / static_cast<float>(meshResolution - 1), -2.0 + 4.0*i / static_cast<float>(meshResolution - 1), 0.0);
+			if (horizontal)
+				initPosition = glm::vec3(initPosition.x, 2.0, initPosition.y);
+			setPosition(i, j, initPosition);
+		}
+	}
+	computeNormals();
+	initSprings();
+	initConstraintColors();
+	initSelfCollision();
+	releaseCheckpoint();
+	stopRecording();
+	wakeAll();
+}
+
+// The tiled layout keeps band after band like the rows, and within a band
+// tile after tile, each one row by row: node (i, j) of a band of rows rows
+// starting at row i0, in the tile of width columns starting at column j0,
+// is stored at i0 * resolution + j0 * rows + (i - i0) * width + j - j0.
+// A band's nodes stay the ones it holds by rows, so everything that walks
+// the nodes band by band works in either layout.
+void Cloth::initLayout() {
+	int n = meshResolution;
+	bool tiled = nodeLayout == TILED;
+	tiledIndex.assign(tiled ? n * n : 0, 0);
+	tiledNode.assign(tiled ? n * n : 0, 0);
+	for (int c = 0; c < 3; c++) {
+		gridPosition[c].resize(tiled ? n * n : 0);
+		gridNormal[c].resize(tiled ? n * n : 0);
+	}
+	if (!tiled)
+		return;
+	for (int i = 0; i < n; i++) {
+		int i0 = i / bandRows * bandRows, rows = std::min(i0 + bandRows, n) - i0;
+		for (int j = 0; j < n; j++) {
+			int j0 = j / tileColumns * tileColumns, width = std::min(j0 + tileColumns, n) - j0;
+			int index = i0 * n + j0 * rows + (i - i0) * width + j - j0;
+			tiledIndex[i * n + j] = index;
+			tiledNode[index] = i * n + j;
+		}
+	}
+}
+
+// Each spring is stored once from its lower-index end a to b = a + offset.
+// Springs are ordered by row, then by direction, then by column, so every
+// (row, direction) pair forms one run the kernels can stream over.
+// 0.Structural: [i, j+1], [i+1, j]
+// 1.Shear: [i+1, j+1], [i+1, j-1]
+// 2.Flexion: [i, j+2], [i+2, j]
+void appendGridSprings(int resolution, int firstNode, const float restLength[3], std::vector<int>& springA,
+	std::vector<int>& springB, std::vector<float>& springRest, std::vector<int>& springType,
+	std::vector<SpringRun>& springRuns, std::vector<int>& rowRuns) {
+	const int directions = 6;
+	int di[directions] = { 0, 1, 1, 1, 0, 2 }, dj[directions] = { 1, 0, 1, -1, 2, 0 };
+	int type[directions] = { 0, 0, 1, 1, 2, 2 };
+
+	for (int i = 0; i < resolution; i++) {
+		rowRuns.push_back(static_cast<int>(springRuns.size()));
+		for (int d = 0; d < directions; d++) {
+			if (i + di[d] >= resolution)
+				continue;
+			int jBegin = dj[d] < 0 ? -dj[d] : 0;
+			int jEnd = dj[d] > 0 ? resolution - dj[d] : resolution;
+			if (jEnd <= jBegin)
+				continue;
+			SpringRun run;
+			run.first = static_cast<int>(springA.size());
+			run.count = jEnd - jBegin;
+			springRuns.push_back(run);
+			for (int j = jBegin; j < jEnd; j++) {
+				springA.push_back(firstNode + i * resolution + j);
+				springB.push_back(firstNode + (i + di[d]) * resolution + j + dj[d]);
+				springRest.push_back(restLength[type[d]]);
+				springType.push_back(type[d]);
+			}
+		}
+	}
+}
+
+void Cloth::initSprings() {
+	std::vector<int> a, b, type;
+	std::vector<float> rest;
+	springRuns.clear();
+	rowRuns.clear();
+	appendGridSprings(meshResolution, 0, restLength, a, b, rest, type, springRuns, rowRuns);
+	rowRuns.push_back(static_cast<int>(springRuns.size()));
+	// tiled, the springs keep their order and a run ends where its nodes
+	// leave the row of their tile
+	if (nodeLayout == TILED) {
+		std::vector<SpringRun> runs;
+		std::vector<int> rows;
+		for (int i = 0; i < meshResolution; i++) {
+			rows.push_back(static_cast<int>(runs.size()));
+			for (int r = rowRuns[i]; r < rowRuns[i + 1]; r++) {
+				for (int s = springRuns[r].first; s < springRuns[r].first + springRuns[r].count; s++) {
+					a[s] = tiledIndex[a[s]];
+					b[s] = tiledIndex[b[s]];
+					if (s > springRuns[r].first && a[s] == a[s - 1] + 1 && b[s] == b[s - 1] + 1) {
+						runs.back().count++;
+						continue;
+					}
+					SpringRun run;
+					run.first = s;
+					run.count = 1;
+					runs.push_back(run);
+				}
+			}
+		}
+		rows.push_back(static_cast<int>(runs.size()));
+		springRuns.swap(runs);
+		rowRuns.swap(rows);
+	}
+	int count = static_cast<int>(a.size());
+	springA.assign(a.data(), count);
+	springB.assign(b.data(), count);
+	springRest.assign(rest.data(), count);
+	springType.assign(type.data(), count);
+	initNodeStiffness();
+	initMembrane();
+}
+
+void Cloth::initNodeStiffness() {
+	int count = static_cast<int>(springA.size());
+	std::vector<float> nodeStiffness(meshResolution * meshResolution, 0.0f), bendingStiffness(nodeStiffness);
+	for (int k = 0; k < count; k++) {
+		nodeStiffness[springA[k]] += K[springType[k]];
+		nodeStiffness[springB[k]] += K[springType[k]];
+		if (springType[k] == 2) {
+			bendingStiffness[springA[k]] += K[2];
+			bendingStiffness[springB[k]] += K[2];
+		}
+	}
+	maxNodeStiffness = *std::max_element(nodeStiffness.begin(), nodeStiffness.end());
+	maxBendingStiffness = *std::max_element(bendingStiffness.begin(), bendingStiffness.end());
+}
+
+// The rest state of every membrane triangle is taken once, from the grid
+// laid out flat at the structural rest length: node (i,j) sits at (j, i)
+// times the rest length in material coordinates. For the time step every
+// node also gets the Gershgorin bound of its triangles' stiffness per unit
+// stiffness, area |g_i| (|g_0| + |g_1| + |g_2|) with g the gradients of the
+// linear shape functions, the rows of the inverse rest matrix.
+void Cloth::initMembrane() {
+	int n = meshResolution;
+	for (int c = 0; c < 10; c++)
+		membraneRest[c].resize(n * n);
+	std::vector<float> nodeStiffness(n * n, 0.0f);
+	for (int i = 0; i + 1 < n; i++) {
+		for (int j = 0; j + 1 < n; j++) {
+			int id = i * n + j;
+			glm::vec2 x[4] = { glm::vec2(j, i), glm::vec2(j + 1, i), glm::vec2(j + 1, i + 1), glm::vec2(j, i + 1) };
+			int corner[2][3] = { { 0, 1, 2 }, { 0, 2, 3 } };
+			int node[4] = { id, id + 1, id + n + 1, id + n };
+			for (int t = 0; t < 2; t++) {
+				glm::vec2 e1 = (x[corner[t][1]] - x[corner[t][0]]) * restLength[0];
+				glm::vec2 e2 = (x[corner[t][2]] - x[corner[t][0]]) * restLength[0];
+				glm::mat2 inverse = glm::inverse(glm::mat2(e1, e2));
+				float area = 0.5f * std::fabs(e1.x * e2.y - e1.y * e2.x);
+				// glm matrices are indexed [column][row]
+				membraneRest[5 * t + 0][id] = inverse[0][0];
+				membraneRest[5 * t + 1][id] = inverse[1][0];
+				membraneRest[5 * t + 2][id] = inverse[0][1];
+				membraneRest[5 * t + 3][id] = inverse[1][1];
+				membraneRest[5 * t + 4][id] = area;
+
+				glm::vec2 g[3];
+				g[1] = glm::vec2(inverse[0][0], inverse[1][0]);
+				g[2] = glm::vec2(inverse[0][1], inverse[1][1]);
+				g[0] = -g[1] - g[2];
+				float sum = glm::length(g[0]) + glm::length(g[1]) + glm::length(g[2]);
+				for (int k = 0; k < 3; k++)
+					nodeStiffness[node[corner[t][k]]] += area * glm::length(g[k]) * sum;
+			}
+		}
+	}
+	maxMembraneStiffness = *std::max_element(nodeStiffness.begin(), nodeStiffness.end());
+
+	bendingRuns.clear();
+	bendingRowRuns.clear();
+	for (int i = 0; i < n; i++) {
+		bendingRowRuns.push_back(static_cast<int>(bendingRuns.size()));
+		for (int r = rowRuns[i]; r < rowRuns[i + 1]; r++) {
+			if (springType[springRuns[r].first] == 2)
+				bendingRuns.push_back(springRuns[r]);
+		}
+	}
+	bendingRowRuns.push_back(static_cast<int>(bendingRuns.size()));
+}
+
+void Cloth::initConstraintColors() {
+	int springs = static_cast<int>(springA.size());
+	int nodes = meshResolution * meshResolution;
+	std::vector<unsigned long long> nodeColors(nodes, 0);
+	std::vector<int> color(springs);
+	int colors = 0;
+	for (int s = 0; s < springs; s++) {
+		unsigned long long used = nodeColors[springA[s]] | nodeColors[springB[s]];
+		int c = 0;
+		while (used & (1ull << c))
+			c++;
+		color[s] = c;
+		nodeColors[springA[s]] |= 1ull << c;
+		nodeColors[springB[s]] |= 1ull << c;
+		colors = std::max(colors, c + 1);
+	}
+
+	// counting sort by color, springs keep their order within a color
+	colorOffsets.assign(colors + 1, 0);
+	for (int s = 0; s < springs; s++)
+		colorOffsets[color[s] + 1]++;
+	for (int c = 0; c < colors; c++)
+		colorOffsets[c + 1] += colorOffsets[c];
+	std::vector<int> cursor(colorOffsets.begin(), colorOffsets.end() - 1);
+	colorOrder.resize(springs);
+	for (int s = 0; s < springs; s++)
+		colorOrder[cursor[color[s]]++] = s;
+	constraintLambda.resize(springs);
+}
+
+glm::vec3 Cloth::getPosition(int i, int j) {
+	int index = nodeIndex(i, j);
+	return glm::vec3(vertexPosition[0][index], vertexPosition[1][index], vertexPosition[2][index]);
+}
+
+void Cloth::setPosition(int i, int j, glm::vec3 value) {
+	int index = nodeIndex(i, j);
+	vertexPosition[0][index] = value.x;
+	vertexPosition[1][index] = value.y;
+	vertexPosition[2][index] = value.z;
+}
+
+glm::vec3 Cloth::getNormal(int i, int j) {
+	int index = nodeIndex(i, j);
+	return glm::vec3(vertexNormal[0][index], vertexNormal[1][index], vertexNormal[2][index]);
+}
+
+void Cloth::setNormal(int i, int j, glm::vec3 value) {
+	int index = nodeIndex(i, j);
+	vertexNormal[0][index] = value.x;
+	vertexNormal[1][index] = value.y;
+	vertexNormal[2][index] = value.z;
+}
+
+glm::vec3 Cloth::getVelocity(int i, int j) {
+	int index = nodeIndex(i, j);
+	return glm::vec3(vertexVelocity[0][index], vertexVelocity[1][index], vertexVelocity[2][index]);
+}
+
+void Cloth::setVelocity(int i, int j, glm::vec3 value) {
+	int index = nodeIndex(i, j);
+	vertexVelocity[0][index] = value.x;
+	vertexVelocity[1][index] = value.y;
+	vertexVelocity[2][index] = value.z;
+}
+
+ParticleView Cloth::particleView() {
+	ParticleView p;
+	p.px = vertexPosition[0].data(); p.py = vertexPosition[1].data(); p.pz = vertexPosition[2].data();
+	p.vx = vertexVelocity[0].data(); p.vy = vertexVelocity[1].data(); p.vz = vertexVelocity[2].data();
+	p.nx = vertexNormal[0].data(); p.ny = vertexNormal[1].data(); p.nz = vertexNormal[2].data();
+	p.fx = vertexForce[0].data(); p.fy = vertexForce[1].data(); p.fz = vertexForce[2].data();
+	return p;
+}
+
+SpringView Cloth::springView() {
+	SpringView springs;
+	springs.a = springA.data();
+	springs.b = springB.data();
+	springs.rest = springRest.data();
+	springs.type = springType.data();
+	return springs;
+}
+
+MembraneView Cloth::membraneView() {
+	MembraneView m;
+	m.a00 = membraneRest[0].data(); m.a01 = membraneRest[1].data(); m.a10 = membraneRest[2].data(); m.a11 = membraneRest[3].data();
+	m.aArea = membraneRest[4].data();
+	m.b00 = membraneRest[5].data(); m.b01 = membraneRest[6].data(); m.b10 = membraneRest[7].data(); m.b11 = membraneRest[8].data();
+	m.bArea = membraneRest[9].data();
+	return m;
+}
+
+FaceView Cloth::faceView() {
+	int padding = meshResolution + 1;
+	FaceView faces;
+	faces.ax = faceNormal[0].data() + padding; faces.ay = faceNormal[1].data() + padding; faces.az = faceNormal[2].data() + padding;
+	faces.bx = faceNormal[3].data() + padding; faces.by = faceNormal[4].data() + padding; faces.bz = faceNormal[5].data() + padding;
+	return faces;
+}
+
+ForceParams Cloth::forceParams(float timeStep) {
+	ForceParams params;
+	for (int t = 0; t < 3; t++)
+		params.flowVelocity[t] = flowVelocity[t];
+	params.mass = mass;
+	params.gravity = gravity;
+	params.Cd = Cd;
+	params.Cv = Cv;
+	params.stepSize = timeStep;
+	return params;
+}
+
+// Every triangle normal is computed once, then each node sums the six
+// triangles around it. Both passes stream along the rows, so tiled they get
+// the positions row by row and give back the normals the same way.
+void Cloth::computeNormals() {
+	ParticleView particles = particleView();
+	bool tiled = nodeLayout == TILED;
+	if (tiled) {
+		parallelNodes([&](int begin, int end) {
+			for (int c = 0; c < 3; c++) {
+				for (int id = begin; id < end; id++)
+					gridPosition[c][tiledNode[id]] = vertexPosition[c][id];
+			}
+		});
+		particles.px = gridPosition[0].data(); particles.py = gridPosition[1].data(); particles.pz = gridPosition[2].data();
+		particles.nx = gridNormal[0].data(); particles.ny = gridNormal[1].data(); particles.nz = gridNormal[2].data();
+	}
+	FaceView faces = faceView();
+	parallelNodes([&](int begin, int end) {
+		int rowBegin = begin / meshResolution, rowEnd = std::min(end / meshResolution, meshResolution - 1);
+		cloth_kernels::faceNormals(simdIsa, particles, faces, meshResolution, rowBegin, rowEnd);
+	});
+	parallelNodes([&](int begin, int end) {
+		cloth_kernels::gatherNormals(simdIsa, particles, faces, meshResolution, begin, end);
+		for (int c = 0; tiled && c < 3; c++) {
+			for (int id = begin; id < end; id++)
+				vertexNormal[c][id] = gridNormal[c][tiledNode[id]];
+		}
+	});
+}
+
+// Symplectic Euler stays stable while the step is below 2 / omega for the
+// highest frequency omega of the mesh. By Gershgorin omega^2 is at most
+// twice the largest stiffness around a node over the mass; a spring
+// compressed below half its rest length is stiffer across than along, by
+// rest / length - 1. The fastest stretching spring also limits the step so
+// that no spring changes its length by more than maxStrainPerStep at once.
+float Cloth::stableTimeStep() {
+	// the springs of a tile reach into the tiles beside and below it and
+	// stay put while all of them sleep
+	std::vector<char> awake, active;
+	awakeTiles(awake);
+	spreadTiles(awake, 0, 1, active);
+	int bands = bandCount();
+	std::vector<float> bandFactor(bands, 1.0f), bandRate(bands, 0.0f);
+	parallelTiles(active, [&](int rowBegin, int rowEnd, int columnBegin, int columnEnd) {
+		float& factor = bandFactor[rowBegin / bandRows];
+		float& rate = bandRate[rowBegin / bandRows];
+		std::vector<SpringRun> runs;
+		cutRuns(springRuns, rowRuns, rowBegin, rowEnd, columnBegin, columnEnd, runs);
+		for (size_t r = 0; r < runs.size(); r++) {
+			for (int s = runs[r].first; s < runs[r].first + runs[r].count; s++) {
+				glm::vec3 d = load3(vertexPosition, springB[s]) - load3(vertexPosition, springA[s]);
+				float length = glm::length(d);
+				if (length == 0.0f)
+					continue;
+				factor = std::max(factor, springRest[s] / length - 1.0f);
+				rate = std::max(rate, strainRate(s, d, length));
+			}
+		}
+	});
+	float factor = *std::max_element(bandFactor.begin(), bandFactor.end());
+	float rate = *std::max_element(bandRate.begin(), bandRate.end());
+
+	// a margin below the bound, which only holds for the state it was taken at
+	const float safety = 0.8f;
+	float stiffness = maxNodeStiffness;
+	if (hasMembrane())
+		stiffness = maxBendingStiffness + maxMembraneStiffness * std::max(std::max(warpStiffness, weftStiffness), 2.0f * shearStiffness);
+	float timeStep = safety * 2.0f / sqrt(2.0f * stiffness * factor / mass);
+	if (rate > 0.0f)
+		timeStep = std::min(timeStep, maxStrainPerStep / rate);
+	return timeStep;
+}
+
+void Cloth::simulate(float stepSize) {
+	// code
+	glm::vec3 pin1 = getPosition(meshResolution - 1, 0), pin2 = getPosition(meshResolution - 1, meshResolution - 1);
+	ParticleView particles = particleView();
+	ForceParams params = forceParams(stepSize);
+	SpringView springs = springView();
+
+	// Sleeping tiles next to an awake one get their forces too: the ones
+	// their neighbours now pull faster than sleepSpeed wake up, the others
+	// drop the velocity and stay where they are. The springs of a tile
+	// reach into the tiles beside and below it, so they run when any of
+	// those is computed, and the forces they leave on a tile that is not are
+	// cleared.
+	std::vector<char> awake, computed, springTiles, reached;
+	awakeTiles(awake);
+	spreadTiles(awake, 1, 1, computed);
+	spreadTiles(computed, 0, 1, springTiles);
+	spreadTiles(springTiles, 1, 0, reached);
+	int tiles = tileCount();
+	std::vector<char> stale(tiles);
+	for (int t = 0; t < tiles; t++)
+		stale[t] = reached[t] && !computed[t];
+
+	// with the membrane only the bending springs stay, and the triangles of
+	// the tiles follow them; the last row has no quads below it
+	bool quads = hasMembrane();
+	MembraneView triangles = membraneView();
+	float stiffness[3] = { warpStiffness, weftStiffness, shearStiffness };
+	const std::vector<SpringRun>& runs = quads ? bendingRuns : springRuns;
+	const std::vector<int>& rows = quads ? bendingRowRuns : rowRuns;
+	parallelTiles(springTiles, [&](int rowBegin, int rowEnd, int columnBegin, int columnEnd) {
+		std::vector<SpringRun> cut;
+		cutRuns(runs, rows, rowBegin, rowEnd, columnBegin, columnEnd, cut);
+		cloth_kernels::accumulateSprings(simdIsa, particles, springs, K, cut.data(), static_cast<int>(cut.size()));
+		if (quads) {
+			cloth_kernels::accumulateMembrane(simdIsa, particles, triangles, stiffness, meshResolution,
+				rowBegin, std::min(rowEnd, meshResolution - 1), columnBegin, columnEnd);
+		}
+	});
+
+	parallelNodes(stale, [&](int begin, int end) {
+		for (int c = 0; c < 3; c++)
+			std::fill(&vertexForce[c][0] + begin, &vertexForce[c][0] + end, 0.0f);
+	});
+
+	parallelNodes(computed, [&](int begin, int end) {
+		cloth_kernels::integrateVelocities(simdIsa, particles, params, begin, end);
+	});
+	if (sleeping && std::count(computed.begin(), computed.end(), 1) > 0)
+		updateSleep(computed);
+
+	// Notice that the updated velocity above is used for better numerical stability.
+	std::vector<char> moving(tiles);
+	for (int t = 0; t < tiles; t++)
+		moving[t] = computed[t] && (!sleeping || !tileAsleep[t]);
+	parallelNodes(moving, [&](int begin, int end) {
+		cloth_kernels::integratePositions(simdIsa, particles, stepSize, begin, end);
+	});
+	
+	glm::vec3 newPin1(pin1.x + stepSize*10, pin1.y, pin1.z);
+	glm::vec3 newPin2(pin2.x + stepSize*10, pin2.y, pin2.z);
+
+	if (pinned) {
+		setPosition(meshResolution - 1, 0, pin1);
+		setPosition(meshResolution - 1, meshResolution - 1, pin2);
+	}
+}
+
+// Every computed tile checks whether it is quiet: its nodes slower than
+// sleepSpeed and its springs changing length slower than sleepStrainRate.
+// One quiet for sleepSubsteps substeps in a row falls asleep and drops its
+// velocity, any other substep wakes it. The velocities are only dropped
+// once every tile has measured its springs, which reach into other tiles.
+void Cloth::updateSleep(const std::vector<char>& computed) {
+	int n = meshResolution, columns = rowTiles();
+	pool->run(bandCount(), [&](int band) {
+		int rowBegin = band * bandRows, rowEnd = std::min(rowBegin + bandRows, n);
+		std::vector<SpringRun> runs;
+		for (int tile = band * columns; tile < (band + 1) * columns; tile++) {
+			if (!computed[tile])
+				continue;
+			int columnBegin = tile % columns * tileColumns, columnEnd = std::min(columnBegin + tileColumns, n);
+			// pinned nodes are put back after every substep, whatever their velocity
+			float fastest = 0.0f;
+			tileNodes(rowBegin, rowEnd, columnBegin, columnEnd, [&](int begin, int end) {
+				for (int id = begin; id < end; id++) {
+					if (!isPinned(id))
+						fastest = std::max(fastest, glm::dot(load3(vertexVelocity, id), load3(vertexVelocity, id)));
+				}
+			});
+			bool quiet = fastest <= sleepSpeed * sleepSpeed;
+			runs.clear();
+			if (quiet)
+				cutRuns(springRuns, rowRuns, rowBegin, rowEnd, columnBegin, columnEnd, runs);
+			// the strain rate of strainRate, squared to spare the root
+			for (size_t r = 0; quiet && r < runs.size(); r++) {
+				for (int s = runs[r].first; quiet && s < runs[r].first + runs[r].count; s++) {
+					glm::vec3 d = load3(vertexPosition, springB[s]) - load3(vertexPosition, springA[s]);
+					glm::vec3 va = isPinned(springA[s]) ? glm::vec3(0.0f) : load3(vertexVelocity, springA[s]);
+					glm::vec3 vb = isPinned(springB[s]) ? glm::vec3(0.0f) : load3(vertexVelocity, springB[s]);
+					float rate = glm::dot(vb - va, d), limit = sleepStrainRate * springRest[s];
+					quiet = rate * rate <= limit * limit * glm::dot(d, d);
+				}
+			}
+			if (!quiet)
+				quietSubsteps[tile] = 0;
+			else if (!tileAsleep[tile])
+				quietSubsteps[tile]++;
+			tileAsleep[tile] = quiet && (tileAsleep[tile] || quietSubsteps[tile] >= sleepSubsteps);
+		}
+	});
+
+	std::vector<char> frozen(computed.size());
+	for (size_t t = 0; t < frozen.size(); t++)
+		frozen[t] = computed[t] && tileAsleep[t];
+	parallelNodes(frozen, [&](int begin, int end) {
+		for (int c = 0; c < 3; c++)
+			std::fill(&vertexVelocity[c][0] + begin, &vertexVelocity[c][0] + end, 0.0f);
+	});
+}
+
+// of spring s along d, length long: how fast it stretches, in rest lengths
+// per second; the explicit integrator leaves the velocity of pinned nodes
+// stale
+float Cloth::strainRate(int s, glm::vec3 d, float length) {
+	glm::vec3 va = isPinned(springA[s]) ? glm::vec3(0.0f) : load3(vertexVelocity, springA[s]);
+	glm::vec3 vb = isPinned(springB[s]) ? glm::vec3(0.0f) : load3(vertexVelocity, springB[s]);
+	return std::fabs(glm::dot(vb - va, d)) / (length * springRest[s]);
+}
+
+void Cloth::wakeAll() {
+	tileAsleep.assign(tileCount(), 0);
+	quietSubsteps.assign(tileCount(), 0);
+}
+
+bool Cloth::isAsleep(int index) {
+	return sleeping && tileAsleep[tileOf(index)];
+}
+
+// one flag per tile, all set unless sleeping
+void Cloth::awakeTiles(std::vector<char>& tiles) {
+	int count = tileCount();
+	tiles.resize(count);
+	for (int t = 0; t < count; t++)
+		tiles[t] = !sleeping || !tileAsleep[t];
+}
+
+// result[t] is set where tiles is set on any tile from bandsUp bands above
+// t to bandsDown bands below it and from one tile left of it to one right
+void Cloth::spreadTiles(const std::vector<char>& tiles, int bandsUp, int bandsDown, std::vector<char>& result) {
+	result.assign(tiles.size(), 0);
+	// a cloth that sleeps whole is the common case, and it spreads nowhere
+	if (std::find(tiles.begin(), tiles.end(), 1) == tiles.end())
+		return;
+	int bands = bandCount(), columns = rowTiles();
+	// across the band first, then from the bands around
+	std::vector<char> wide(tiles.size(), 0);
+	for (int t = 0; t < static_cast<int>(tiles.size()); t++) {
+		int c = t % columns;
+		wide[t] = tiles[t] || (c > 0 && tiles[t - 1]) || (c + 1 < columns && tiles[t + 1]);
+	}
+	for (int b = 0; b < bands; b++) {
+		for (int nb = std::max(b - bandsDown, 0); nb <= std::min(b + bandsUp, bands - 1); nb++) {
+			for (int c = 0; c < columns; c++)
+				result[nb * columns + c] |= wide[b * columns + c];
+		}
+	}
+}
+
+float Cloth::awakeShare() {
+	std::vector<char> awake;
+	awakeTiles(awake);
+	return static_cast<float>(std::count(awake.begin(), awake.end(), 1)) / awake.size();
+}
+
+int Cloth::bandCount(int resolution) {
+	return (resolution + bandRows - 1) / bandRows;
+}
+
+int Cloth::bandCount() {
+	return bandCount(meshResolution);
+}
+
+// tiles across one band
+int Cloth::rowTiles() {
+	return (meshResolution + tileColumns - 1) / tileColumns;
+}
+
+int Cloth::tileCount() {
+	return bandCount() * rowTiles();
+}
+
+int Cloth::tileOf(int index) {
+	index = gridIndex(index);
+	return index / (bandRows * meshResolution) * rowTiles() + index % meshResolution / tileColumns;
+}
+
+// fn(columnBegin, columnEnd) on the columns of the tiles of band whose flag
+// is set, neighbouring tiles in one call
+void Cloth::forTileColumns(const std::vector<char>& tiles, int band, const std::function<void(int, int)>& fn) {
+	int columns = rowTiles();
+	const char* flags = tiles.data() + band * columns;
+	for (int c = 0; c < columns; c++) {
+		if (!flags[c])
+			continue;
+		int last = c;
+		while (last + 1 < columns && flags[last + 1])
+			last++;
+		fn(c * tileColumns, std::min((last + 1) * tileColumns, meshResolution));
+		c = last;
+	}
+}
+
+// fn(begin, end) on the nodes of the rows [rowBegin, rowEnd) of a band and
+// the columns [columnBegin, columnEnd) of neighbouring tiles: row by row, or
+// at once tiled, where they lie together
+void Cloth::tileNodes(int rowBegin, int rowEnd, int columnBegin, int columnEnd, const std::function<void(int, int)>& fn) {
+	int n = meshResolution;
+	if (nodeLayout == TILED) {
+		fn(rowBegin * n + columnBegin * (rowEnd - rowBegin), rowBegin * n + columnEnd * (rowEnd - rowBegin));
+		return;
+	}
+	for (int i = rowBegin; i < rowEnd; i++)
+		fn(i * n + columnBegin, i * n + columnEnd);
+}
+
+// appends the runs of the rows [rowBegin, rowEnd), see rowRuns, cut down to
+// the springs whose node a lies in the columns [columnBegin, columnEnd)
+void Cloth::cutRuns(const std::vector<SpringRun>& runs, const std::vector<int>& rows, int rowBegin, int rowEnd,
+	int columnBegin, int columnEnd, std::vector<SpringRun>& cut) {
+	for (int r = rows[rowBegin]; r < rows[rowEnd]; r++) {
+		int column = gridIndex(springA[runs[r].first]) % meshResolution;
+		int first = std::max(columnBegin - column, 0), last = std::min(columnEnd - column, runs[r].count);
+		if (first >= last)
+			continue;
+		SpringRun piece;
+		piece.first = runs[r].first + first;
+		piece.count = last - first;
+		cut.push_back(piece);
+	}
+}
+
+// fn(begin, end) on the nodes of every band of a resolution x resolution
+// grid, by default the cloth's
+void Cloth::parallelNodes(int resolution, const std::function<void(int, int)>& fn) {
+	pool->run(bandCount(resolution), [&](int band) {
+		fn(band * bandRows * resolution, std::min((band + 1) * bandRows, resolution) * resolution);
+	});
+}
+
+void Cloth::parallelNodes(const std::function<void(int, int)>& fn) {
+	parallelNodes(meshResolution, fn);
+}
+
+// the same on the tiles whose flag is set only: a band at once where all of
+// its tiles are, otherwise row by row
+void Cloth::parallelNodes(const std::vector<char>& tiles, const std::function<void(int, int)>& fn) {
+	int n = meshResolution;
+	pool->run(bandCount(), [&](int band) {
+		int rowBegin = band * bandRows, rowEnd = std::min(rowBegin + bandRows, n);
+		forTileColumns(tiles, band, [&](int columnBegin, int columnEnd) {
+			if (columnEnd - columnBegin == n) {
+				fn(rowBegin * n, rowEnd * n);
+				return;
+			}
+			tileNodes(rowBegin, rowEnd, columnBegin, columnEnd, fn);
+		});
+	});
+}
+
+// fn(firstRun, lastRun) on the spring runs of every band: even bands first,
+// then odd ones. The order in which a node receives its spring forces only
+// depends on the bands, so the result is the same for any number of threads.
+// rows holds the first run of every row, plus the end.
+void Cloth::parallelSprings(int resolution, const std::vector<int>& rows, const std::function<void(int, int)>& fn) {
+	int bands = bandCount(resolution);
+	for (int parity = 0; parity < 2; parity++) {
+		pool->run((bands + 1 - parity) / 2, [&](int t) {
+			int band = 2 * t + parity;
+			fn(rows[band * bandRows], rows[std::min((band + 1) * bandRows, resolution)]);
+		});
+	}
+}
+
+void Cloth::parallelSprings(const std::function<void(int, int)>& fn) {
+	parallelSprings(meshResolution, rowRuns, fn);
+}
+
+// fn(rowBegin, rowEnd) on the quad rows of every band: even bands first,
+// then odd ones. A quad reaches one row down, so the bands running at the
+// same time never share a node.
+void Cloth::parallelQuads(const std::function<void(int, int)>& fn) {
+	int bands = bandCount();
+	for (int parity = 0; parity < 2; parity++) {
+		pool->run((bands + 1 - parity) / 2, [&](int t) {
+			int band = 2 * t + parity;
+			fn(band * bandRows, std::min((band + 1) * bandRows, meshResolution - 1));
+		});
+	}
+}
+
+// fn(rowBegin, rowEnd, columnBegin, columnEnd) on the tiles whose flag is
+// set, band by band like parallelSprings: even bands first, then odd ones.
+// The rows are those of the band and the columns those of neighbouring set
+// tiles, so a band whose tiles are all set comes whole.
+void Cloth::parallelTiles(const std::vector<char>& tiles, const std::function<void(int, int, int, int)>& fn) {
+	int bands = bandCount();
+	for (int parity = 0; parity < 2; parity++) {
+		pool->run((bands + 1 - parity) / 2, [&](int t) {
+			int band = 2 * t + parity;
+			int rowBegin = band * bandRows, rowEnd = std::min(rowBegin + bandRows, meshResolution);
+			forTileColumns(tiles, band, [&](int columnBegin, int columnEnd) {
+				fn(rowBegin, rowEnd, columnBegin, columnEnd);
+			});
+		});
+	}
+}
+
+// sum of fn(begin, end) over the bands, added up in band order
+double Cloth::parallelSum(const std::function<double(int, int)>& fn) {
+	std::vector<double> partial(bandCount());
+	parallelNodes([&](int begin, int end) {
+		partial[begin / (bandRows * meshResolution)] = fn(begin, end);
+	});
+	double sum = 0.0;
+	for (size_t b = 0; b < partial.size(); b++)
+		sum += partial[b];
+	return sum;
+}
+
+bool Cloth::isPinned(int index) {
+	return pinned && (index == nodeIndex(meshResolution - 1, 0) || index == nodeIndex(meshResolution - 1, meshResolution - 1));
+}
+
+// the membrane's quads are rows of nodes
+bool Cloth::hasMembrane() {
+	return membrane && nodeLayout == ROW_MAJOR;
+}
+
+// where node (i, j) is stored
+int Cloth::nodeIndex(int i, int j) {
+	int node = i * meshResolution + j;
+	return nodeLayout == TILED ? tiledIndex[node] : node;
+}
+
+// i * resolution + j of the node stored at index
+int Cloth::gridIndex(int index) {
+	return nodeLayout == TILED ? tiledNode[index] : index;
+}
+
+// Backward Euler step in the style of Baraff & Witkin, "Large Steps in Cloth
+// Simulation": solves (M - dt df/dv - dt^2 df/dx) dv = dt (f + dt df/dx v)
+// with a block-Jacobi preconditioned conjugate gradient. The spring
+// Jacobians are assembled once per step and kept per spring; the transverse
+// term of compressed springs is dropped so the system stays positive definite.
+void Cloth::simulateImplicit(float stepSize) {
+	int nodes = meshResolution * meshResolution;
+	int springs = static_cast<int>(springA.size());
+	if (static_cast<int>(springHessian[0].size()) != springs) {
+		for (int c = 0; c < 6; c++)
+			springHessian[c].resize(springs);
+	}
+	if (static_cast<int>(deltaVelocity[0].size()) != nodes) {
+		for (int c = 0; c < 6; c++)
+			blockPreconditioner[c].resize(nodes);
+		for (int c = 0; c < 3; c++) {
+			deltaVelocity[c].resize(nodes);
+			cgResidual[c].resize(nodes);
+			cgPreconditioned[c].resize(nodes);
+			cgDirection[c].resize(nodes);
+			cgProduct[c].resize(nodes);
+		}
+	}
+
+	glm::vec3 pin1 = getPosition(meshResolution - 1, 0), pin2 = getPosition(meshResolution - 1, meshResolution - 1);
+	if (pinned) {
+		setVelocity(meshResolution - 1, 0, glm::vec3(0.0f));
+		setVelocity(meshResolution - 1, meshResolution - 1, glm::vec3(0.0f));
+	}
+	float dt = stepSize, dt2 = stepSize * stepSize;
+
+	// cgResidual collects -sum H (v_a - v_b) and blockPreconditioner the
+	// spring part of the diagonal blocks
+	parallelNodes([&](int begin, int end) {
+		for (int c = 0; c < 6; c++)
+			std::fill(blockPreconditioner[c].data() + begin, blockPreconditioner[c].data() + end, 0.0f);
+		for (int c = 0; c < 3; c++)
+			std::fill(cgResidual[c].data() + begin, cgResidual[c].data() + end, 0.0f);
+	});
+
+	parallelSprings([&](int firstRun, int lastRun) {
+		int first = springRuns[firstRun].first;
+		int last = lastRun < static_cast<int>(springRuns.size()) ? springRuns[lastRun].first : springs;
+		for (int s = first; s < last; s++) {
+			int a = springA[s], b = springB[s];
+			glm::vec3 d = load3(vertexPosition, a) - load3(vertexPosition, b);
+			float len = glm::length(d);
+			float k = K[springType[s]];
+			float stretch = 1.0f - springRest[s] / len;
+			glm::vec3 f = d * (-k * stretch);
+			store3(vertexForce, a, load3(vertexForce, a) + f);
+			store3(vertexForce, b, load3(vertexForce, b) - f);
+
+			float h[6];
+			springJacobian(d, len, springRest[s], k, h);
+			for (int c = 0; c < 6; c++) {
+				springHessian[c][s] = h[c];
+				blockPreconditioner[c][a] += h[c];
+				blockPreconditioner[c][b] += h[c];
+			}
+			glm::vec3 hv = symmetricProduct(springHessian, s, load3(vertexVelocity, a) - load3(vertexVelocity, b));
+			store3(cgResidual, a, load3(cgResidual, a) - hv);
+			store3(cgResidual, b, load3(cgResidual, b) + hv);
+		}
+	});
+
+	// right hand side, preconditioner and the first search direction
+	double rz = parallelSum([&](int begin, int end) {
+		double sum = 0.0;
+		for (int i = begin; i < end; i++) {
+			glm::vec3 v = load3(vertexVelocity, i), n = load3(vertexNormal, i);
+			glm::vec3 f = load3(vertexForce, i) + glm::vec3(0.0f, -mass * gravity, 0.0f) + v * (-Cd)
+				+ n * (Cv * glm::dot(n, flowVelocity - v));
+			store3(vertexForce, i, glm::vec3(0.0f));
+			glm::vec3 r = (f + load3(cgResidual, i) * dt) * dt;
+
+			// A_ii = (m + dt Cd) I + dt Cv n n^T + dt^2 sum H, pinned nodes are
+			// filtered out by a zero preconditioner
+			glm::mat3 block;
+			if (!isPinned(i)) {
+				float diagonal = mass + dt * Cd;
+				block[0][0] = diagonal + dt * Cv * n.x * n.x + dt2 * blockPreconditioner[0][i];
+				block[0][1] = block[1][0] = dt * Cv * n.x * n.y + dt2 * blockPreconditioner[1][i];
+				block[0][2] = block[2][0] = dt * Cv * n.x * n.z + dt2 * blockPreconditioner[2][i];
+				block[1][1] = diagonal + dt * Cv * n.y * n.y + dt2 * blockPreconditioner[3][i];
+				block[1][2] = block[2][1] = dt * Cv * n.y * n.z + dt2 * blockPreconditioner[4][i];
+				block[2][2] = diagonal + dt * Cv * n.z * n.z + dt2 * blockPreconditioner[5][i];
+				block = glm::inverse(block);
+			} else {
+				block = glm::mat3(0.0f);
+			}
+			blockPreconditioner[0][i] = block[0][0];
+			blockPreconditioner[1][i] = block[0][1];
+			blockPreconditioner[2][i] = block[0][2];
+			blockPreconditioner[3][i] = block[1][1];
+			blockPreconditioner[4][i] = block[1][2];
+			blockPreconditioner[5][i] = block[2][2];
+
+			glm::vec3 z = symmetricProduct(blockPreconditioner, i, r);
+			store3(deltaVelocity, i, glm::vec3(0.0f));
+			store3(cgResidual, i, r);
+			store3(cgPreconditioned, i, z);
+			store3(cgDirection, i, z);
+			sum += glm::dot(r, z);
+		}
+		return sum;
+	});
+
+	// multigrid restricts and prolongs along the rows
+	bool vCycles = multigrid && nodeLayout == ROW_MAJOR;
+	if (vCycles)
+		rz = multigridPrecondition(stepSize, true);
+	double threshold = rz * cgTolerance * cgTolerance;
+	if (rz > threshold)
+		multiplySystem(stepSize, false, 0.0f);
+	for (cgIterations = 0; cgIterations < cgMaxIterations && rz > threshold; cgIterations++) {
+		double pq = parallelSum([&](int begin, int end) {
+			double sum = 0.0;
+			for (int i = begin; i < end; i++)
+				sum += glm::dot(load3(cgDirection, i), load3(cgProduct, i));
+			return sum;
+		});
+		if (pq <= 0.0)
+			break;
+		float alpha = static_cast<float>(rz / pq);
+		double rzNext = parallelSum([&](int begin, int end) {
+			double sum = 0.0;
+			for (int i = begin; i < end; i++) {
+				store3(deltaVelocity, i, load3(deltaVelocity, i) + load3(cgDirection, i) * alpha);
+				glm::vec3 r = load3(cgResidual, i) - load3(cgProduct, i) * alpha;
+				glm::vec3 z = symmetricProduct(blockPreconditioner, i, r);
+				store3(cgResidual, i, r);
+				store3(cgPreconditioned, i, z);
+				sum += glm::dot(r, z);
+			}
+			return sum;
+		});
+		if (vCycles)
+			rzNext = multigridPrecondition(stepSize, false);
+		float beta = static_cast<float>(rzNext / rz);
+		rz = rzNext;
+		// the direction update p = z + beta p is folded into the product pass
+		if (rz > threshold && cgIterations + 1 < cgMaxIterations)
+			multiplySystem(stepSize, true, beta);
+	}
+
+	parallelNodes([&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			glm::vec3 v = load3(vertexVelocity, i) + load3(deltaVelocity, i);
+			store3(vertexVelocity, i, v);
+			store3(vertexPosition, i, load3(vertexPosition, i) + v * stepSize);
+		}
+	});
+
+	if (pinned) {
+		setPosition(meshResolution - 1, 0, pin1);
+		setPosition(meshResolution - 1, meshResolution - 1, pin2);
+	}
+}
+
+// cgProduct = A cgDirection, optionally updating cgDirection = z + beta p first
+void Cloth::multiplySystem(float stepSize, bool updateDirection, float beta) {
+	float dt = stepSize, dt2 = stepSize * stepSize;
+	parallelNodes([&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			glm::vec3 p = load3(cgDirection, i);
+			if (updateDirection) {
+				p = load3(cgPreconditioned, i) + p * beta;
+				store3(cgDirection, i, p);
+			}
+			glm::vec3 n = load3(vertexNormal, i);
+			store3(cgProduct, i, p * (mass + dt * Cd) + n * (dt * Cv * glm::dot(n, p)));
+		}
+	});
+	parallelSprings([&](int firstRun, int lastRun) {
+		int first = springRuns[firstRun].first;
+		int last = lastRun < static_cast<int>(springRuns.size()) ? springRuns[lastRun].first : static_cast<int>(springA.size());
+		for (int s = first; s < last; s++) {
+			int a = springA[s], b = springB[s];
+			glm::vec3 u = symmetricProduct(springHessian, s, load3(cgDirection, a) - load3(cgDirection, b)) * dt2;
+			store3(cgProduct, a, load3(cgProduct, a) + u);
+			store3(cgProduct, b, load3(cgProduct, b) - u);
+		}
+	});
+}
+
+// Extended position based dynamics (Macklin et al., "XPBD: Position-Based
+// Simulation of Compliant Constrained Dynamics"). The springs become distance
+// constraints with compliance 1 / K; gravity, damping and viscous drag are
+// applied in the prediction. Constraints of one color share no node, so
+// each color is projected in parallel chunks and the result does not depend
+// on the thread count.
+void Cloth::simulateXPBD(float stepSize) {
+	int nodes = meshResolution * meshResolution;
+	if (static_cast<int>(previousPosition[0].size()) != nodes) {
+		for (int c = 0; c < 3; c++)
+			previousPosition[c].resize(nodes);
+	}
+	float dt = stepSize;
+	float invMass = 1.0f / mass;
+
+	parallelNodes([&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			glm::vec3 x = load3(vertexPosition, i), v = load3(vertexVelocity, i), n = load3(vertexNormal, i);
+			if (isPinned(i)) {
+				v = glm::vec3(0.0f);
+			} else {
+				glm::vec3 f = glm::vec3(0.0f, -mass * gravity, 0.0f) + v * (-Cd) + n * (Cv * glm::dot(n, flowVelocity - v));
+				v += f * (dt * invMass);
+			}
+			store3(previousPosition, i, x);
+			store3(vertexPosition, i, x + v * dt);
+		}
+	});
+	constraintLambda.fill(0.0f);
+
+	const int chunk = 512;
+	for (int iteration = 0; iteration < xpbdIterations; iteration++) {
+		for (size_t c = 0; c + 1 < colorOffsets.size(); c++) {
+			int first = colorOffsets[c], last = colorOffsets[c + 1];
+			pool->run((last - first + chunk - 1) / chunk, [&](int t) {
+				int end = std::min(first + (t + 1) * chunk, last);
+				for (int k = first + t * chunk; k < end; k++) {
+					int s = colorOrder[k];
+					int a = springA[s], b = springB[s];
+					float wa = isPinned(a) ? 0.0f : invMass, wb = isPinned(b) ? 0.0f : invMass;
+					glm::vec3 d = load3(vertexPosition, a) - load3(vertexPosition, b);
+					float len = glm::length(d);
+					if (wa + wb == 0.0f || len == 0.0f)
+						continue;
+					float alpha = compliance[springType[s]] / (dt * dt);
+					float dLambda = (springRest[s] - len - alpha * constraintLambda[s]) / (wa + wb + alpha);
+					constraintLambda[s] += dLambda;
+					glm::vec3 correction = d * (dLambda / len);
+					store3(vertexPosition, a, load3(vertexPosition, a) + correction * wa);
+					store3(vertexPosition, b, load3(vertexPosition, b) - correction * wb);
+				}
+			});
+		}
+	}
+
+	parallelNodes([&](int begin, int end) {
+		for (int i = begin; i < end; i++)
+			store3(vertexVelocity, i, (load3(vertexPosition, i) - load3(previousPosition, i)) / dt);
+	});
+}
@@ -0,0 +1,381 @@
+#ifndef CLOTH_H
+#define CLOTH_H
+
+// The cloth simulation itself, free of any GL, window or GUI code so that it
+// can also be built into headless tools such as the benchmark.
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <atomic>
+
+#include "aligned_array.h"
+#include "cloth_kernels.h"
+#include "continuous_collision.h"
+#include "physics_thread.h"
+#include "signed_distance_field.h"
+#include "thread_pool.h"
+#include "triangle_bvh.h"
+#include "triple_buffer.h"
+
+class MappedFile;
+class VertexCacheWriter;
+
+class Cloth {
+    public:
+		enum Integrator { EXPLICIT_EULER, IMPLICIT_EULER, XPBD };
+		enum Layout { ROW_MAJOR, TILED };
+
+		// one finished tick of the physics thread
+		struct Snapshot {
+			std::vector<float> vertices; // interleaved position and normal
+			double time; // clockTime() when the tick was finished
+			int cgIterations;
+			int substeps; // in the last tick
+			float awake; // share of the tiles awake, see sleeping
+			Snapshot() : time(0.0), cgIterations(0), substeps(0), awake(1.0f) {}
+		};
+
+		// settings, only change these while the simulation is stopped
+		Integrator integrator;
+		cloth_kernels::Isa simdIsa;
+		float explicitTimeStep;
+		// The explicit integrator picks its substep from the current state
+		// instead, as large as stays stable, but takes at most maxSubsteps per
+		// advance call.
+		bool adaptiveTimeStep;
+		int maxSubsteps;
+		float maxStrainPerStep; // how far the fastest spring may stretch in one substep
+		float implicitTimeStep;
+		bool multigrid; // precondition the implicit solve with V-cycles, see cloth_multigrid.cpp
+		float xpbdTimeStep;
+		int xpbdIterations;
+		float simulationTick;
+		bool pinned; // the two top corners hold the cloth
+		bool selfCollision;
+		bool continuousCollision; // edges and faces of the cloth against the collider too
+		bool horizontal; // lay the cloth out flat at the height of the pins, see setResolution
+		// Every pass works on fixed bands of rows and sums in band order, so
+		// the state only depends on the thread count where the threads race
+		// to fill the self-collision hash. This orders the hash too, which
+		// makes every step bit for bit the same for any number of threads.
+		bool deterministic;
+		// Explicit Euler only: the grid is cut into tiles of bandRows rows by
+		// tileColumns columns, and a tile whose nodes all stay slower than
+		// sleepSpeed while its springs all change length slower than
+		// sleepStrainRate (rest lengths per second) for sleepSubsteps substeps
+		// in a row is frozen and skipped until a neighbouring tile or a
+		// collision wakes it, see simulate.
+		bool sleeping;
+		float sleepSpeed;
+		float sleepStrainRate;
+		int sleepSubsteps;
+		// Explicit Euler only: the structural and shear springs give way to a
+		// Saint Venant-Kirchhoff membrane of two triangles per quad, stiff
+		// along the rows (warp), along the columns (weft) and in shear by
+		// separate amounts, so the cloth can be anisotropic; the bending
+		// springs stay. See initMembrane.
+		bool membrane;
+		float warpStiffness;
+		float weftStiffness;
+		float shearStiffness;
+
+		// written by the physics thread, the read side belongs to whoever
+		// draws the cloth
+		TripleBuffer<Snapshot> snapshots;
+
+        Cloth(int resolution = 20);
+		~Cloth();
+
+		int resolution() const { return meshResolution; }
+		int threadCount() const { return pool->size(); }
+		int colorCount() const { return static_cast<int>(colorOffsets.size()) - 1; }
+		int solverIterations() const { return cgIterations; } // of the last implicit step
+		float awakeShare(); // of the tiles, 1 unless sleeping
+		cloth_kernels::Isa bestIsa() const { return maxSimdIsa; }
+		void setThreadCount(int threads);
+		void setResolution(int resolution);
+
+		// How the nodes are stored: row by row, or tile by tile in the tiles
+		// of sleeping, so the rows a spring reaches across lie a tile apart
+		// instead of a grid apart, see initLayout. The grid starts over. The
+		// membrane and multigrid need the rows and are left out when tiled,
+		// and checkpoints always hold the rows. The spring runs stop at every
+		// tile, which has cost more than it saved on the grids benchmarked so
+		// far, so the rows stay the default.
+		Layout layout() const { return nodeLayout; }
+		void setLayout(Layout layout);
+
+		// Static triangles the cloth collides with, three vertex indices per
+		// triangle; empty indices remove the collider. The hierarchy is built
+		// here, once, so only call this while the simulation is stopped.
+		void setCollider(const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& indices);
+		bool hasCollider() const { return !collider.empty(); }
+
+		// The same from a baked distance field, which costs one lookup per
+		// node however detailed the mesh was; an empty field removes it.
+		void setColliderField(const SignedDistanceField& field);
+		bool hasColliderField() const { return !colliderField.empty(); }
+
+		// The simulation runs on its own thread, one tick of simulationTick
+		// seconds at a time at a fixed wall clock rate, and publishes every
+		// finished tick to snapshots.
+		void startSimulation();
+		bool stopSimulation() { return physics.stop(); }
+		double clockTime() const { return physics.clockTime(); }
+
+		// advances the cloth by frameTime and returns the number of substeps
+		int advance(float frameTime);
+		double computeEnergy();
+		// a hash of the bits of every position and velocity, to compare runs by
+		unsigned long long stateChecksum();
+
+		// Checkpoints hold the positions, velocities and spring table of the
+		// cloth with the settings and parameters, see cloth_checkpoint.cpp.
+		// Restoring maps the file and simulates on from its pages instead of
+		// copying the arrays out, but it still reads the whole spring table to
+		// check it, and rebuilds what is derived from it (the node stiffness,
+		// the membrane, the constraint colors and the collision hash) and the
+		// normals. The collider and the SIMD kernels stay as they are.
+		bool saveCheckpoint(const std::string& path);
+		bool loadCheckpoint(const std::string& path);
+
+		// Records every finished tick of the physics thread to a vertex cache,
+		// see vertex_cache.h, starting with the current state. Recording ends
+		// with stopRecording or when the grid changes size.
+		bool startRecording(const std::string& path);
+		bool stopRecording();
+		bool isRecording() const { return recorder != NULL; }
+
+		// the current state in the layout of Snapshot::vertices, 6 floats per node
+		void copyVertices(float* vertices);
+
+    private:
+		int meshResolution;
+		Layout nodeLayout;
+		// tiled: where node i * resolution + j is stored, and which node is
+		// stored at each index; both empty by rows
+		std::vector<int> tiledIndex;
+		std::vector<int> tiledNode;
+		float restLength[3];
+		float mass;
+		float K[3];
+		float gravity;
+		float Cd;
+		float Cv;
+		glm::vec3 flowVelocity;
+
+		// structure of arrays, one array per component
+		AlignedArray<float> vertexPosition[3];
+		AlignedArray<float> vertexNormal[3];
+		AlignedArray<float> vertexVelocity[3];
+		AlignedArray<float> vertexForce[3];
+
+		// triangle normals for computeNormals, see FaceView; the first
+		// resolution + 1 entries are the zero padding in front of the grid
+		AlignedArray<float> faceNormal[6];
+		// tiled: the positions and normals row by row for computeNormals
+		AlignedArray<float> gridPosition[3];
+		AlignedArray<float> gridNormal[3];
+
+		// every spring once, built by initMesh
+		AlignedArray<int> springA;
+		AlignedArray<int> springB;
+		AlignedArray<float> springRest;
+		AlignedArray<int> springType;
+		std::vector<SpringRun> springRuns;
+		std::vector<int> rowRuns; // first run of each row, plus the end
+		float maxNodeStiffness; // largest sum of K over the springs of one node
+		float maxBendingStiffness; // the same over the bending springs only
+
+		// membrane: the rest state of both triangles of every quad, see
+		// MembraneView, and the bending springs by themselves, run by run
+		AlignedArray<float> membraneRest[10];
+		std::vector<SpringRun> bendingRuns;
+		std::vector<int> bendingRowRuns;
+		float maxMembraneStiffness; // largest membrane stiffness of a node per unit stiffness
+		int lastSubsteps;
+
+		// per tile: frozen, and for how many substeps in a row it was quiet
+		std::vector<char> tileAsleep;
+		std::vector<int> quietSubsteps;
+
+		// Substeps are split into bands of rows handed to the pool. Springs
+		// reach at most two rows down, so with bands of at least two rows the
+		// even bands never touch each other's nodes and neither do the odd ones.
+		// For sleeping the bands are cut into tiles, tile after tile along the
+		// band and band after band; springs reach at most two columns to
+		// either side, so they stay within the tiles next to their own.
+		static const int bandRows = 4;
+		static const int tileColumns = 32;
+		ThreadPool* pool;
+
+		cloth_kernels::Isa maxSimdIsa;
+
+		// backward Euler state: symmetric 3x3 blocks are stored as
+		// xx, xy, xz, yy, yz, zz
+		AlignedArray<float> springHessian[6];
+		AlignedArray<float> blockPreconditioner[6];
+		AlignedArray<float> deltaVelocity[3];
+		AlignedArray<float> cgResidual[3];
+		AlignedArray<float> cgPreconditioned[3];
+		AlignedArray<float> cgDirection[3];
+		AlignedArray<float> cgProduct[3];
+		int cgMaxIterations;
+		float cgTolerance;
+		int cgIterations;
+
+		// the levels of the multigrid preconditioner, finest first
+		struct GridLevel;
+		std::vector<GridLevel*> gridLevels;
+
+		// XPBD: every spring is a distance constraint. Constraints are greedily
+		// colored so that no two of the same color share a node; colorOrder
+		// lists the springs color by color and colorOffsets[c] is where color
+		// c starts.
+		float compliance[3];
+		AlignedArray<float> previousPosition[3];
+		AlignedArray<float> constraintLambda;
+		AlignedArray<int> colorOrder;
+		std::vector<int> colorOffsets;
+
+		// Self-collision: nodes are kept collisionThickness apart from each
+		// other and from the triangles. The spatial hash keeps the nodes sorted
+		// by hash slot: slot s holds hashNodes[hashStart[s], hashStart[s + 1]).
+		float collisionThickness;
+		float collisionRadius; // cell size, the reach of one query
+		std::vector<std::atomic<int> > hashCount;
+		AlignedArray<int> hashStart;
+		AlignedArray<int> hashNodes;
+		AlignedArray<int> nodeCell;
+		AlignedArray<float> collisionCorrection[3];
+
+		// Collider: every substep each node's path from substepStart to its new
+		// position is tested against the collider's triangles, and nodes that
+		// end up closer than colliderThickness are pushed back out.
+		TriangleBvh collider;
+		float colliderThickness;
+		AlignedArray<float> substepStart[3];
+		AlignedArray<float> impactTime; // safe fraction of the substep path
+		AlignedArray<float> impactNormal[3];
+		int impactPasses; // at most this many rounds of continuous tests per substep
+		SignedDistanceField colliderField;
+
+		// the restored checkpoint the arrays borrow from, until initMesh
+		MappedFile* checkpointMapping;
+
+		VertexCacheWriter* recorder;
+
+		PhysicsThread physics;
+
+		void initMesh();
+		void initLayout();
+		void initSprings();
+		void initNodeStiffness();
+		void initMembrane();
+		void initConstraintColors();
+		void initSelfCollision();
+		void buildSpatialHash();
+		void resolveSelfCollisions(float timeStep);
+		void resolveColliderContacts();
+		int resolveColliderImpacts();
+		void resolveFieldContacts();
+		void computeNormals();
+		void publishSnapshot(bool finishedTick);
+		void releaseCheckpoint();
+		float stableTimeStep();
+		void simulate(float timeStep);
+		void simulateImplicit(float timeStep);
+		void simulateXPBD(float timeStep);
+		void multiplySystem(float timeStep, bool updateDirection, float beta);
+		void buildGridLevels();
+		void releaseGridLevels();
+		void updateGridLevels(float timeStep);
+		void levelResidual(int l, float timeStep);
+		void smoothLevel(int l, bool fromZero);
+		void vCycle(int l, float timeStep);
+		double multigridPrecondition(float timeStep, bool firstCall);
+
+		void wakeAll();
+		bool isAsleep(int index);
+		void awakeTiles(std::vector<char>& tiles);
+		void spreadTiles(const std::vector<char>& tiles, int bandsUp, int bandsDown, std::vector<char>& result);
+		void updateSleep(const std::vector<char>& computed);
+		float strainRate(int spring, glm::vec3 d, float length);
+		int bandCount(int resolution);
+		int bandCount();
+		int rowTiles();
+		int tileCount();
+		int tileOf(int index);
+		void forTileColumns(const std::vector<char>& tiles, int band, const std::function<void(int, int)>& fn);
+		void tileNodes(int rowBegin, int rowEnd, int columnBegin, int columnEnd, const std::function<void(int, int)>& fn);
+		void cutRuns(const std::vector<SpringRun>& runs, const std::vector<int>& rows, int rowBegin, int rowEnd,
+			int columnBegin, int columnEnd, std::vector<SpringRun>& cut);
+		void parallelNodes(int resolution, const std::function<void(int, int)>& fn);
+		void parallelNodes(const std::function<void(int, int)>& fn);
+		void parallelNodes(const std::vector<char>& tiles, const std::function<void(int, int)>& fn);
+		void parallelSprings(int resolution, const std::vector<int>& rows, const std::function<void(int, int)>& fn);
+		void parallelSprings(const std::function<void(int, int)>& fn);
+		void parallelQuads(const std::function<void(int, int)>& fn);
+		void parallelTiles(const std::vector<char>& tiles, const std::function<void(int, int, int, int)>& fn);
+		double parallelSum(const std::function<double(int, int)>& fn);
+		bool isPinned(int index);
+		bool hasMembrane();
+		int nodeIndex(int i, int j);
+		int gridIndex(int index);
+
+		glm::vec3 getPosition(int i, int j);
+		glm::vec3 getNormal(int i, int j);
+		glm::vec3 getVelocity(int i, int j);
+		void setPosition(int i, int j, glm::vec3 value);
+		void setNormal(int i, int j, glm::vec3 value);
+		void setVelocity(int i, int j, glm::vec3 value);
+
+		ParticleView particleView();
+		SpringView springView();
+		FaceView faceView();
+		MembraneView membraneView();
+		ForceParams forceParams(float timeStep);
+};
+
+// Appends the springs of a resolution x resolution grid whose nodes start at
+// firstNode: one run per row and direction, and the first run of each row
+// to rowRuns.
+void appendGridSprings(int resolution, int firstNode, const float restLength[3], std::vector<int>& springA,
+	std::vector<int>& springB, std::vector<float>& springRest, std::vector<int>& springType,
+	std::vector<SpringRun>& springRuns, std::vector<int>& rowRuns);
+
+inline glm::vec3 load3(const AlignedArray<float>* a, int i) {
+	return glm::vec3(a[0][i], a[1][i], a[2][i]);
+}
+
+inline void store3(AlignedArray<float>* a, int i, glm::vec3 v) {
+	a[0][i] = v.x;
+	a[1][i] = v.y;
+	a[2][i] = v.z;
+}
+
+// symmetric 3x3 blocks are stored as xx, xy, xz, yy, yz, zz
+inline glm::vec3 symmetricProduct(const AlignedArray<float>* m, int i, glm::vec3 v) {
+	return glm::vec3(m[0][i] * v.x + m[1][i] * v.y + m[2][i] * v.z,
+		m[1][i] * v.x + m[3][i] * v.y + m[4][i] * v.z,
+		m[2][i] * v.x + m[4][i] * v.y + m[5][i] * v.z);
+}
+
+// H = k (u u^T + max(0, 1 - rest / len) (I - u u^T)) of the spring along d,
+// df_a/dx_a = -H; the transverse term of a compressed spring is dropped
+inline void springJacobian(glm::vec3 d, float len, float rest, float k, float* h) {
+	glm::vec3 u = d / len;
+	float t = std::max(1.0f - rest / len, 0.0f);
+	h[0] = k * (u.x * u.x + t * (1.0f - u.x * u.x));
+	h[1] = k * (1.0f - t) * u.x * u.y;
+	h[2] = k * (1.0f - t) * u.x * u.z;
+	h[3] = k * (u.y * u.y + t * (1.0f - u.y * u.y));
+	h[4] = k * (1.0f - t) * u.y * u.z;
+	h[5] = k * (u.z * u.z + t * (1.0f - u.z * u.z));
+}
+
+#endif
@@ -0,0 +1,429 @@
+#include "cloth.h"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A file mapped copy-on-write: its pages can be written, but the changes
+// stay with the process and never reach the file.
+class MappedFile {
+public:
+	MappedFile() : address(NULL), length(0) {}
+	~MappedFile() { close(); }
+
+	bool open(const std::string& path) {
+		close();
+#ifdef _WIN32
+		HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER fileSize;
+		if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+			// the view keeps the mapping alive once the handles are closed
+			HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+			if (mapping) {
+				address = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0));
+				CloseHandle(mapping);
+			}
+		}
+		CloseHandle(file);
+		if (!address)
+			return false;
+		length = static_cast<size_t>(fileSize.QuadPart);
+#else
+		int file = ::open(path.c_str(), O_RDONLY);
+		if (file < 0)
+			return false;
+		struct stat info;
+		void* p = MAP_FAILED;
+		if (fstat(file, &info) == 0 && info.st_size > 0)
+			p = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+		::close(file);
+		if (p == MAP_FAILED)
+			return false;
+		address = static_cast<char*>(p);
+		length = static_cast<size_t>(info.st_size);
+#endif
+		return true;
+	}
+
+	void close() {
+		if (!address)
+			return;
+#ifdef _WIN32
+		UnmapViewOfFile(address);
+#else
+		munmap(address, length);
+#endif
+		address = NULL;
+		length = 0;
+	}
+
+	char* data() { return address; }
+	size_t size() const { return length; }
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	char* address;
+	size_t length;
+};
+
+// File layout (little endian): the header below, then every section at a
+// multiple of sectionAlignment bytes from the start of the file, so the
+// arrays can be used straight from a mapping of it. The header records the
+// offset and size of each section. Every version appends to the header, so
+// an older header is a prefix of the current one, see headerSize.
+static const int fileVersion = 4;
+static const long long sectionAlignment = 64;
+
+enum CheckpointSection {
+	POSITION_X, POSITION_Y, POSITION_Z,
+	VELOCITY_X, VELOCITY_Y, VELOCITY_Z,
+	SPRING_A, SPRING_B, SPRING_REST, SPRING_TYPE,
+	SPRING_RUNS, ROW_RUNS,
+	SECTION_COUNT
+};
+
+// four or eight byte fields only, the eight byte ones first, so there is no
+// padding to differ between compilers
+struct CheckpointHeader {
+	char magic[4];
+	int version;
+	long long sections[SECTION_COUNT][2]; // offset and size in bytes
+
+	int resolution;
+	int springCount;
+	int runCount;
+	int integrator;
+	int pinned;
+	int selfCollision;
+	int continuousCollision;
+	int horizontal;
+	int adaptiveTimeStep;
+	int maxSubsteps;
+	int xpbdIterations;
+	int cgMaxIterations;
+	int impactPasses;
+
+	float restLength[3];
+	float mass;
+	float K[3];
+	float gravity;
+	float Cd;
+	float Cv;
+	float flowVelocity[3];
+	float compliance[3];
+	float explicitTimeStep;
+	float maxStrainPerStep;
+	float implicitTimeStep;
+	float xpbdTimeStep;
+	float simulationTick;
+	float cgTolerance;
+
+	// since version 2
+	int sleeping;
+	int sleepSubsteps;
+	int multigrid;
+	int deterministic;
+	float sleepSpeed;
+
+	// since version 3
+	float sleepStrainRate;
+
+	// since version 4
+	int membrane;
+	float warpStiffness;
+	float weftStiffness;
+	float shearStiffness;
+};
+
+// the bytes of the header a file of the given version has
+static size_t headerSize(int version) {
+	if (version == 1)
+		return offsetof(CheckpointHeader, sleeping);
+	if (version == 2)
+		return offsetof(CheckpointHeader, sleepStrainRate);
+	if (version == 3)
+		return offsetof(CheckpointHeader, membrane);
+	return sizeof(CheckpointHeader);
+}
+
+static_assert(sizeof(long long) == 8 && sizeof(int) == 4 && sizeof(float) == 4, "checkpoints need 32-bit int and float");
+static_assert(sizeof(SpringRun) == 2 * sizeof(int), "spring runs are stored as two ints");
+
+void Cloth::releaseCheckpoint() {
+	delete checkpointMapping;
+	checkpointMapping = NULL;
+}
+
+bool Cloth::saveCheckpoint(const std::string& path) {
+	bool running = stopSimulation();
+	int nodes = meshResolution * meshResolution;
+	int springs = static_cast<int>(springA.size());
+
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "CCKP", 4);
+	header.version = fileVersion;
+	header.resolution = meshResolution;
+	header.springCount = springs;
+	header.runCount = static_cast<int>(springRuns.size());
+	header.integrator = integrator;
+	header.pinned = pinned;
+	header.selfCollision = selfCollision;
+	header.continuousCollision = continuousCollision;
+	header.horizontal = horizontal;
+	header.adaptiveTimeStep = adaptiveTimeStep;
+	header.maxSubsteps = maxSubsteps;
+	header.xpbdIterations = xpbdIterations;
+	header.cgMaxIterations = cgMaxIterations;
+	header.impactPasses = impactPasses;
+	for (int k = 0; k < 3; k++) {
+		header.restLength[k] = restLength[k];
+		header.K[k] = K[k];
+		header.flowVelocity[k] = flowVelocity[k];
+		header.compliance[k] = compliance[k];
+	}
+	header.mass = mass;
+	header.gravity = gravity;
+	header.Cd = Cd;
+	header.Cv = Cv;
+	header.explicitTimeStep = explicitTimeStep;
+	header.maxStrainPerStep = maxStrainPerStep;
+	header.implicitTimeStep = implicitTimeStep;
+	header.xpbdTimeStep = xpbdTimeStep;
+	header.simulationTick = simulationTick;
+	header.cgTolerance = cgTolerance;
+	header.sleeping = sleeping;
+	header.sleepSubsteps = sleepSubsteps;
+	header.multigrid = multigrid;
+	header.deterministic = deterministic;
+	header.sleepSpeed = sleepSpeed;
+	header.sleepStrainRate = sleepStrainRate;
+	header.membrane = membrane;
+	header.warpStiffness = warpStiffness;
+	header.weftStiffness = weftStiffness;
+	header.shearStiffness = shearStiffness;
+
+	const void* data[SECTION_COUNT] = {
+		vertexPosition[0].data(), vertexPosition[1].data(), vertexPosition[2].data(),
+		vertexVelocity[0].data(), vertexVelocity[1].data(), vertexVelocity[2].data(),
+		springA.data(), springB.data(), springRest.data(), springType.data(),
+		springRuns.data(), rowRuns.data()
+	};
+	// Checkpoints hold the nodes row by row. The tiled layout only ever has
+	// the springs initSprings makes, so those are made again by rows.
+	std::vector<float> byRows[6];
+	std::vector<int> a, b, type, firstRuns;
+	std::vector<float> rest;
+	std::vector<SpringRun> runs;
+	if (nodeLayout == TILED) {
+		for (int c = 0; c < 6; c++) {
+			const AlignedArray<float>& from = c < 3 ? vertexPosition[c] : vertexVelocity[c - 3];
+			byRows[c].resize(nodes);
+			for (int id = 0; id < nodes; id++)
+				byRows[c][tiledNode[id]] = from[id];
+			data[POSITION_X + c] = byRows[c].data();
+		}
+		appendGridSprings(meshResolution, 0, restLength, a, b, rest, type, runs, firstRuns);
+		firstRuns.push_back(static_cast<int>(runs.size()));
+		data[SPRING_A] = a.data();
+		data[SPRING_B] = b.data();
+		data[SPRING_REST] = rest.data();
+		data[SPRING_TYPE] = type.data();
+		data[SPRING_RUNS] = runs.data();
+		data[ROW_RUNS] = firstRuns.data();
+		header.runCount = static_cast<int>(runs.size());
+	}
+	long long bytes[SECTION_COUNT] = {
+		nodes * 4ll, nodes * 4ll, nodes * 4ll, nodes * 4ll, nodes * 4ll, nodes * 4ll,
+		springs * 4ll, springs * 4ll, springs * 4ll, springs * 4ll,
+		header.runCount * 8ll, (meshResolution + 1) * 4ll
+	};
+	long long offset = sizeof(header);
+	for (int k = 0; k < SECTION_COUNT; k++) {
+		offset = (offset + sectionAlignment - 1) / sectionAlignment * sectionAlignment;
+		header.sections[k][0] = offset;
+		header.sections[k][1] = bytes[k];
+		offset += bytes[k];
+	}
+
+	bool ok = false;
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file) {
+		const char zeros[sectionAlignment] = {};
+		ok = fwrite(&header, sizeof(header), 1, file) == 1;
+		long long written = sizeof(header);
+		for (int k = 0; ok && k < SECTION_COUNT; k++) {
+			size_t padding = static_cast<size_t>(header.sections[k][0] - written);
+			ok = fwrite(zeros, 1, padding, file) == padding
+				&& fwrite(data[k], 1, static_cast<size_t>(bytes[k]), file) == static_cast<size_t>(bytes[k]);
+			written = header.sections[k][0] + bytes[k];
+		}
+		ok = fclose(file) == 0 && ok;
+	}
+	if (running)
+		startSimulation();
+	return ok;
+}
+
+// Everything is checked against the mapping before the cloth is touched, so
+// a bad file leaves the current cloth running as it was. The settings an
+// older file predates keep their current values.
+bool Cloth::loadCheckpoint(const std::string& path) {
+	MappedFile* file = new MappedFile;
+	CheckpointHeader header;
+	header.sleeping = sleeping;
+	header.sleepSubsteps = sleepSubsteps;
+	header.multigrid = multigrid;
+	header.deterministic = deterministic;
+	header.sleepSpeed = sleepSpeed;
+	header.sleepStrainRate = sleepStrainRate;
+	header.membrane = membrane;
+	header.warpStiffness = warpStiffness;
+	header.weftStiffness = weftStiffness;
+	header.shearStiffness = shearStiffness;
+	bool ok = file->open(path) && file->size() >= 8;
+	if (ok) {
+		memcpy(&header, file->data(), 8);
+		ok = !memcmp(header.magic, "CCKP", 4) && header.version >= 1 && header.version <= fileVersion
+			&& file->size() >= headerSize(header.version);
+	}
+	if (ok) {
+		memcpy(&header, file->data(), headerSize(header.version));
+		ok = header.resolution >= 2 && header.resolution <= 46340 && header.springCount >= 0 && header.runCount >= 0
+			&& header.integrator >= EXPLICIT_EULER && header.integrator <= XPBD && header.mass > 0.0f;
+	}
+	long long nodes = ok ? static_cast<long long>(header.resolution) * header.resolution : 0;
+	if (ok) {
+		long long expected[SECTION_COUNT] = {
+			nodes * 4, nodes * 4, nodes * 4, nodes * 4, nodes * 4, nodes * 4,
+			header.springCount * 4ll, header.springCount * 4ll, header.springCount * 4ll, header.springCount * 4ll,
+			header.runCount * 8ll, (header.resolution + 1) * 4ll
+		};
+		for (int k = 0; ok && k < SECTION_COUNT; k++) {
+			long long offset = header.sections[k][0];
+			ok = offset >= static_cast<long long>(headerSize(header.version)) && offset % sectionAlignment == 0
+				&& header.sections[k][1] == expected[k] && offset + expected[k] <= static_cast<long long>(file->size());
+		}
+	}
+
+	// the spring table has to stay inside the cloth
+	const int* a = NULL;
+	const int* b = NULL;
+	const int* type = NULL;
+	const SpringRun* runs = NULL;
+	const int* rows = NULL;
+	if (ok) {
+		a = reinterpret_cast<const int*>(file->data() + header.sections[SPRING_A][0]);
+		b = reinterpret_cast<const int*>(file->data() + header.sections[SPRING_B][0]);
+		type = reinterpret_cast<const int*>(file->data() + header.sections[SPRING_TYPE][0]);
+		runs = reinterpret_cast<const SpringRun*>(file->data() + header.sections[SPRING_RUNS][0]);
+		rows = reinterpret_cast<const int*>(file->data() + header.sections[ROW_RUNS][0]);
+		for (int s = 0; ok && s < header.springCount; s++)
+			ok = a[s] >= 0 && a[s] < nodes && b[s] >= 0 && b[s] < nodes && type[s] >= 0 && type[s] < 3;
+		// and the kernels stream over the runs, which are never empty and
+		// cover the springs in order, as initSprings makes them
+		int end = 0;
+		for (int r = 0; ok && r < header.runCount; r++) {
+			ok = runs[r].first == end && runs[r].count > 0 && runs[r].first <= header.springCount - runs[r].count;
+			for (int s = runs[r].first + 1; ok && s < runs[r].first + runs[r].count; s++)
+				ok = a[s] == a[s - 1] + 1 && b[s] == b[s - 1] + 1 && type[s] == type[s - 1];
+			end = runs[r].first + runs[r].count;
+		}
+		ok = ok && end == header.springCount;
+		for (int i = 0; ok && i < header.resolution; i++)
+			ok = rows[i] >= 0 && rows[i] <= rows[i + 1];
+		ok = ok && rows[0] == 0 && rows[header.resolution] == header.runCount;
+	}
+	if (!ok) {
+		delete file;
+		return false;
+	}
+
+	bool running = stopSimulation();
+	if (header.resolution != meshResolution)
+		stopRecording();
+	meshResolution = header.resolution;
+	integrator = static_cast<Integrator>(header.integrator);
+	pinned = header.pinned != 0;
+	selfCollision = header.selfCollision != 0;
+	continuousCollision = header.continuousCollision != 0;
+	horizontal = header.horizontal != 0;
+	adaptiveTimeStep = header.adaptiveTimeStep != 0;
+	maxSubsteps = header.maxSubsteps;
+	xpbdIterations = header.xpbdIterations;
+	cgMaxIterations = header.cgMaxIterations;
+	impactPasses = header.impactPasses;
+	for (int k = 0; k < 3; k++) {
+		restLength[k] = header.restLength[k];
+		K[k] = header.K[k];
+		flowVelocity[k] = header.flowVelocity[k];
+		compliance[k] = header.compliance[k];
+	}
+	mass = header.mass;
+	gravity = header.gravity;
+	Cd = header.Cd;
+	Cv = header.Cv;
+	explicitTimeStep = header.explicitTimeStep;
+	maxStrainPerStep = header.maxStrainPerStep;
+	implicitTimeStep = header.implicitTimeStep;
+	xpbdTimeStep = header.xpbdTimeStep;
+	simulationTick = header.simulationTick;
+	cgTolerance = header.cgTolerance;
+	sleeping = header.sleeping != 0;
+	sleepSubsteps = header.sleepSubsteps;
+	multigrid = header.multigrid != 0;
+	deterministic = header.deterministic != 0;
+	sleepSpeed = header.sleepSpeed;
+	sleepStrainRate = header.sleepStrainRate;
+	membrane = header.membrane != 0;
+	warpStiffness = header.warpStiffness;
+	weftStiffness = header.weftStiffness;
+	shearStiffness = header.shearStiffness;
+	nodeLayout = ROW_MAJOR;
+	initLayout();
+
+	for (int c = 0; c < 3; c++) {
+		vertexPosition[c].borrow(reinterpret_cast<float*>(file->data() + header.sections[POSITION_X + c][0]), nodes);
+		vertexVelocity[c].borrow(reinterpret_cast<float*>(file->data() + header.sections[VELOCITY_X + c][0]), nodes);
+		vertexNormal[c].resize(nodes);
+		vertexForce[c].resize(nodes);
+	}
+	for (int c = 0; c < 6; c++)
+		faceNormal[c].resize(nodes + meshResolution + 1);
+	springA.borrow(reinterpret_cast<int*>(file->data() + header.sections[SPRING_A][0]), header.springCount);
+	springB.borrow(reinterpret_cast<int*>(file->data() + header.sections[SPRING_B][0]), header.springCount);
+	springRest.borrow(reinterpret_cast<float*>(file->data() + header.sections[SPRING_REST][0]), header.springCount);
+	springType.borrow(reinterpret_cast<int*>(file->data() + header.sections[SPRING_TYPE][0]), header.springCount);
+	springRuns.assign(runs, runs + header.runCount);
+	rowRuns.assign(rows, rows + header.resolution + 1);
+
+	// every array now points into the new mapping
+	releaseCheckpoint();
+	checkpointMapping = file;
+
+	initNodeStiffness();
+	initMembrane();
+	initConstraintColors();
+	initSelfCollision();
+	wakeAll();
+	computeNormals();
+	if (running)
+		startSimulation();
+	return true;
+}
@@ -0,0 +1,397 @@
+// Collisions of the cloth. Self-collision: a uniform spatial hash over the
+// nodes for the broad phase and particle-particle / particle-triangle
+// thickness tests for the narrow phase. Collider: swept and proximity
+// queries of every node against the collider's bounding volume hierarchy,
+// continuous tests of the cloth's triangles and edges against the collider's
+// vertices and edges, or lookups in the collider's signed distance field.
+#include "cloth.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+
+static unsigned hashCell(int x, int y, int z, unsigned mask) {
+	return (static_cast<unsigned>(x) * 73856093u ^ static_cast<unsigned>(y) * 19349663u ^ static_cast<unsigned>(z) * 83492791u) & mask;
+}
+
+void Cloth::initSelfCollision() {
+	int nodes = meshResolution * meshResolution;
+	// A node within the thickness of a triangle is within the thickness plus
+	// the longest triangle edge of its corner node, so one radius serves both
+	// tests. Edges are allowed to stretch by half their rest length.
+	collisionThickness = 0.4f * restLength[0];
+	collisionRadius = collisionThickness + 1.5f * restLength[1];
+	unsigned tableSize = 1;
+	while (tableSize < 2u * nodes)
+		tableSize <<= 1;
+	std::vector<std::atomic<int> >(tableSize).swap(hashCount);
+	hashStart.resize(tableSize + 1);
+	hashNodes.resize(nodes);
+	nodeCell.resize(nodes);
+	nodeCell.fill(-1);
+	for (int c = 0; c < 3; c++)
+		collisionCorrection[c].resize(nodes);
+
+	colliderThickness = 0.25f * restLength[0];
+	impactTime.resize(nodes);
+	for (int c = 0; c < 3; c++) {
+		substepStart[c].resize(nodes);
+		impactNormal[c].resize(nodes);
+	}
+}
+
+// a new collider can reach into sleeping bands, they all wake
+void Cloth::setCollider(const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& indices) {
+	collider.build(vertices, indices);
+	wakeAll();
+}
+
+void Cloth::setColliderField(const SignedDistanceField& field) {
+	colliderField = field;
+	wakeAll();
+}
+
+// Cells are collisionRadius wide, so all neighbours of a node are in the 27
+// cells around it. The nodes are counting-sorted by cell; as long as no node
+// moved to another cell the layout of the last substep is kept.
+void Cloth::buildSpatialHash() {
+	unsigned mask = static_cast<unsigned>(hashCount.size()) - 1;
+	float inverseCell = 1.0f / collisionRadius;
+	std::atomic<bool> moved(false);
+	parallelNodes([&](int begin, int end) {
+		bool changed = false;
+		for (int i = begin; i < end; i++) {
+			int cell = static_cast<int>(hashCell(static_cast<int>(floor(vertexPosition[0][i] * inverseCell)),
+				static_cast<int>(floor(vertexPosition[1][i] * inverseCell)),
+				static_cast<int>(floor(vertexPosition[2][i] * inverseCell)), mask));
+			if (cell != nodeCell[i]) {
+				nodeCell[i] = cell;
+				changed = true;
+			}
+		}
+		if (changed)
+			moved = true;
+	});
+	if (!moved)
+		return;
+
+	int cells = static_cast<int>(hashCount.size());
+	pool->run(pool->size(), [&](int t) {
+		for (int c = cells * t / pool->size(); c < cells * (t + 1) / pool->size(); c++)
+			hashCount[c].store(0, std::memory_order_relaxed);
+	});
+	parallelNodes([&](int begin, int end) {
+		for (int i = begin; i < end; i++)
+			hashCount[nodeCell[i]].fetch_add(1, std::memory_order_relaxed);
+	});
+	int sum = 0;
+	for (int c = 0; c < cells; c++) {
+		hashStart[c] = sum;
+		sum += hashCount[c].load(std::memory_order_relaxed);
+		hashCount[c].store(hashStart[c], std::memory_order_relaxed);
+	}
+	hashStart[cells] = sum;
+	parallelNodes([&](int begin, int end) {
+		for (int i = begin; i < end; i++)
+			hashNodes[hashCount[nodeCell[i]].fetch_add(1, std::memory_order_relaxed)] = i;
+	});
+
+	// the threads fill a slot in whatever order they get there; sorted, the
+	// narrow phase adds up every node's pushes in the same order each run
+	if (deterministic) {
+		pool->run(pool->size(), [&](int t) {
+			for (int c = cells * t / pool->size(); c < cells * (t + 1) / pool->size(); c++) {
+				if (hashStart[c + 1] - hashStart[c] > 1)
+					std::sort(hashNodes.data() + hashStart[c], hashNodes.data() + hashStart[c + 1]);
+			}
+		});
+	}
+}
+
+// Each node gathers the pushes from everything within the thickness and
+// only moves itself, so the narrow phase runs in parallel without write
+// conflicts. Node pairs are seen from both sides and each side takes half;
+// a node inside a triangle's thickness is moved all the way out.
+// Nodes closer than three rows and columns on the grid are left to the
+// springs. Velocities lose their component into the contact.
+void Cloth::resolveSelfCollisions(float stepSize) {
+	buildSpatialHash();
+
+	unsigned mask = static_cast<unsigned>(hashCount.size()) - 1;
+	float inverseCell = 1.0f / collisionRadius;
+	float h = collisionThickness, r2 = collisionRadius * collisionRadius;
+	int n = meshResolution;
+	parallelNodes([&](int begin, int end) {
+		for (int p = begin; p < end; p++) {
+			glm::vec3 correction(0.0f);
+			if (isPinned(p)) {
+				store3(collisionCorrection, p, correction);
+				continue;
+			}
+			glm::vec3 x = load3(vertexPosition, p);
+			int pNode = gridIndex(p), pi = pNode / n, pj = pNode % n;
+			int cx = static_cast<int>(floor(x.x * inverseCell)), cy = static_cast<int>(floor(x.y * inverseCell)),
+				cz = static_cast<int>(floor(x.z * inverseCell));
+
+			// neighbouring cells can share a hash slot, visit every slot once
+			unsigned visited[27];
+			int visitedCount = 0;
+			for (int dz = -1; dz <= 1; dz++) for (int dy = -1; dy <= 1; dy++) for (int dx = -1; dx <= 1; dx++) {
+				unsigned cell = hashCell(cx + dx, cy + dy, cz + dz, mask);
+				if (std::find(visited, visited + visitedCount, cell) != visited + visitedCount)
+					continue;
+				visited[visitedCount++] = cell;
+
+				for (int k = hashStart[cell]; k < hashStart[cell + 1]; k++) {
+					int q = hashNodes[k];
+					int qNode = gridIndex(q), qi = qNode / n, qj = qNode % n;
+					if (abs(qi - pi) <= 2 && abs(qj - pj) <= 2)
+						continue;
+					glm::vec3 d = x - load3(vertexPosition, q);
+					float d2 = glm::dot(d, d);
+					if (d2 >= r2)
+						continue;
+
+					// particle-particle
+					if (d2 < h * h && d2 > 0.0f) {
+						float len = sqrt(d2);
+						correction += d * (0.5f * (h - len) / len);
+					}
+
+					// particle-triangle, for both triangles of the quad q is the corner of
+					if (qi == n - 1 || qj == n - 1)
+						continue;
+					glm::vec3 a = load3(vertexPosition, q), right = load3(vertexPosition, nodeIndex(qi, qj + 1));
+					glm::vec3 down = load3(vertexPosition, nodeIndex(qi + 1, qj)), diagonal = load3(vertexPosition, nodeIndex(qi + 1, qj + 1));
+					glm::vec3 lower = glm::min(glm::min(a, right), glm::min(down, diagonal)) - glm::vec3(h);
+					glm::vec3 upper = glm::max(glm::max(a, right), glm::max(down, diagonal)) + glm::vec3(h);
+					if (glm::any(glm::lessThan(x, lower)) || glm::any(glm::greaterThan(x, upper)))
+						continue;
+					glm::vec3 corners[2][2] = { { right, diagonal }, { diagonal, down } };
+					for (int t = 0; t < 2; t++) {
+						glm::vec3 b = corners[t][0], c = corners[t][1];
+						glm::vec3 normal = glm::cross(b - a, c - a);
+						float area = glm::length(normal);
+						if (area == 0.0f)
+							continue;
+						normal /= area;
+						glm::vec3 e = x - TriangleBvh::closestOnTriangle(x, a, b, c);
+						float distance = glm::length(e);
+						if (distance >= h)
+							continue;
+						// push out to the side of the triangle the node is on
+						float side = glm::dot(x - a, normal) < 0.0f ? -1.0f : 1.0f;
+						correction += normal * (side * (h - distance));
+					}
+				}
+			}
+			store3(collisionCorrection, p, correction);
+		}
+	});
+
+	parallelNodes([&](int begin, int end) {
+		for (int p = begin; p < end; p++) {
+			glm::vec3 correction = load3(collisionCorrection, p);
+			float length = glm::length(correction);
+			if (length == 0.0f)
+				continue;
+			// a sleeping node is only moved, and its tile woken, by a push
+			// faster than sleepSpeed; a resting contact leaves it asleep
+			if (isAsleep(p)) {
+				if (length <= sleepSpeed * stepSize)
+					continue;
+				int tile = tileOf(p);
+				tileAsleep[tile] = 0;
+				quietSubsteps[tile] = 0;
+			}
+			store3(vertexPosition, p, load3(vertexPosition, p) + correction);
+			glm::vec3 u = correction / length, v = load3(vertexVelocity, p);
+			float approach = glm::dot(v, u);
+			if (approach < 0.0f)
+				store3(vertexVelocity, p, v - u * approach);
+		}
+	});
+}
+
+// A node whose path over the substep crossed a triangle is put back on the
+// side it came from, colliderThickness off the surface; one that merely ended
+// up too close is pushed out along the closest point. The queries only read
+// the hierarchy, so every node does its own stackless walk in parallel.
+void Cloth::resolveColliderContacts() {
+	float h = colliderThickness;
+	// the collider does not move, sleeping tiles stay where the last
+	// contact left them
+	std::vector<char> awake;
+	awakeTiles(awake);
+	parallelNodes(awake, [&](int begin, int end) {
+		for (int p = begin; p < end; p++) {
+			if (isPinned(p))
+				continue;
+			glm::vec3 from = load3(substepStart, p), to = load3(vertexPosition, p);
+			glm::vec3 normal, direction, point;
+			float t;
+			if (collider.intersectSegment(from, to, t, normal)) {
+				direction = glm::dot(to - from, normal) > 0.0f ? -normal : normal;
+				point = from + (to - from) * t + direction * h;
+			} else if (collider.closestPoint(to, h, point, normal)) {
+				glm::vec3 e = to - point;
+				float distance = glm::length(e);
+				direction = distance > 0.0f ? e / distance : normal;
+				point += direction * h;
+			} else {
+				continue;
+			}
+			store3(vertexPosition, p, point);
+			glm::vec3 v = load3(vertexVelocity, p);
+			float approach = glm::dot(v, direction);
+			if (approach < 0.0f)
+				store3(vertexVelocity, p, v - direction * approach);
+		}
+	});
+}
+
+// Nodes less than colliderThickness from the surface, or behind it, are
+// moved out along the gradient of the field.
+void Cloth::resolveFieldContacts() {
+	float h = colliderThickness;
+	// sleeping tiles stay where the last contact left them, as above
+	std::vector<char> awake;
+	awakeTiles(awake);
+	parallelNodes(awake, [&](int begin, int end) {
+		for (int p = begin; p < end; p++) {
+			if (isPinned(p))
+				continue;
+			glm::vec3 x = load3(vertexPosition, p), gradient;
+			float distance;
+			if (!colliderField.sample(x, distance, gradient) || distance >= h)
+				continue;
+			float length = glm::length(gradient);
+			if (length == 0.0f)
+				continue;
+			glm::vec3 direction = gradient / length;
+			store3(vertexPosition, p, x + direction * (h - distance));
+			glm::vec3 v = load3(vertexVelocity, p);
+			float approach = glm::dot(v, direction);
+			if (approach < 0.0f)
+				store3(vertexVelocity, p, v - direction * approach);
+		}
+	});
+}
+
+// Thin parts of the collider can pass between the nodes, so its vertices are
+// also tested against the moving cloth triangles and its edges against the
+// cloth edges. Every quad collects the collider triangles its swept box
+// overlaps and runs the cubic tests on those only. The nodes of an impact
+// are moved back along their path to colliderThickness before it, slide on
+// for the rest of the substep and lose their velocity towards the collider.
+// Returns the number of nodes moved; moving them can cause new impacts.
+int Cloth::resolveColliderImpacts() {
+	int n = meshResolution;
+	float h = colliderThickness, tolerance = 0.01f * colliderThickness;
+	parallelNodes([&](int begin, int end) {
+		for (int p = begin; p < end; p++)
+			impactTime[p] = 1.0f;
+	});
+
+	// the triangles and edges of quad (i, j) as corners a, right, down,
+	// diagonal; the last row and column bring the border edges
+	static const int triangles[2][3] = { { 0, 1, 3 }, { 0, 3, 2 } };
+	static const int edges[5][2] = { { 0, 1 }, { 0, 2 }, { 0, 3 }, { 1, 3 }, { 2, 3 } };
+	parallelQuads([&](int rowBegin, int rowEnd) {
+		std::vector<int> candidates;
+		for (int i = rowBegin; i < rowEnd; i++) {
+			for (int j = 0; j < n - 1; j++) {
+				int node[4] = { nodeIndex(i, j), nodeIndex(i, j + 1), nodeIndex(i + 1, j), nodeIndex(i + 1, j + 1) };
+				glm::vec3 from[4], to[4];
+				glm::vec3 lower(FLT_MAX), upper(-FLT_MAX);
+				for (int k = 0; k < 4; k++) {
+					from[k] = load3(substepStart, node[k]);
+					to[k] = load3(vertexPosition, node[k]);
+					lower = glm::min(lower, glm::min(from[k], to[k]));
+					upper = glm::max(upper, glm::max(from[k], to[k]));
+				}
+				lower -= glm::vec3(h);
+				upper += glm::vec3(h);
+				candidates.clear();
+				collider.overlapping(lower, upper, candidates);
+				int edgeCount = 3 + (j == n - 2) + (i == n - 2);
+				int ownedEdges[5] = { 0, 1, 2, j == n - 2 ? 3 : 4, 4 };
+
+				// moves the given corners back to h before the impact at t
+				auto impact = [&](const int* corners, int count, float t, glm::vec3 direction) {
+					float approach = 0.0f;
+					for (int c = 0; c < count; c++)
+						approach = std::max(approach, -glm::dot(to[corners[c]] - from[corners[c]], direction));
+					float safe = approach > 0.0f ? std::max(t - h / approach, 0.0f) : t;
+					for (int c = 0; c < count; c++) {
+						int p = node[corners[c]];
+						if (safe < impactTime[p]) {
+							impactTime[p] = safe;
+							store3(impactNormal, p, direction);
+						}
+					}
+				};
+
+				for (size_t m = 0; m < candidates.size(); m++) {
+					glm::vec3 corner[3];
+					collider.corners(candidates[m], corner[0], corner[1], corner[2]);
+					for (int v = 0; v < 3; v++) {
+						if (glm::any(glm::lessThan(corner[v], lower)) || glm::any(glm::greaterThan(corner[v], upper)))
+							continue;
+						for (int f = 0; f < 2; f++) {
+							const int* tri = triangles[f];
+							glm::vec3 start[4] = { corner[v], from[tri[0]], from[tri[1]], from[tri[2]] };
+							glm::vec3 finish[4] = { corner[v], to[tri[0]], to[tri[1]], to[tri[2]] };
+							float t;
+							if (!vertexTriangleImpact(start, finish, tolerance, t))
+								continue;
+							glm::vec3 normal = glm::cross(start[2] - start[1], start[3] - start[1]);
+							if (glm::length(normal) == 0.0f)
+								continue;
+							normal = glm::normalize(normal);
+							// back towards the side of the vertex the triangle came from
+							glm::vec3 centroid = (start[1] + start[2] + start[3]) / 3.0f;
+							impact(tri, 3, t, glm::dot(centroid - corner[v], normal) < 0.0f ? -normal : normal);
+						}
+					}
+					for (int e = 0; e < edgeCount; e++) {
+						const int* edge = edges[ownedEdges[e]];
+						for (int v = 0; v < 3; v++) {
+							glm::vec3 start[4] = { from[edge[0]], from[edge[1]], corner[v], corner[(v + 1) % 3] };
+							glm::vec3 finish[4] = { to[edge[0]], to[edge[1]], corner[v], corner[(v + 1) % 3] };
+							float t, s, u;
+							if (!edgeEdgeImpact(start, finish, tolerance, t))
+								continue;
+							// away from the collider edge, the way the cloth edge came from
+							segmentDistance(start[0], start[1], start[2], start[3], s, u);
+							glm::vec3 direction = start[0] + (start[1] - start[0]) * s - (start[2] + (start[3] - start[2]) * u);
+							if (glm::length(direction) == 0.0f)
+								continue;
+							impact(edge, 2, t, glm::normalize(direction));
+						}
+					}
+				}
+			}
+		}
+	});
+
+	std::atomic<int> moved(0);
+	parallelNodes([&](int begin, int end) {
+		for (int p = begin; p < end; p++) {
+			if (impactTime[p] >= 1.0f || isPinned(p))
+				continue;
+			moved.fetch_add(1, std::memory_order_relaxed);
+			// up to the impact along the path, then on along the surface
+			glm::vec3 from = load3(substepStart, p), direction = load3(impactNormal, p);
+			glm::vec3 d = load3(vertexPosition, p) - from;
+			glm::vec3 slide = d - direction * std::min(glm::dot(d, direction), 0.0f);
+			store3(vertexPosition, p, from + d * impactTime[p] + slide * (1.0f - impactTime[p]));
+			glm::vec3 v = load3(vertexVelocity, p);
+			float approach = glm::dot(v, direction);
+			if (approach < 0.0f)
+				store3(vertexVelocity, p, v - direction * approach);
+		}
+	});
+	return moved;
+}
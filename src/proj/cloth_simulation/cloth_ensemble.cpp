@@ -0,0 +1,253 @@
+#include "cloth_ensemble.h"
+
+#include "cloth.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+ClothEnsemble::Variant::Variant() {
+	mass = 1.0;
+	K[0] = K[1] = K[2] = 25000.0;
+	Cd = 0.5;
+	Cv = 0.5;
+}
+
+ClothEnsemble::ClothEnsemble(int resolution) {
+	meshResolution = std::max(resolution, 2);
+	gravity = 9.8;
+	flowVelocity = glm::vec3(0.0f, 0.0f, 1.0f);
+	timeStep = 0.001;
+	simulationTick = 0.01;
+	maxSimdIsa = simdIsa = cloth_kernels::detectIsa();
+	pool = NULL;
+	setThreadCount(std::thread::hardware_concurrency());
+
+	restLength[0] = 4.0 / static_cast<float>(meshResolution - 1);
+	restLength[1] = sqrt(2.0) * 4.0 / static_cast<float>(meshResolution - 1);
+	restLength[2] = 2.0 * restLength[0];
+	std::vector<int> a, b, type, rows;
+	std::vector<float> rest;
+	std::vector<SpringRun> runs;
+	appendGridSprings(meshResolution, 0, restLength, a, b, rest, type, runs, rows);
+	springA.assign(a.data(), a.size());
+	springB.assign(b.data(), b.size());
+	springRest.assign(rest.data(), rest.size());
+	springType.assign(type.data(), type.size());
+
+	std::vector<int> count(3 * meshResolution * meshResolution, 0);
+	for (size_t s = 0; s < a.size(); s++) {
+		count[3 * a[s] + type[s]]++;
+		count[3 * b[s] + type[s]]++;
+	}
+	for (int t = 0; t < 3; t++) {
+		nodeSprings[t] = 0;
+		for (int i = 0; i < meshResolution * meshResolution; i++)
+			nodeSprings[t] = std::max(nodeSprings[t], count[3 * i + t]);
+	}
+
+	setVariants(std::vector<Variant>(1));
+}
+
+ClothEnsemble::~ClothEnsemble() {
+	delete pool;
+}
+
+void ClothEnsemble::setThreadCount(int threads) {
+	delete pool;
+	pool = new ThreadPool(threads > 0 ? threads : 1);
+}
+
+void ClothEnsemble::setVariants(const std::vector<Variant>& list) {
+	variants = list;
+	int blocks = (variantCount() + ensembleLanes - 1) / ensembleLanes;
+	blockParams.resize(blocks);
+	for (int block = 0; block < blocks; block++) {
+		EnsembleParams& params = blockParams[block];
+		for (int l = 0; l < ensembleLanes; l++) {
+			const Variant& v = variants[std::min(block * ensembleLanes + l, variantCount() - 1)];
+			params.mass[l] = v.mass;
+			for (int t = 0; t < 3; t++)
+				params.K[t][l] = v.K[t];
+			params.Cd[l] = v.Cd;
+			params.Cv[l] = v.Cv;
+		}
+	}
+	initBlocks();
+}
+
+// every block starts from the flat cloth of Cloth::initMesh
+void ClothEnsemble::initBlocks() {
+	int floats = blockCount() * blockFloats();
+	for (int c = 0; c < 3; c++) {
+		vertexPosition[c].resize(floats);
+		vertexVelocity[c].resize(floats);
+		vertexNormal[c].resize(floats);
+		vertexForce[c].resize(floats);
+	}
+	for (int c = 0; c < 6; c++)
+		faceNormal[c].resize(blockCount() * faceFloats());
+	pool->run(blockCount(), [&](int block) {
+		for (int i = 0; i < meshResolution; i++) {
+			for (int j = 0; j < meshResolution; j++) {
+				glm::vec3 initPosition(-2.0 + 4.0*j / static_cast<float>(meshResolution - 1), -2.0 + 4.0*i / static_cast<float>(meshResolution - 1), 0.0);
+				int id = block * blockFloats() + (i * meshResolution + j) * ensembleLanes;
+				for (int c = 0; c < 3; c++)
+					std::fill(&vertexPosition[c][0] + id, &vertexPosition[c][0] + id + ensembleLanes, initPosition[c]);
+			}
+		}
+		cloth_kernels::ensembleNormals(simdIsa, particleView(block), faceView(block), meshResolution);
+	});
+}
+
+ParticleView ClothEnsemble::particleView(int block) {
+	int offset = block * blockFloats();
+	ParticleView p;
+	p.px = vertexPosition[0].data() + offset; p.py = vertexPosition[1].data() + offset; p.pz = vertexPosition[2].data() + offset;
+	p.vx = vertexVelocity[0].data() + offset; p.vy = vertexVelocity[1].data() + offset; p.vz = vertexVelocity[2].data() + offset;
+	p.nx = vertexNormal[0].data() + offset; p.ny = vertexNormal[1].data() + offset; p.nz = vertexNormal[2].data() + offset;
+	p.fx = vertexForce[0].data() + offset; p.fy = vertexForce[1].data() + offset; p.fz = vertexForce[2].data() + offset;
+	return p;
+}
+
+FaceView ClothEnsemble::faceView(int block) {
+	int offset = block * faceFloats() + (meshResolution + 1) * ensembleLanes;
+	FaceView faces;
+	faces.ax = faceNormal[0].data() + offset; faces.ay = faceNormal[1].data() + offset; faces.az = faceNormal[2].data() + offset;
+	faces.bx = faceNormal[3].data() + offset; faces.by = faceNormal[4].data() + offset; faces.bz = faceNormal[5].data() + offset;
+	return faces;
+}
+
+// the bound of Cloth::stableTimeStep for the stiffest variant at rest
+float ClothEnsemble::substepSize() {
+	const float safety = 0.8f;
+	float step = timeStep;
+	for (int v = 0; v < variantCount(); v++) {
+		float stiffness = 0.0f;
+		for (int t = 0; t < 3; t++)
+			stiffness += nodeSprings[t] * variants[v].K[t];
+		if (stiffness > 0.0f)
+			step = std::min(step, safety * 2.0f / std::sqrt(2.0f * stiffness / variants[v].mass));
+	}
+	return step;
+}
+
+int ClothEnsemble::advance(float frameTime) {
+	int n = static_cast<int>(ceil(frameTime / substepSize() - 1e-4));
+	n = std::max(n, 1);
+	float step = frameTime / n;
+	pool->run(blockCount(), [&](int block) {
+		for (int i = 0; i < n; i++)
+			simulate(block, step);
+		cloth_kernels::ensembleNormals(simdIsa, particleView(block), faceView(block), meshResolution);
+	});
+	return n;
+}
+
+// symplectic Euler as in Cloth::simulate, for every variant of the block
+void ClothEnsemble::simulate(int block, float stepSize) {
+	ParticleView particles = particleView(block);
+	SpringView springs;
+	springs.a = springA.data();
+	springs.b = springB.data();
+	springs.rest = springRest.data();
+	springs.type = springType.data();
+	ForceParams shared;
+	for (int t = 0; t < 3; t++)
+		shared.flowVelocity[t] = flowVelocity[t];
+	shared.gravity = gravity;
+	shared.stepSize = stepSize;
+	shared.mass = shared.Cd = shared.Cv = 0.0f; // per lane instead
+
+	int pins[2] = { (meshResolution - 1) * meshResolution, meshResolution * meshResolution - 1 };
+	float pinPosition[2][3];
+	for (int k = 0; k < 2; k++) {
+		for (int c = 0; c < 3; c++)
+			pinPosition[k][c] = vertexPosition[c][block * blockFloats() + pins[k] * ensembleLanes];
+	}
+
+	cloth_kernels::ensembleSprings(simdIsa, particles, springs, blockParams[block], 0, static_cast<int>(springA.size()));
+	cloth_kernels::ensembleIntegrate(simdIsa, particles, shared, blockParams[block], 0, meshResolution * meshResolution);
+
+	for (int k = 0; k < 2; k++) {
+		int id = block * blockFloats() + pins[k] * ensembleLanes;
+		for (int c = 0; c < 3; c++)
+			std::fill(&vertexPosition[c][0] + id, &vertexPosition[c][0] + id + ensembleLanes, pinPosition[k][c]);
+	}
+}
+
+// one result per variant, from the lanes they were packed into
+std::vector<ClothEnsemble::Result> ClothEnsemble::results() {
+	std::vector<Result> list(variantCount());
+	int nodes = meshResolution * meshResolution;
+	pool->run(variantCount(), [&](int v) {
+		int block = v / ensembleLanes, lane = v % ensembleLanes;
+		const float* x[3], *u[3];
+		for (int c = 0; c < 3; c++) {
+			x[c] = vertexPosition[c].data() + block * blockFloats() + lane;
+			u[c] = vertexVelocity[c].data() + block * blockFloats() + lane;
+		}
+		Result& r = list[v];
+		r.kineticEnergy = 0.0;
+		r.springEnergy = 0.0;
+		r.lowestHeight = x[1][0];
+		r.maxStretch = 0.0f;
+		r.finite = true;
+		double height = 0.0;
+		for (int i = 0; i < nodes; i++) {
+			int id = i * ensembleLanes;
+			glm::vec3 position(x[0][id], x[1][id], x[2][id]), velocity(u[0][id], u[1][id], u[2][id]);
+			// the pins do not move, whatever the integrator leaves in their velocity
+			if (i != (meshResolution - 1) * meshResolution && i != nodes - 1)
+				r.kineticEnergy += 0.5 * variants[v].mass * glm::dot(velocity, velocity);
+			height += position.y;
+			r.lowestHeight = std::min(r.lowestHeight, position.y);
+			r.finite = r.finite && std::isfinite(position.x) && std::isfinite(position.y) && std::isfinite(position.z);
+		}
+		r.meanHeight = static_cast<float>(height / nodes);
+		for (int s = 0; s < static_cast<int>(springA.size()); s++) {
+			int a = springA[s] * ensembleLanes, b = springB[s] * ensembleLanes;
+			glm::vec3 d(x[0][a] - x[0][b], x[1][a] - x[1][b], x[2][a] - x[2][b]);
+			float length = glm::length(d);
+			double stretch = length - springRest[s];
+			r.springEnergy += 0.5 * variants[v].K[springType[s]] * stretch * stretch;
+			r.maxStretch = std::max(r.maxStretch, length / springRest[s] - 1.0f);
+		}
+	});
+	return list;
+}
+
+bool loadVariants(const std::string& path, std::vector<ClothEnsemble::Variant>& variants) {
+	FILE* file = fopen(path.c_str(), "r");
+	if (!file)
+		return false;
+	variants.clear();
+	char line[1024];
+	bool ok = fgets(line, sizeof(line), file) != NULL; // the header
+	while (ok && fgets(line, sizeof(line), file)) {
+		if (line[strspn(line, " \t\r\n")] == '\0')
+			continue;
+		ClothEnsemble::Variant v;
+		ok = sscanf(line, "%f,%f,%f,%f,%f,%f", &v.mass, &v.K[0], &v.K[1], &v.K[2], &v.Cd, &v.Cv) == 6 && v.mass > 0.0f;
+		if (ok)
+			variants.push_back(v);
+	}
+	fclose(file);
+	return ok && !variants.empty();
+}
+
+bool saveResults(const std::string& path, const std::vector<ClothEnsemble::Variant>& variants,
+	const std::vector<ClothEnsemble::Result>& results) {
+	FILE* file = fopen(path.c_str(), "w");
+	if (!file)
+		return false;
+	fprintf(file, "mass,k_structural,k_shear,k_bending,cd,cv,kinetic_energy,spring_energy,mean_height,lowest_height,max_stretch,finite\n");
+	for (size_t v = 0; v < variants.size() && v < results.size(); v++) {
+		const ClothEnsemble::Variant& p = variants[v];
+		const ClothEnsemble::Result& r = results[v];
+		fprintf(file, "%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%d\n", p.mass, p.K[0], p.K[1], p.K[2], p.Cd, p.Cv,
+			r.kineticEnergy, r.springEnergy, r.meanHeight, r.lowestHeight, r.maxStretch, r.finite ? 1 : 0);
+	}
+	return fclose(file) == 0;
+}
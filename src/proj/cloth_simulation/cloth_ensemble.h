@@ -0,0 +1,110 @@
+#ifndef CLOTH_ENSEMBLE_H
+#define CLOTH_ENSEMBLE_H
+
+// Many variants of one cloth that differ only in their mass, stiffness and
+// damping, for sweeping material parameters. Every variant is the grid of
+// Cloth hanging from its two top corners, with the explicit integrator.
+// Variants are packed ensembleLanes to a block, interleaved node by node
+// (see EnsembleParams), so every kernel call advances a whole block; the
+// blocks never interact and each one runs all its substeps on one thread.
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+
+#include "aligned_array.h"
+#include "cloth_kernels.h"
+#include "thread_pool.h"
+
+class ClothEnsemble {
+    public:
+		struct Variant {
+			float mass;
+			float K[3]; // structural, shear and bending, as in Cloth
+			float Cd; // damping
+			float Cv; // viscosity
+			Variant();
+		};
+
+		// how a variant ended up, see results
+		struct Result {
+			double kineticEnergy;
+			double springEnergy;
+			float meanHeight;
+			float lowestHeight;
+			float maxStretch; // largest length over rest length of a spring, minus one
+			bool finite; // every position is still a number
+		};
+
+		// settings, only change these between advance calls
+		cloth_kernels::Isa simdIsa;
+		float timeStep; // largest substep, smaller if a variant needs it to stay stable
+		float simulationTick;
+
+		ClothEnsemble(int resolution = 20);
+		~ClothEnsemble();
+
+		// replaces the variants, which all start over from the flat cloth
+		void setVariants(const std::vector<Variant>& variants);
+
+		int resolution() const { return meshResolution; }
+		int variantCount() const { return static_cast<int>(variants.size()); }
+		int blockCount() const { return static_cast<int>(blockParams.size()); }
+		int threadCount() const { return pool->size(); }
+		cloth_kernels::Isa bestIsa() const { return maxSimdIsa; }
+		void setThreadCount(int threads);
+
+		// the substep advance takes, stable for the stiffest variant
+		float substepSize();
+
+		// advances every variant by frameTime and returns the number of substeps
+		int advance(float frameTime);
+		std::vector<Result> results();
+
+    private:
+		int meshResolution;
+		float restLength[3];
+		float gravity;
+		glm::vec3 flowVelocity;
+
+		std::vector<Variant> variants;
+		// the variants of every block; lanes past the last variant repeat it
+		std::vector<EnsembleParams> blockParams;
+
+		// block after block, ensembleLanes floats per node
+		AlignedArray<float> vertexPosition[3];
+		AlignedArray<float> vertexNormal[3];
+		AlignedArray<float> vertexVelocity[3];
+		AlignedArray<float> vertexForce[3];
+		AlignedArray<float> faceNormal[6]; // see FaceView, one padded grid per block
+
+		// the springs of the grid, as Cloth builds them
+		AlignedArray<int> springA;
+		AlignedArray<int> springB;
+		AlignedArray<float> springRest;
+		AlignedArray<int> springType;
+		// the most springs of each type around one node
+		int nodeSprings[3];
+
+		ThreadPool* pool;
+
+		cloth_kernels::Isa maxSimdIsa;
+
+		void initBlocks();
+		void simulate(int block, float timeStep);
+		int blockFloats() const { return meshResolution * meshResolution * ensembleLanes; }
+		int faceFloats() const { return (meshResolution * meshResolution + meshResolution + 1) * ensembleLanes; }
+		ParticleView particleView(int block);
+		FaceView faceView(int block);
+};
+
+// Variants as comma separated values: a header line, then one variant per
+// line as mass, K[0], K[1], K[2], Cd, Cv.
+bool loadVariants(const std::string& path, std::vector<ClothEnsemble::Variant>& variants);
+
+// the same columns followed by those of every variant's result
+bool saveResults(const std::string& path, const std::vector<ClothEnsemble::Variant>& variants,
+	const std::vector<ClothEnsemble::Result>& results);
+
+#endif
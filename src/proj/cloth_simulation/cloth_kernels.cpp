@@ -0,0 +1,171 @@
+// Scalar build of the cloth kernels plus the runtime dispatchers.
+#include "cloth_kernels_impl.h"
+
+#if CLOTH_KERNELS_X86 && defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+namespace cloth_kernels {
+
+#if CLOTH_KERNELS_X86
+namespace sse4 {
+void accumulateSprings(const ParticleView& p, const SpringView& springs, const float K[3],
+	const SpringRun* runs, int runCount);
+void accumulateMembrane(const ParticleView& p, const MembraneView& m, const float stiffness[3],
+	int resolution, int rowBegin, int rowEnd, int columnBegin, int columnEnd);
+void integrateVelocities(const ParticleView& p, const ForceParams& params, int begin, int end);
+void integratePositions(const ParticleView& p, float stepSize, int begin, int end);
+void faceNormals(const ParticleView& p, const FaceView& faces, int resolution, int rowBegin, int rowEnd);
+void gatherNormals(const ParticleView& p, const FaceView& faces, int resolution, int begin, int end);
+void ensembleSprings(const ParticleView& p, const SpringView& springs, const EnsembleParams& params, int first, int last);
+void ensembleIntegrate(const ParticleView& p, const ForceParams& shared, const EnsembleParams& params, int begin, int end);
+void ensembleNormals(const ParticleView& p, const FaceView& faces, int resolution);
+}
+namespace avx2 {
+void accumulateSprings(const ParticleView& p, const SpringView& springs, const float K[3],
+	const SpringRun* runs, int runCount);
+void accumulateMembrane(const ParticleView& p, const MembraneView& m, const float stiffness[3],
+	int resolution, int rowBegin, int rowEnd, int columnBegin, int columnEnd);
+void integrateVelocities(const ParticleView& p, const ForceParams& params, int begin, int end);
+void integratePositions(const ParticleView& p, float stepSize, int begin, int end);
+void faceNormals(const ParticleView& p, const FaceView& faces, int resolution, int rowBegin, int rowEnd);
+void gatherNormals(const ParticleView& p, const FaceView& faces, int resolution, int begin, int end);
+void ensembleSprings(const ParticleView& p, const SpringView& springs, const EnsembleParams& params, int first, int last);
+void ensembleIntegrate(const ParticleView& p, const ForceParams& shared, const EnsembleParams& params, int begin, int end);
+void ensembleNormals(const ParticleView& p, const FaceView& faces, int resolution);
+}
+#endif
+
+Isa detectIsa() {
+#if CLOTH_KERNELS_X86 && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+	__cpuid(info, 1);
+	bool sse41 = (info[2] & (1 << 19)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	bool avx2 = false;
+	// the OS has to save the YMM registers as well
+	if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6) {
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+	}
+	if (avx2)
+		return ISA_AVX2;
+	if (sse41)
+		return ISA_SSE4;
+#elif CLOTH_KERNELS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return ISA_AVX2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return ISA_SSE4;
+#endif
+	return ISA_SCALAR;
+}
+
+const char* isaName(Isa isa) {
+	switch (isa) {
+	case ISA_AVX2: return "AVX2";
+	case ISA_SSE4: return "SSE4.1";
+	default: return "scalar";
+	}
+}
+
+void accumulateSprings(Isa isa, const ParticleView& p, const SpringView& springs, const float K[3],
+	const SpringRun* runs, int runCount) {
+	switch (isa) {
+#if CLOTH_KERNELS_X86
+	case ISA_AVX2: avx2::accumulateSprings(p, springs, K, runs, runCount); return;
+	case ISA_SSE4: sse4::accumulateSprings(p, springs, K, runs, runCount); return;
+#endif
+	default: scalar::accumulateSprings(p, springs, K, runs, runCount); return;
+	}
+}
+
+void accumulateMembrane(Isa isa, const ParticleView& p, const MembraneView& m, const float stiffness[3],
+	int resolution, int rowBegin, int rowEnd, int columnBegin, int columnEnd) {
+	switch (isa) {
+#if CLOTH_KERNELS_X86
+	case ISA_AVX2: avx2::accumulateMembrane(p, m, stiffness, resolution, rowBegin, rowEnd, columnBegin, columnEnd); return;
+	case ISA_SSE4: sse4::accumulateMembrane(p, m, stiffness, resolution, rowBegin, rowEnd, columnBegin, columnEnd); return;
+#endif
+	default: scalar::accumulateMembrane(p, m, stiffness, resolution, rowBegin, rowEnd, columnBegin, columnEnd); return;
+	}
+}
+
+void integrateVelocities(Isa isa, const ParticleView& p, const ForceParams& params, int begin, int end) {
+	switch (isa) {
+#if CLOTH_KERNELS_X86
+	case ISA_AVX2: avx2::integrateVelocities(p, params, begin, end); return;
+	case ISA_SSE4: sse4::integrateVelocities(p, params, begin, end); return;
+#endif
+	default: scalar::integrateVelocities(p, params, begin, end); return;
+	}
+}
+
+void integratePositions(Isa isa, const ParticleView& p, float stepSize, int begin, int end) {
+	switch (isa) {
+#if CLOTH_KERNELS_X86
+	case ISA_AVX2: avx2::integratePositions(p, stepSize, begin, end); return;
+	case ISA_SSE4: sse4::integratePositions(p, stepSize, begin, end); return;
+#endif
+	default: scalar::integratePositions(p, stepSize, begin, end); return;
+	}
+}
+
+void faceNormals(Isa isa, const ParticleView& p, const FaceView& faces, int resolution, int rowBegin, int rowEnd) {
+	switch (isa) {
+#if CLOTH_KERNELS_X86
+	case ISA_AVX2: avx2::faceNormals(p, faces, resolution, rowBegin, rowEnd); return;
+	case ISA_SSE4: sse4::faceNormals(p, faces, resolution, rowBegin, rowEnd); return;
+#endif
+	default: scalar::faceNormals(p, faces, resolution, rowBegin, rowEnd); return;
+	}
+}
+
+void gatherNormals(Isa isa, const ParticleView& p, const FaceView& faces, int resolution, int begin, int end) {
+	switch (isa) {
+#if CLOTH_KERNELS_X86
+	case ISA_AVX2: avx2::gatherNormals(p, faces, resolution, begin, end); return;
+	case ISA_SSE4: sse4::gatherNormals(p, faces, resolution, begin, end); return;
+#endif
+	default: scalar::gatherNormals(p, faces, resolution, begin, end); return;
+	}
+}
+
+void ensembleSprings(Isa isa, const ParticleView& p, const SpringView& springs, const EnsembleParams& params,
+	int first, int last) {
+	switch (isa) {
+#if CLOTH_KERNELS_X86
+	case ISA_AVX2: avx2::ensembleSprings(p, springs, params, first, last); return;
+	case ISA_SSE4: sse4::ensembleSprings(p, springs, params, first, last); return;
+#endif
+	default: scalar::ensembleSprings(p, springs, params, first, last); return;
+	}
+}
+
+void ensembleIntegrate(Isa isa, const ParticleView& p, const ForceParams& shared, const EnsembleParams& params,
+	int begin, int end) {
+	switch (isa) {
+#if CLOTH_KERNELS_X86
+	case ISA_AVX2: avx2::ensembleIntegrate(p, shared, params, begin, end); return;
+	case ISA_SSE4: sse4::ensembleIntegrate(p, shared, params, begin, end); return;
+#endif
+	default: scalar::ensembleIntegrate(p, shared, params, begin, end); return;
+	}
+}
+
+void ensembleNormals(Isa isa, const ParticleView& p, const FaceView& faces, int resolution) {
+	switch (isa) {
+#if CLOTH_KERNELS_X86
+	case ISA_AVX2: avx2::ensembleNormals(p, faces, resolution); return;
+	case ISA_SSE4: sse4::ensembleNormals(p, faces, resolution); return;
+#endif
+	default: scalar::ensembleNormals(p, faces, resolution); return;
+	}
+}
+
+}
@@ -0,0 +1,133 @@
+#ifndef CLOTH_KERNELS_H
+#define CLOTH_KERNELS_H
+
+// SIMD kernels for the cloth solver. Every kernel is compiled once per
+// instruction set (cloth_kernels.cpp, cloth_kernels_sse4.cpp,
+// cloth_kernels_avx2.cpp) and the dispatchers below pick one at runtime.
+// This header stays free of glm/STL so the per-ISA translation units do not
+// emit shared inline code built with wider instruction sets.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CLOTH_KERNELS_X86 1
+#else
+#define CLOTH_KERNELS_X86 0
+#endif
+
+// structure-of-arrays view of the cloth particles, one float per node
+struct ParticleView {
+	float* px; float* py; float* pz;
+	float* vx; float* vy; float* vz;
+	float* nx; float* ny; float* nz;
+	float* fx; float* fy; float* fz;
+};
+
+// spring table in structure-of-arrays form; type indexes the stiffness K[]
+struct SpringView {
+	const int* a;
+	const int* b;
+	const float* rest;
+	const int* type;
+};
+
+// a stretch of springs [first, first + count) whose endpoints a and b both
+// advance by one node per spring and that share a stiffness type, so the
+// kernel can stream positions and forces instead of gathering them
+struct SpringRun {
+	int first;
+	int count;
+};
+
+// normals of the two triangles (i,j) (i,j+1) (i+1,j+1) and (i,j) (i+1,j+1)
+// (i+1,j) of every grid quad, stored at the index of the quad's (i,j) node.
+// The pointers are offset so that indices down to -resolution - 1 are valid;
+// those entries, and the ones past the last quad row and column, stay zero.
+struct FaceView {
+	float* ax; float* ay; float* az;
+	float* bx; float* by; float* bz;
+};
+
+// rest state of the membrane triangles (i,j) (i,j+1) (i+1,j+1) and (i,j)
+// (i+1,j+1) (i+1,j) of every grid quad, stored at the index of the quad's
+// (i,j) node: the inverse of the matrix whose columns are the two edges out
+// of the first corner in material coordinates, u along the rows and v along
+// the columns, and the triangle's area
+struct MembraneView {
+	const float* a00; const float* a01; const float* a10; const float* a11; const float* aArea;
+	const float* b00; const float* b01; const float* b10; const float* b11; const float* bArea;
+};
+
+struct ForceParams {
+	float mass;
+	float gravity;
+	float Cd;
+	float Cv;
+	float flowVelocity[3];
+	float stepSize;
+};
+
+// Ensembles simulate ensembleLanes variants of one grid side by side, each
+// with its own parameters: the floats of node i are interleaved as [i *
+// ensembleLanes, (i + 1) * ensembleLanes), one per variant, so the kernels
+// advance every variant of a node with the same instructions.
+const int ensembleLanes = 8;
+
+struct EnsembleParams {
+	float mass[ensembleLanes];
+	float K[3][ensembleLanes];
+	float Cd[ensembleLanes];
+	float Cv[ensembleLanes];
+};
+
+namespace cloth_kernels {
+
+enum Isa { ISA_SCALAR, ISA_SSE4, ISA_AVX2 };
+
+// best instruction set supported by this CPU and OS
+Isa detectIsa();
+const char* isaName(Isa isa);
+
+// evaluates every spring of the runs once and scatters f to a and -f to b
+void accumulateSprings(Isa isa, const ParticleView& p, const SpringView& springs, const float K[3],
+	const SpringRun* runs, int runCount);
+
+// Saint Venant-Kirchhoff forces of the membrane triangles of the quads on
+// the rows [rowBegin, rowEnd) and columns [columnBegin, columnEnd) of a
+// resolution x resolution grid, with the stiffness along u, along v and in
+// shear; each quad scatters to its four nodes, so no two rows running at
+// the same time may share a node
+void accumulateMembrane(Isa isa, const ParticleView& p, const MembraneView& m, const float stiffness[3],
+	int resolution, int rowBegin, int rowEnd, int columnBegin, int columnEnd);
+
+// adds gravity, damping and viscous forces to the accumulated spring forces
+// and integrates v += F * dt / m for the nodes [begin, end); the force
+// accumulators are left zeroed for the next substep
+void integrateVelocities(Isa isa, const ParticleView& p, const ForceParams& params, int begin, int end);
+
+// x += v * dt for the nodes [begin, end)
+void integratePositions(Isa isa, const ParticleView& p, float stepSize, int begin, int end);
+
+// face normals of the quads on the rows [rowBegin, rowEnd) of a
+// resolution x resolution grid, rowEnd at most resolution - 1
+void faceNormals(Isa isa, const ParticleView& p, const FaceView& faces, int resolution, int rowBegin, int rowEnd);
+
+// vertex normals of the nodes [begin, end): the normalized sum of the
+// normals of the six triangles around each node
+void gatherNormals(Isa isa, const ParticleView& p, const FaceView& faces, int resolution, int begin, int end);
+
+// the springs [first, last) of the table for every lane of an ensemble,
+// with node indices into the grid
+void ensembleSprings(Isa isa, const ParticleView& p, const SpringView& springs, const EnsembleParams& params,
+	int first, int last);
+
+// integrateVelocities and integratePositions for the nodes [begin, end) of
+// an ensemble; gravity, wind and step size come from shared
+void ensembleIntegrate(Isa isa, const ParticleView& p, const ForceParams& shared, const EnsembleParams& params,
+	int begin, int end);
+
+// faceNormals and gatherNormals over the whole grid of an ensemble, with
+// ensembleLanes floats per face as per node
+void ensembleNormals(Isa isa, const ParticleView& p, const FaceView& faces, int resolution);
+
+}
+
+#endif
@@ -0,0 +1,7 @@
+// AVX2 build of the cloth kernels, compiled with -mavx2 / /arch:AVX2 (see CMakeLists.txt)
+#include "cloth_kernels.h"
+
+#if CLOTH_KERNELS_X86
+#define CLOTH_SIMD_AVX2
+#include "cloth_kernels_impl.h"
+#endif
@@ -0,0 +1,365 @@
+// Kernel bodies shared by every instruction set. Included once per ISA
+// translation unit; CLOTH_SIMD_AVX2 / CLOTH_SIMD_SSE4 select the lane type,
+// otherwise the plain scalar build is produced.
+
+#include "cloth_kernels.h"
+
+#if defined(CLOTH_SIMD_AVX2)
+#include <immintrin.h>
+#define CLOTH_SIMD_NAMESPACE avx2
+#elif defined(CLOTH_SIMD_SSE4)
+#include <smmintrin.h>
+#define CLOTH_SIMD_NAMESPACE sse4
+#else
+#include <cmath>
+#define CLOTH_SIMD_NAMESPACE scalar
+#endif
+
+namespace cloth_kernels {
+namespace CLOTH_SIMD_NAMESPACE {
+namespace {
+
+template <typename V> struct Lanes;
+
+// the scalar lane handles row tails; in the SIMD builds it goes through
+// intrinsics so no out-of-line libm wrapper is compiled with wide flags
+template <> struct Lanes<float> {
+	enum { count = 1 };
+	static float load(const float* p) { return *p; }
+	static void store(float* p, float v) { *p = v; }
+	static float set(float v) { return v; }
+#if defined(CLOTH_SIMD_AVX2) || defined(CLOTH_SIMD_SSE4)
+	static float sqrt(float v) { return _mm_cvtss_f32(_mm_sqrt_ss(_mm_set_ss(v))); }
+#else
+	static float sqrt(float v) { return std::sqrt(v); }
+#endif
+};
+
+inline float vadd(float a, float b) { return a + b; }
+inline float vsub(float a, float b) { return a - b; }
+inline float vmul(float a, float b) { return a * b; }
+inline float vdiv(float a, float b) { return a / b; }
+
+// vector registers are wrapped in structs so they can be template arguments
+#if defined(CLOTH_SIMD_AVX2)
+struct Wide { __m256 v; };
+
+template <> struct Lanes<Wide> {
+	enum { count = 8 };
+	static Wide load(const float* p) { Wide r = { _mm256_loadu_ps(p) }; return r; }
+	static void store(float* p, Wide a) { _mm256_storeu_ps(p, a.v); }
+	static Wide set(float v) { Wide r = { _mm256_set1_ps(v) }; return r; }
+	static Wide sqrt(Wide a) { Wide r = { _mm256_sqrt_ps(a.v) }; return r; }
+};
+
+inline Wide vadd(Wide a, Wide b) { Wide r = { _mm256_add_ps(a.v, b.v) }; return r; }
+inline Wide vsub(Wide a, Wide b) { Wide r = { _mm256_sub_ps(a.v, b.v) }; return r; }
+inline Wide vmul(Wide a, Wide b) { Wide r = { _mm256_mul_ps(a.v, b.v) }; return r; }
+inline Wide vdiv(Wide a, Wide b) { Wide r = { _mm256_div_ps(a.v, b.v) }; return r; }
+#elif defined(CLOTH_SIMD_SSE4)
+struct Wide { __m128 v; };
+
+template <> struct Lanes<Wide> {
+	enum { count = 4 };
+	static Wide load(const float* p) { Wide r = { _mm_loadu_ps(p) }; return r; }
+	static void store(float* p, Wide a) { _mm_storeu_ps(p, a.v); }
+	static Wide set(float v) { Wide r = { _mm_set1_ps(v) }; return r; }
+	static Wide sqrt(Wide a) { Wide r = { _mm_sqrt_ps(a.v) }; return r; }
+};
+
+inline Wide vadd(Wide a, Wide b) { Wide r = { _mm_add_ps(a.v, b.v) }; return r; }
+inline Wide vsub(Wide a, Wide b) { Wide r = { _mm_sub_ps(a.v, b.v) }; return r; }
+inline Wide vmul(Wide a, Wide b) { Wide r = { _mm_mul_ps(a.v, b.v) }; return r; }
+inline Wide vdiv(Wide a, Wide b) { Wide r = { _mm_div_ps(a.v, b.v) }; return r; }
+#else
+typedef float Wide;
+#endif
+
+// one block of springs from a run: a and b both advance by one per lane,
+// force on a is f = (a - b) * K * (rest - len) / len and b gets -f
+template <typename V>
+inline void spring(const ParticleView& p, V rest, V k, int a, int b) {
+	typedef Lanes<V> L;
+	V dx = vsub(L::load(p.px + a), L::load(p.px + b));
+	V dy = vsub(L::load(p.py + a), L::load(p.py + b));
+	V dz = vsub(L::load(p.pz + a), L::load(p.pz + b));
+	V len = L::sqrt(vadd(vadd(vmul(dx, dx), vmul(dy, dy)), vmul(dz, dz)));
+	V s = vdiv(vmul(k, vsub(rest, len)), len);
+	V fx = vmul(dx, s), fy = vmul(dy, s), fz = vmul(dz, s);
+	// a and b may overlap within a block (b - a < lanes), so the second
+	// read-modify-write has to see the first one
+	L::store(p.fx + a, vadd(L::load(p.fx + a), fx));
+	L::store(p.fy + a, vadd(L::load(p.fy + a), fy));
+	L::store(p.fz + a, vadd(L::load(p.fz + a), fz));
+	L::store(p.fx + b, vsub(L::load(p.fx + b), fx));
+	L::store(p.fy + b, vsub(L::load(p.fy + b), fy));
+	L::store(p.fz + b, vsub(L::load(p.fz + b), fz));
+}
+
+// Forces of one triangle with edges e1 = x1 - x0 and e2 = x2 - x0 and rest
+// inverse m: F = [e1 e2] m, E = (F^T F - I) / 2 and the orthotropic energy
+// area (ku Euu^2 + kv Evv^2) / 2 + 2 area ks Euv^2. h1 and h2 are the
+// gradients of the energy at x1 and x2; x0 gets -(h1 + h2).
+template <typename V>
+inline void stvk(V e1x, V e1y, V e1z, V e2x, V e2y, V e2z, V m00, V m01, V m10, V m11, V area,
+	V ku, V kv, V ks, V& h1x, V& h1y, V& h1z, V& h2x, V& h2y, V& h2z) {
+	typedef Lanes<V> L;
+	V ux = vadd(vmul(e1x, m00), vmul(e2x, m10)), uy = vadd(vmul(e1y, m00), vmul(e2y, m10)), uz = vadd(vmul(e1z, m00), vmul(e2z, m10));
+	V vx = vadd(vmul(e1x, m01), vmul(e2x, m11)), vy = vadd(vmul(e1y, m01), vmul(e2y, m11)), vz = vadd(vmul(e1z, m01), vmul(e2z, m11));
+	V half = L::set(0.5f), one = L::set(1.0f);
+	V euu = vmul(half, vsub(vadd(vadd(vmul(ux, ux), vmul(uy, uy)), vmul(uz, uz)), one));
+	V evv = vmul(half, vsub(vadd(vadd(vmul(vx, vx), vmul(vy, vy)), vmul(vz, vz)), one));
+	V euv = vadd(vadd(vmul(ux, vx), vmul(uy, vy)), vmul(uz, vz));
+
+	// second Piola-Kirchhoff stress times the area, suv = 2 ks Euv with
+	// Euv = (u . v) / 2
+	V suu = vmul(vmul(ku, euu), area), svv = vmul(vmul(kv, evv), area), suv = vmul(vmul(ks, euv), area);
+
+	// the first Piola-Kirchhoff stress P = F S, then h = P m^T
+	V pux = vadd(vmul(ux, suu), vmul(vx, suv)), puy = vadd(vmul(uy, suu), vmul(vy, suv)), puz = vadd(vmul(uz, suu), vmul(vz, suv));
+	V pvx = vadd(vmul(ux, suv), vmul(vx, svv)), pvy = vadd(vmul(uy, suv), vmul(vy, svv)), pvz = vadd(vmul(uz, suv), vmul(vz, svv));
+	h1x = vadd(vmul(pux, m00), vmul(pvx, m01)); h1y = vadd(vmul(puy, m00), vmul(pvy, m01)); h1z = vadd(vmul(puz, m00), vmul(pvz, m01));
+	h2x = vadd(vmul(pux, m10), vmul(pvx, m11)); h2y = vadd(vmul(puy, m10), vmul(pvy, m11)); h2z = vadd(vmul(puz, m10), vmul(pvz, m11));
+}
+
+template <typename V>
+inline void addForce(float* f, int id, V a) {
+	typedef Lanes<V> L;
+	L::store(f + id, vadd(L::load(f + id), a));
+}
+
+template <typename V>
+inline void subtractForce(float* f, int id, V a) {
+	typedef Lanes<V> L;
+	L::store(f + id, vsub(L::load(f + id), a));
+}
+
+// both membrane triangles of the quads whose (i,j) corner is id. The four
+// corners are read-modify-written one after the other: the blocks of
+// neighbouring corners overlap by all but one lane.
+template <typename V>
+inline void quad(const ParticleView& p, const MembraneView& m, V ku, V kv, V ks, int n, int id) {
+	typedef Lanes<V> L;
+	V x = L::load(p.px + id), y = L::load(p.py + id), z = L::load(p.pz + id);
+	V ex = vsub(L::load(p.px + id + 1), x), ey = vsub(L::load(p.py + id + 1), y), ez = vsub(L::load(p.pz + id + 1), z);
+	V fx = vsub(L::load(p.px + id + n + 1), x), fy = vsub(L::load(p.py + id + n + 1), y), fz = vsub(L::load(p.pz + id + n + 1), z);
+	V gx = vsub(L::load(p.px + id + n), x), gy = vsub(L::load(p.py + id + n), y), gz = vsub(L::load(p.pz + id + n), z);
+
+	// a = (id, id + 1, id + n + 1), b = (id, id + n + 1, id + n)
+	V a1x, a1y, a1z, a2x, a2y, a2z, b1x, b1y, b1z, b2x, b2y, b2z;
+	stvk(ex, ey, ez, fx, fy, fz, L::load(m.a00 + id), L::load(m.a01 + id), L::load(m.a10 + id), L::load(m.a11 + id),
+		L::load(m.aArea + id), ku, kv, ks, a1x, a1y, a1z, a2x, a2y, a2z);
+	stvk(fx, fy, fz, gx, gy, gz, L::load(m.b00 + id), L::load(m.b01 + id), L::load(m.b10 + id), L::load(m.b11 + id),
+		L::load(m.bArea + id), ku, kv, ks, b1x, b1y, b1z, b2x, b2y, b2z);
+
+	addForce(p.fx, id, vadd(vadd(a1x, a2x), vadd(b1x, b2x)));
+	addForce(p.fy, id, vadd(vadd(a1y, a2y), vadd(b1y, b2y)));
+	addForce(p.fz, id, vadd(vadd(a1z, a2z), vadd(b1z, b2z)));
+	subtractForce(p.fx, id + 1, a1x);
+	subtractForce(p.fy, id + 1, a1y);
+	subtractForce(p.fz, id + 1, a1z);
+	subtractForce(p.fx, id + n + 1, vadd(a2x, b1x));
+	subtractForce(p.fy, id + n + 1, vadd(a2y, b1y));
+	subtractForce(p.fz, id + n + 1, vadd(a2z, b1z));
+	subtractForce(p.fx, id + n, b2x);
+	subtractForce(p.fy, id + n, b2y);
+	subtractForce(p.fz, id + n, b2z);
+}
+
+// adds gravity, damping and viscous forces to the accumulated spring
+// forces, integrates the velocity and clears the accumulator. The mass, the
+// damping -Cd and the viscosity Cv come per lane, the rest from params.
+template <typename V>
+inline void velocity(const ParticleView& p, const ForceParams& params, V m, V cd, V cv, int id) {
+	typedef Lanes<V> L;
+	V fx = L::load(p.fx + id), fy = L::load(p.fy + id), fz = L::load(p.fz + id);
+	L::store(p.fx + id, L::set(0.0f));
+	L::store(p.fy + id, L::set(0.0f));
+	L::store(p.fz + id, L::set(0.0f));
+
+	// gravity
+	fy = vadd(fy, vmul(m, L::set(-params.gravity)));
+
+	// damping
+	V vx = L::load(p.vx + id), vy = L::load(p.vy + id), vz = L::load(p.vz + id);
+	fx = vadd(fx, vmul(vx, cd));
+	fy = vadd(fy, vmul(vy, cd));
+	fz = vadd(fz, vmul(vz, cd));
+
+	// viscous
+	V nx = L::load(p.nx + id), ny = L::load(p.ny + id), nz = L::load(p.nz + id);
+	V ux = vsub(L::set(params.flowVelocity[0]), vx);
+	V uy = vsub(L::set(params.flowVelocity[1]), vy);
+	V uz = vsub(L::set(params.flowVelocity[2]), vz);
+	V factor = vmul(cv, vadd(vadd(vmul(nx, ux), vmul(ny, uy)), vmul(nz, uz)));
+	fx = vadd(fx, vmul(nx, factor));
+	fy = vadd(fy, vmul(ny, factor));
+	fz = vadd(fz, vmul(nz, factor));
+
+	V dt = L::set(params.stepSize);
+	L::store(p.vx + id, vadd(vx, vdiv(vmul(fx, dt), m)));
+	L::store(p.vy + id, vadd(vy, vdiv(vmul(fy, dt), m)));
+	L::store(p.vz + id, vadd(vz, vdiv(vmul(fz, dt), m)));
+}
+
+template <typename V>
+inline void position(const ParticleView& p, V dt, int id) {
+	typedef Lanes<V> L;
+	L::store(p.px + id, vadd(L::load(p.px + id), vmul(L::load(p.vx + id), dt)));
+	L::store(p.py + id, vadd(L::load(p.py + id), vmul(L::load(p.vy + id), dt)));
+	L::store(p.pz + id, vadd(L::load(p.pz + id), vmul(L::load(p.vz + id), dt)));
+}
+
+template <typename V>
+inline void normalize(V& x, V& y, V& z) {
+	typedef Lanes<V> L;
+	V len = L::sqrt(vadd(vadd(vmul(x, x), vmul(y, y)), vmul(z, z)));
+	x = vdiv(x, len);
+	y = vdiv(y, len);
+	z = vdiv(z, len);
+}
+
+// both triangle normals of the quads whose (i,j) corner is id, with the
+// next column step and the next row n further on
+template <typename V>
+inline void face(const ParticleView& p, const FaceView& faces, int step, int n, int id) {
+	typedef Lanes<V> L;
+	V x = L::load(p.px + id), y = L::load(p.py + id), z = L::load(p.pz + id);
+	V ex = vsub(L::load(p.px + id + step), x), ey = vsub(L::load(p.py + id + step), y), ez = vsub(L::load(p.pz + id + step), z);
+	V fx = vsub(L::load(p.px + id + n + step), x), fy = vsub(L::load(p.py + id + n + step), y), fz = vsub(L::load(p.pz + id + n + step), z);
+	V gx = vsub(L::load(p.px + id + n), x), gy = vsub(L::load(p.py + id + n), y), gz = vsub(L::load(p.pz + id + n), z);
+
+	// a = e x f, b = f x g
+	V ax = vsub(vmul(ey, fz), vmul(ez, fy)), ay = vsub(vmul(ez, fx), vmul(ex, fz)), az = vsub(vmul(ex, fy), vmul(ey, fx));
+	V bx = vsub(vmul(fy, gz), vmul(fz, gy)), by = vsub(vmul(fz, gx), vmul(fx, gz)), bz = vsub(vmul(fx, gy), vmul(fy, gx));
+	normalize(ax, ay, az);
+	normalize(bx, by, bz);
+	L::store(faces.ax + id, ax); L::store(faces.ay + id, ay); L::store(faces.az + id, az);
+	L::store(faces.bx + id, bx); L::store(faces.by + id, by); L::store(faces.bz + id, bz);
+}
+
+// the six triangles around a node: both of the quads at id and id - n - step,
+// triangle a of the quad to the left and triangle b of the quad above
+template <typename V>
+inline void gather(const ParticleView& p, const FaceView& faces, int step, int n, int id) {
+	typedef Lanes<V> L;
+	int left = id - step, up = id - n, corner = id - n - step;
+	V x = vadd(vadd(vadd(L::load(faces.ax + id), L::load(faces.bx + id)), vadd(L::load(faces.ax + left), L::load(faces.bx + up))),
+		vadd(L::load(faces.ax + corner), L::load(faces.bx + corner)));
+	V y = vadd(vadd(vadd(L::load(faces.ay + id), L::load(faces.by + id)), vadd(L::load(faces.ay + left), L::load(faces.by + up))),
+		vadd(L::load(faces.ay + corner), L::load(faces.by + corner)));
+	V z = vadd(vadd(vadd(L::load(faces.az + id), L::load(faces.bz + id)), vadd(L::load(faces.az + left), L::load(faces.bz + up))),
+		vadd(L::load(faces.az + corner), L::load(faces.bz + corner)));
+	normalize(x, y, z);
+	L::store(p.nx + id, x);
+	L::store(p.ny + id, y);
+	L::store(p.nz + id, z);
+}
+
+}
+
+void accumulateSprings(const ParticleView& p, const SpringView& springs, const float K[3],
+	const SpringRun* runs, int runCount) {
+	for (int r = 0; r < runCount; r++) {
+		int first = runs[r].first, count = runs[r].count;
+		int a = springs.a[first], b = springs.b[first];
+		const float* rest = springs.rest + first;
+		float k = K[springs.type[first]];
+		int s = 0;
+		for (; s + Lanes<Wide>::count <= count; s += Lanes<Wide>::count)
+			spring<Wide>(p, Lanes<Wide>::load(rest + s), Lanes<Wide>::set(k), a + s, b + s);
+		for (; s < count; s++)
+			spring<float>(p, rest[s], k, a + s, b + s);
+	}
+}
+
+void accumulateMembrane(const ParticleView& p, const MembraneView& m, const float stiffness[3],
+	int resolution, int rowBegin, int rowEnd, int columnBegin, int columnEnd) {
+	Wide ku = Lanes<Wide>::set(stiffness[0]), kv = Lanes<Wide>::set(stiffness[1]), ks = Lanes<Wide>::set(stiffness[2]);
+	// the last column has no quads to its right
+	if (columnEnd > resolution - 1)
+		columnEnd = resolution - 1;
+	for (int i = rowBegin; i < rowEnd; i++) {
+		int id = i * resolution + columnBegin, end = i * resolution + columnEnd;
+		for (; id + Lanes<Wide>::count <= end; id += Lanes<Wide>::count)
+			quad<Wide>(p, m, ku, kv, ks, resolution, id);
+		for (; id < end; id++)
+			quad<float>(p, m, stiffness[0], stiffness[1], stiffness[2], resolution, id);
+	}
+}
+
+void integrateVelocities(const ParticleView& p, const ForceParams& params, int begin, int end) {
+	int id = begin;
+	Wide m = Lanes<Wide>::set(params.mass), cd = Lanes<Wide>::set(-params.Cd), cv = Lanes<Wide>::set(params.Cv);
+	for (; id + Lanes<Wide>::count <= end; id += Lanes<Wide>::count)
+		velocity<Wide>(p, params, m, cd, cv, id);
+	for (; id < end; id++)
+		velocity<float>(p, params, params.mass, -params.Cd, params.Cv, id);
+}
+
+void integratePositions(const ParticleView& p, float stepSize, int begin, int end) {
+	Wide dt = Lanes<Wide>::set(stepSize);
+	int id = begin;
+	for (; id + Lanes<Wide>::count <= end; id += Lanes<Wide>::count)
+		position<Wide>(p, dt, id);
+	for (; id < end; id++)
+		position<float>(p, stepSize, id);
+}
+
+void faceNormals(const ParticleView& p, const FaceView& faces, int resolution, int rowBegin, int rowEnd) {
+	for (int i = rowBegin; i < rowEnd; i++) {
+		int id = i * resolution, end = id + resolution - 1;
+		for (; id + Lanes<Wide>::count <= end; id += Lanes<Wide>::count)
+			face<Wide>(p, faces, 1, resolution, id);
+		for (; id < end; id++)
+			face<float>(p, faces, 1, resolution, id);
+	}
+}
+
+// the ensemble kernels step through the lanes of every node, one register
+// at a time; a register never holds more than ensembleLanes floats
+void ensembleSprings(const ParticleView& p, const SpringView& springs, const EnsembleParams& params, int first, int last) {
+	for (int s = first; s < last; s++) {
+		int a = springs.a[s] * ensembleLanes, b = springs.b[s] * ensembleLanes;
+		Wide rest = Lanes<Wide>::set(springs.rest[s]);
+		const float* k = params.K[springs.type[s]];
+		for (int l = 0; l < ensembleLanes; l += Lanes<Wide>::count)
+			spring<Wide>(p, rest, Lanes<Wide>::load(k + l), a + l, b + l);
+	}
+}
+
+void ensembleIntegrate(const ParticleView& p, const ForceParams& shared, const EnsembleParams& params, int begin, int end) {
+	Wide dt = Lanes<Wide>::set(shared.stepSize), zero = Lanes<Wide>::set(0.0f);
+	for (int id = begin * ensembleLanes; id < end * ensembleLanes; id += ensembleLanes) {
+		for (int l = 0; l < ensembleLanes; l += Lanes<Wide>::count) {
+			velocity<Wide>(p, shared, Lanes<Wide>::load(params.mass + l), vsub(zero, Lanes<Wide>::load(params.Cd + l)),
+				Lanes<Wide>::load(params.Cv + l), id + l);
+			position<Wide>(p, dt, id + l);
+		}
+	}
+}
+
+void ensembleNormals(const ParticleView& p, const FaceView& faces, int resolution) {
+	int n = resolution * ensembleLanes;
+	for (int i = 0; i + 1 < resolution; i++) {
+		for (int id = i * n; id < i * n + n - ensembleLanes; id += ensembleLanes) {
+			for (int l = 0; l < ensembleLanes; l += Lanes<Wide>::count)
+				face<Wide>(p, faces, ensembleLanes, n, id + l);
+		}
+	}
+	for (int id = 0; id < resolution * n; id += ensembleLanes) {
+		for (int l = 0; l < ensembleLanes; l += Lanes<Wide>::count)
+			gather<Wide>(p, faces, ensembleLanes, n, id + l);
+	}
+}
+
+void gatherNormals(const ParticleView& p, const FaceView& faces, int resolution, int begin, int end) {
+	int id = begin;
+	for (; id + Lanes<Wide>::count <= end; id += Lanes<Wide>::count)
+		gather<Wide>(p, faces, 1, resolution, id);
+	for (; id < end; id++)
+		gather<float>(p, faces, 1, resolution, id);
+}
+
+}
+}
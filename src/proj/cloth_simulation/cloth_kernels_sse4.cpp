@@ -0,0 +1,7 @@
+// SSE4.1 build of the cloth kernels, compiled with -msse4.1 (see CMakeLists.txt)
+#include "cloth_kernels.h"
+
+#if CLOTH_KERNELS_X86
+#define CLOTH_SIMD_SSE4
+#include "cloth_kernels_impl.h"
+#endif
@@ -0,0 +1,321 @@
+// Geometric multigrid preconditioner for the implicit solve. Every level is
+// the cloth's grid at half the resolution of the one above: coarse node
+// (I, J) sits on fine node (2I, 2J) and the fine nodes in between take the
+// bilinear blend of the coarse ones around them, P; the last row and column
+// of an even grid take the nearest coarse node. Residuals go down with P^T.
+//
+// Instead of forming P^T A P, the coarse levels rediscretize the cloth: the
+// same springs and stiffness over twice the rest lengths, which a membrane
+// looks like from twice as far, and four times the mass, damping and drag
+// per node, which is what P^T A P does to the diagonal. Their spring
+// Jacobians come from the fine positions, injected down every step.
+//
+// A V-cycle with as many block Jacobi sweeps on the way up as on the way
+// down is symmetric and positive definite, so it stands in for the block
+// diagonal preconditioner of the conjugate gradient. Smooth errors, which
+// the block diagonal only spreads a few nodes per iteration, are taken out
+// on the coarse levels, and the iteration count stays about the same as
+// the resolution grows.
+#include "cloth.h"
+
+#include <algorithm>
+
+struct Cloth::GridLevel {
+	int resolution;
+	float mass;
+	float damping;
+	float drag;
+	AlignedArray<int> springA;
+	AlignedArray<int> springB;
+	AlignedArray<int> springType;
+	AlignedArray<float> springRest;
+	// the spring runs and the first run of every row; level 0 points at the
+	// cloth's own, the coarse levels at their coarseRuns and coarseRows
+	const std::vector<SpringRun>* springRuns;
+	const std::vector<int>* rowRuns;
+	std::vector<SpringRun> coarseRuns;
+	std::vector<int> coarseRows;
+	AlignedArray<float> position[3];
+	AlignedArray<float> normal[3];
+	AlignedArray<float> hessian[6]; // per spring, dt^2 not applied
+	AlignedArray<float> diagonal[6]; // inverse diagonal blocks of the system
+	AlignedArray<float> rhs[3];
+	AlignedArray<float> solution[3];
+	AlignedArray<float> residual[3];
+};
+
+static const int coarsestResolution = 8;
+static const int smoothingSweeps = 1; // each way
+static const int coarsestSweeps = 8;
+static const float smoothingWeight = 0.7f;
+
+// the coarse rows (or columns) fine row i blends and their weights in P,
+// returns how many there are
+static int coarseRows(int i, int coarse, int* rows, float* weights) {
+	rows[0] = i / 2;
+	weights[0] = 1.0f;
+	if (i % 2 == 0 || i / 2 + 1 >= coarse)
+		return 1;
+	rows[1] = i / 2 + 1;
+	weights[0] = weights[1] = 0.5f;
+	return 2;
+}
+
+// the fine rows that blend coarse row I and their weights in P
+static int fineRows(int I, int fine, int coarse, int* rows, float* weights) {
+	int count = 0;
+	for (int i = std::max(2 * I - 1, 0); i <= std::min(2 * I + 1, fine - 1); i++) {
+		rows[count] = i;
+		weights[count++] = i == 2 * I || (i == 2 * I + 1 && I == coarse - 1) ? 1.0f : 0.5f;
+	}
+	return count;
+}
+
+// The coarse levels only depend on the resolution. Level 0 is the cloth
+// itself; it borrows the solver's arrays, see updateGridLevels.
+void Cloth::buildGridLevels() {
+	releaseGridLevels();
+	gridLevels.push_back(new GridLevel());
+	gridLevels[0]->resolution = meshResolution;
+	int n = meshResolution;
+	float spacing = 1.0f;
+	while (n > coarsestResolution) {
+		n = (n + 1) / 2;
+		spacing *= 2.0f;
+		GridLevel* level = new GridLevel();
+		level->resolution = n;
+		float rest[3] = { restLength[0] * spacing, restLength[1] * spacing, restLength[2] * spacing };
+		std::vector<int> a, b, type;
+		std::vector<float> lengths;
+		appendGridSprings(n, 0, rest, a, b, lengths, type, level->coarseRuns, level->coarseRows);
+		level->coarseRows.push_back(static_cast<int>(level->coarseRuns.size()));
+		level->springRuns = &level->coarseRuns;
+		level->rowRuns = &level->coarseRows;
+		int springs = static_cast<int>(a.size());
+		level->springA.assign(a.data(), springs);
+		level->springB.assign(b.data(), springs);
+		level->springType.assign(type.data(), springs);
+		level->springRest.assign(lengths.data(), springs);
+		for (int c = 0; c < 3; c++) {
+			level->position[c].resize(n * n);
+			level->normal[c].resize(n * n);
+			level->rhs[c].resize(n * n);
+			level->solution[c].resize(n * n);
+			level->residual[c].resize(n * n);
+		}
+		for (int c = 0; c < 6; c++) {
+			level->hessian[c].resize(springs);
+			level->diagonal[c].resize(n * n);
+		}
+		gridLevels.push_back(level);
+	}
+}
+
+void Cloth::releaseGridLevels() {
+	for (size_t l = 0; l < gridLevels.size(); l++)
+		delete gridLevels[l];
+	gridLevels.clear();
+}
+
+// Points level 0 at this step's system, whose spring Jacobians and inverse
+// diagonal blocks simulateImplicit has just made, and builds the coarse
+// systems from positions and normals injected level by level.
+void Cloth::updateGridLevels(float stepSize) {
+	GridLevel& fine = *gridLevels[0];
+	fine.mass = mass;
+	fine.damping = Cd;
+	fine.drag = Cv;
+	fine.springA.borrow(springA.data(), springA.size());
+	fine.springB.borrow(springB.data(), springB.size());
+	fine.springRuns = &springRuns;
+	fine.rowRuns = &rowRuns;
+	for (int c = 0; c < 3; c++) {
+		fine.position[c].borrow(vertexPosition[c].data(), vertexPosition[c].size());
+		fine.normal[c].borrow(vertexNormal[c].data(), vertexNormal[c].size());
+		fine.rhs[c].borrow(cgResidual[c].data(), cgResidual[c].size());
+		fine.solution[c].borrow(cgPreconditioned[c].data(), cgPreconditioned[c].size());
+		fine.residual[c].borrow(cgProduct[c].data(), cgProduct[c].size());
+	}
+	for (int c = 0; c < 6; c++) {
+		fine.hessian[c].borrow(springHessian[c].data(), springHessian[c].size());
+		fine.diagonal[c].borrow(blockPreconditioner[c].data(), blockPreconditioner[c].size());
+	}
+
+	float dt = stepSize, dt2 = stepSize * stepSize;
+	for (size_t l = 1; l < gridLevels.size(); l++) {
+		GridLevel& above = *gridLevels[l - 1];
+		GridLevel& level = *gridLevels[l];
+		int n = level.resolution;
+		level.mass = 4.0f * above.mass;
+		level.damping = 4.0f * above.damping;
+		level.drag = 4.0f * above.drag;
+		parallelNodes(n, [&](int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				int node = 2 * (i / n) * above.resolution + 2 * (i % n);
+				store3(level.position, i, load3(above.position, node));
+				store3(level.normal, i, load3(above.normal, node));
+				for (int c = 0; c < 6; c++)
+					level.diagonal[c][i] = 0.0f;
+			}
+		});
+
+		int springs = static_cast<int>(level.springA.size());
+		const std::vector<SpringRun>& runs = *level.springRuns;
+		parallelSprings(n, *level.rowRuns, [&](int firstRun, int lastRun) {
+			int first = runs[firstRun].first;
+			int last = lastRun < static_cast<int>(runs.size()) ? runs[lastRun].first : springs;
+			for (int s = first; s < last; s++) {
+				int a = level.springA[s], b = level.springB[s];
+				glm::vec3 d = load3(level.position, a) - load3(level.position, b);
+				float h[6];
+				springJacobian(d, glm::length(d), level.springRest[s], K[level.springType[s]], h);
+				for (int c = 0; c < 6; c++) {
+					level.hessian[c][s] = h[c];
+					level.diagonal[c][a] += h[c];
+					level.diagonal[c][b] += h[c];
+				}
+			}
+		});
+
+		parallelNodes(n, [&](int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				glm::vec3 normal = load3(level.normal, i);
+				glm::mat3 block = glm::mat3(level.mass + dt * level.damping) + glm::outerProduct(normal, normal) * (dt * level.drag);
+				block[0][0] += dt2 * level.diagonal[0][i];
+				block[0][1] = block[1][0] += dt2 * level.diagonal[1][i];
+				block[0][2] = block[2][0] += dt2 * level.diagonal[2][i];
+				block[1][1] += dt2 * level.diagonal[3][i];
+				block[1][2] = block[2][1] += dt2 * level.diagonal[4][i];
+				block[2][2] += dt2 * level.diagonal[5][i];
+				block = glm::inverse(block);
+				level.diagonal[0][i] = block[0][0];
+				level.diagonal[1][i] = block[0][1];
+				level.diagonal[2][i] = block[0][2];
+				level.diagonal[3][i] = block[1][1];
+				level.diagonal[4][i] = block[1][2];
+				level.diagonal[5][i] = block[2][2];
+			}
+		});
+	}
+}
+
+// residual = rhs - A solution on level l; on the cloth itself the pinned
+// nodes are left out of the system
+void Cloth::levelResidual(int l, float stepSize) {
+	GridLevel& level = *gridLevels[l];
+	int n = level.resolution;
+	float dt = stepSize, dt2 = stepSize * stepSize;
+	parallelNodes(n, [&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			glm::vec3 x = load3(level.solution, i), normal = load3(level.normal, i);
+			store3(level.residual, i, load3(level.rhs, i) - x * (level.mass + dt * level.damping)
+				- normal * (dt * level.drag * glm::dot(normal, x)));
+		}
+	});
+	int springs = static_cast<int>(level.springA.size());
+	const std::vector<SpringRun>& runs = *level.springRuns;
+	parallelSprings(n, *level.rowRuns, [&](int firstRun, int lastRun) {
+		int first = runs[firstRun].first;
+		int last = lastRun < static_cast<int>(runs.size()) ? runs[lastRun].first : springs;
+		for (int s = first; s < last; s++) {
+			int a = level.springA[s], b = level.springB[s];
+			glm::vec3 u = symmetricProduct(level.hessian, s, load3(level.solution, a) - load3(level.solution, b)) * dt2;
+			store3(level.residual, a, load3(level.residual, a) - u);
+			store3(level.residual, b, load3(level.residual, b) + u);
+		}
+	});
+	if (l == 0 && pinned) {
+		store3(level.residual, (n - 1) * n, glm::vec3(0.0f));
+		store3(level.residual, n * n - 1, glm::vec3(0.0f));
+	}
+}
+
+// one damped block Jacobi sweep, from a zero solution or from the residual
+void Cloth::smoothLevel(int l, bool fromZero) {
+	GridLevel& level = *gridLevels[l];
+	AlignedArray<float>* from = fromZero ? level.rhs : level.residual;
+	parallelNodes(level.resolution, [&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			glm::vec3 x = fromZero ? glm::vec3(0.0f) : load3(level.solution, i);
+			store3(level.solution, i, x + symmetricProduct(level.diagonal, i, load3(from, i)) * smoothingWeight);
+		}
+	});
+}
+
+// solution = V-cycle(rhs) from level l down
+void Cloth::vCycle(int l, float stepSize) {
+	bool coarsest = l + 1 == static_cast<int>(gridLevels.size());
+	int sweeps = coarsest ? coarsestSweeps : smoothingSweeps;
+	smoothLevel(l, true);
+	for (int k = 1; k < sweeps; k++) {
+		levelResidual(l, stepSize);
+		smoothLevel(l, false);
+	}
+	if (coarsest)
+		return;
+
+	GridLevel& level = *gridLevels[l];
+	GridLevel& coarse = *gridLevels[l + 1];
+	int n = level.resolution, nc = coarse.resolution;
+	levelResidual(l, stepSize);
+	parallelNodes(nc, [&](int begin, int end) {
+		for (int node = begin; node < end; node++) {
+			int rows[3], columns[3];
+			float rowWeights[3], columnWeights[3];
+			int rowCount = fineRows(node / nc, n, nc, rows, rowWeights);
+			int columnCount = fineRows(node % nc, n, nc, columns, columnWeights);
+			glm::vec3 sum(0.0f);
+			for (int a = 0; a < rowCount; a++) {
+				for (int b = 0; b < columnCount; b++)
+					sum += load3(level.residual, rows[a] * n + columns[b]) * (rowWeights[a] * columnWeights[b]);
+			}
+			store3(coarse.rhs, node, sum);
+		}
+	});
+
+	vCycle(l + 1, stepSize);
+
+	parallelNodes(n, [&](int begin, int end) {
+		for (int node = begin; node < end; node++) {
+			if (l == 0 && isPinned(node))
+				continue;
+			int rows[2], columns[2];
+			float rowWeights[2], columnWeights[2];
+			int rowCount = coarseRows(node / n, nc, rows, rowWeights);
+			int columnCount = coarseRows(node % n, nc, columns, columnWeights);
+			glm::vec3 correction(0.0f);
+			for (int a = 0; a < rowCount; a++) {
+				for (int b = 0; b < columnCount; b++)
+					correction += load3(coarse.solution, rows[a] * nc + columns[b]) * (rowWeights[a] * columnWeights[b]);
+			}
+			store3(level.solution, node, load3(level.solution, node) + correction);
+		}
+	});
+
+	for (int k = 0; k < sweeps; k++) {
+		levelResidual(l, stepSize);
+		smoothLevel(l, false);
+	}
+}
+
+// cgPreconditioned = V-cycle(cgResidual), returns the dot product of the
+// two. The first call of a step brings the levels up to date and also sets
+// the first search direction.
+double Cloth::multigridPrecondition(float stepSize, bool firstCall) {
+	if (firstCall) {
+		if (gridLevels.empty() || gridLevels[0]->resolution != meshResolution)
+			buildGridLevels();
+		updateGridLevels(stepSize);
+	}
+	vCycle(0, stepSize);
+	return parallelSum([&](int begin, int end) {
+		double sum = 0.0;
+		for (int i = begin; i < end; i++) {
+			glm::vec3 z = load3(cgPreconditioned, i);
+			if (firstCall)
+				store3(cgDirection, i, z);
+			sum += glm::dot(load3(cgResidual, i), z);
+		}
+		return sum;
+	});
+}
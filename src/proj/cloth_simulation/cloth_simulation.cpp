@@ -18,9 +18,49 @@
 
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <map>
+
+#include "cloth.h"
+#include "cloth_world.h"
+#include "triangle_cloth.h"
+#include "vertex_cache.h"
+
+// Vertices streamed to the GPU every frame through a ring of regions
+// regions of one VBO, each regionFloats floats; a fence per region tells
+// when the GPU is done reading it so the region can be rewritten. With
+// OpenGL 4.4 the VBO stays mapped for good, otherwise every write maps its
+// region unsynchronized, the fence already guarding it.
+class VertexRing {
+    public:
+		static const int regions = 3;
+
+		VertexRing();
+		// makes the VBO and leaves it bound to GL_ARRAY_BUFFER, for the
+		// attribute pointers of the caller's VAO
+		void create(int regionFloats);
+		// the next region, once the GPU is done with it
+		int wait();
+		// writes from + (to - from) * blend to the region
+		bool write(int region, const float* from, const float* to, float blend);
+		// after the draws that read the region
+		void fence(int region);
+		void destroy();
+
+    private:
+		unsigned int vbo;
+		GLsync fences[regions];
+		int next;
+		int floats; // per region
+		float* persistent; // mapped for good when glBufferStorage is there
+};
 
-class Cloth {
+// draws a Cloth and owns its GUI; everything GL lives here
+class ClothRenderer {
     private:
+		Cloth* cloth;
 		GLFWwindow * window;
 		Shader* clothShader;
 		glm::vec3 lightPos;
@@ -28,40 +68,117 @@ class Cloth {
 		float SCR_WIDTH;
 		float SCR_HEIGHT;
 
-		unsigned int clothVAO, clothVBO, clothEBO;
-
-		float clothVertices[20 * 20 * 3 * 2];
-		int clothIndices[19 * 19 * 6];
-
-		int meshResolution;
-		float restLength[3];
-		float mass;
-		float K[3];
-
-		std::vector<glm::vec3> vertexPosition;
-		std::vector<glm::vec3> vertexNormal;
-		std::vector<glm::vec3> vertexVelocity;
-		
-		void initMesh();
-		void computeNormals();
-		void simulate(float timeStep);
-
-		glm::vec3 getForce(int i, int j);
-		glm::vec3 getAllSprings(int i, int j);
-		glm::vec3 getSpringForce(glm::vec3 p, glm::vec3 q, int type);
-		glm::vec3 getGravityForce(int i, int j);
-		glm::vec3 getDampingForce(int i, int j);
-		glm::vec3 getViscousForce(int i, int j);
-
-		glm::vec3 getPosition(int i, int j);
-		glm::vec3 getNormal(int i, int j);
-		glm::vec3 getVelocity(int i, int j);
-		void setPosition(int i, int j, glm::vec3 value);
-		void setVelocity(int i, int j, glm::vec3 value);
+		// The VAO, EBO and vertex ring live as long as the mesh.
+		unsigned int clothVAO, clothEBO;
+		VertexRing ring;
+		int bufferResolution; // mesh size the buffers were made for
+
+		// the snapshot before the newest one, the cloth is drawn in between
+		Cloth::Snapshot previousSnapshot;
+		int requestedResolution;
+
+		// the model the cloth can be dropped on, loaded the first time it is
+		// switched on and fitted under the cloth: cloth space is model space
+		// times colliderScale plus colliderOffset
+		enum ColliderMode { NO_COLLIDER, TRIANGLE_COLLIDER, FIELD_COLLIDER };
+		Model* colliderModel;
+		float colliderScale;
+		glm::vec3 colliderOffset;
+
+		// A recording being played back instead of the simulation, drawn
+		// between the two frames around playbackTime like the snapshots.
+		VertexCacheReader player;
+		float playbackTime;
+		double playbackClock; // clockTime() of the last frame drawn
+		bool playbackPaused;
+		int playbackFrame; // the frame in playFrom, playTo holds the next one
+		std::vector<float> playFrom, playTo;
+
+		void initBuffers(int meshResolution);
+		void setCollider(int mode);
+		bool playbackFrames(const float*& from, const float*& to, float& blend);
 
     public:
-        Cloth(GLFWwindow* theWindow, glm::vec3 theLightPos, glm::vec3 theLightColor, float width, float height);
+		ClothRenderer(Cloth* theCloth, GLFWwindow* theWindow, glm::vec3 theLightPos, glm::vec3 theLightColor, float width, float height);
         void render(Camera* theCamera, int step);
+		void gui();
+		void clean();
+		bool playing() const { return player.frameCount() > 0; }
+};
+
+// draws every panel of a ClothWorld with a single multi-draw call
+class ClothWorldRenderer {
+    private:
+		ClothWorld* world;
+		Shader* worldShader;
+		glm::vec3 lightPos;
+		glm::vec3 lightColor;
+		float SCR_WIDTH;
+		float SCR_HEIGHT;
+
+		// the layout of glMultiDrawElementsIndirect's commands
+		struct DrawCommand {
+			GLuint count;
+			GLuint instanceCount;
+			GLuint firstIndex;
+			GLint baseVertex;
+			GLuint baseInstance;
+		};
+
+		// The vertices of all panels are streamed through one ring. The EBO
+		// holds one grid of indices per panel resolution and the instance
+		// buffer one model matrix per panel. There is a draw command per panel
+		// and ring region: it picks the panel's grid, its first vertex in the
+		// region and, as its base instance, its matrix, so one indirect
+		// multi-draw covers a region.
+		unsigned int worldVAO, worldEBO, instanceVBO, indirectBuffer;
+		VertexRing ring;
+		int bufferNodes, bufferCloths; // world layout the buffers were made for
+		std::vector<DrawCommand> commands;
+
+		ClothWorld::Snapshot previousSnapshot;
+		int requestedPanels;
+		int requestedResolution;
+
+		void initBuffers();
+		void buildPanels();
+
+    public:
+		ClothWorldRenderer(ClothWorld* theWorld, glm::vec3 theLightPos, glm::vec3 theLightColor, float width, float height);
+		void render(Camera* theCamera);
+		void gui();
+		void clean();
+};
+
+// draws a TriangleCloth, a disc or the meshes of a model
+class TriangleClothRenderer {
+    private:
+		TriangleCloth* cloth;
+		Shader* clothShader;
+		glm::vec3 lightPos;
+		glm::vec3 lightColor;
+		float SCR_WIDTH;
+		float SCR_HEIGHT;
+
+		// the vertices stream through a ring like ClothRenderer's
+		unsigned int clothVAO, clothEBO;
+		VertexRing ring;
+		int bufferNodes; // node count the buffers were made for
+		int bufferIndices;
+
+		TriangleCloth::Snapshot previousSnapshot;
+		int requestedRings;
+		char modelPath[256];
+		float pinnedTop; // the share of the height pinned at the top
+
+		void initBuffers();
+		void loadDisc();
+		bool loadModel(const std::string& path);
+
+    public:
+		TriangleClothRenderer(TriangleCloth* theCloth, glm::vec3 theLightPos, glm::vec3 theLightColor, float width, float height);
+		void render(Camera* theCamera);
+		void gui();
 		void clean();
 };
 
@@ -148,8 +265,15 @@ int main()
     ImGui::StyleColorsDark();
 
     glm::vec3 lightColor(1.0f, 1.0f, 1.0f);
-    Cloth cloth(window, lightPos, lightColor, SCR_WIDTH, SCR_HEIGHT);
+    Cloth cloth;
+    ClothRenderer clothRenderer(&cloth, window, lightPos, lightColor, SCR_WIDTH, SCR_HEIGHT);
+    cloth.startSimulation();
     int timestep = 0;
+    ClothWorld world;
+    ClothWorldRenderer worldRenderer(&world, lightPos, lightColor, SCR_WIDTH, SCR_HEIGHT);
+    TriangleCloth triangleCloth;
+    TriangleClothRenderer triangleRenderer(&triangleCloth, lightPos, lightColor, SCR_WIDTH, SCR_HEIGHT);
+    int scene = 0; // the cloth, the panels of the world or the triangle mesh
 
     // render loop
     // -----------
@@ -157,6 +281,30 @@ int main()
     {
         ImGui_ImplGlfwGL3_NewFrame();
         ImGui::Text("Cloth simulation");
+        int shown = scene;
+        ImGui::RadioButton("one cloth", &scene, 0);
+        ImGui::SameLine();
+        ImGui::RadioButton("many panels", &scene, 1);
+        ImGui::SameLine();
+        ImGui::RadioButton("triangle mesh", &scene, 2);
+        if (scene != shown) {
+            // only the scene on screen keeps simulating
+            cloth.stopSimulation();
+            world.stopSimulation();
+            triangleCloth.stopSimulation();
+            if (scene == 1)
+                world.startSimulation();
+            else if (scene == 2)
+                triangleCloth.startSimulation();
+            else if (!clothRenderer.playing())
+                cloth.startSimulation();
+        }
+        if (scene == 1)
+            worldRenderer.gui();
+        else if (scene == 2)
+            triangleRenderer.gui();
+        else
+            clothRenderer.gui();
 
         glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
         glfwSetCursorPosCallback(window, mouse_callback);
@@ -181,7 +329,12 @@ int main()
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
         // std::cout << (blinn ? "Blinn-Phong" : "Phong") << std::endl;
-        cloth.render(&camera, timestep++);
+        if (scene == 1)
+            worldRenderer.render(&camera);
+        else if (scene == 2)
+            triangleRenderer.render(&camera);
+        else
+            clothRenderer.render(&camera, timestep++);
 
         ImGui::Render();
         ImGui_ImplGlfwGL3_RenderDrawData(ImGui::GetDrawData());
@@ -193,6 +346,12 @@ int main()
     }
 
 
+    cloth.stopSimulation();
+    world.stopSimulation();
+    triangleCloth.stopSimulation();
+    clothRenderer.clean();
+    worldRenderer.clean();
+    triangleRenderer.clean();
     ImGui_ImplGlfwGL3_Shutdown();
     ImGui::DestroyContext();
 
@@ -304,10 +463,90 @@ unsigned int loadTexture(char const * path)
 
 
 
+// vertex ring
+VertexRing::VertexRing() {
+	vbo = 0;
+	for (int r = 0; r < regions; r++)
+		fences[r] = 0;
+	next = 0;
+	floats = 0;
+	persistent = NULL;
+}
+
+void VertexRing::create(int regionFloats) {
+	destroy();
+	floats = regionFloats;
+	glGenBuffers(1, &vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	GLsizeiptr size = regions * static_cast<GLsizeiptr>(floats) * sizeof(float);
+	if (GLAD_GL_VERSION_4_4) {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+		persistent = static_cast<float*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags));
+	} else {
+		glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+	}
+}
+
+int VertexRing::wait() {
+	int region = next;
+	next = (next + 1) % regions;
+	if (fences[region]) {
+		while (glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+			;
+		glDeleteSync(fences[region]);
+		fences[region] = 0;
+	}
+	return region;
+}
+
+bool VertexRing::write(int region, const float* from, const float* to, float blend) {
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	float* vertices;
+	if (persistent) {
+		vertices = persistent + region * floats;
+	} else {
+		// the fence already guards the region, so the driver must not
+		// synchronize or keep the old contents around
+		vertices = static_cast<float*>(glMapBufferRange(GL_ARRAY_BUFFER, region * floats * sizeof(float),
+			floats * sizeof(float), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
+		if (!vertices)
+			return false;
+	}
+	// the pool belongs to the physics thread, so this loop stays serial
+	for (int k = 0; k < floats; k++)
+		vertices[k] = from[k] + (to[k] - from[k]) * blend;
+	if (!persistent)
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+	return true;
+}
+
+void VertexRing::fence(int region) {
+	fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void VertexRing::destroy() {
+	for (int r = 0; r < regions; r++) {
+		if (fences[r])
+			glDeleteSync(fences[r]);
+		fences[r] = 0;
+	}
+	if (persistent) {
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		persistent = NULL;
+	}
+	glDeleteBuffers(1, &vbo);
+	vbo = 0;
+	next = 0;
+}
+
+
 // cloth
-Cloth::Cloth(GLFWwindow* theWindow, glm::vec3 theLightPos, glm::vec3 theLightColor, float width, float height) {
+ClothRenderer::ClothRenderer(Cloth* theCloth, GLFWwindow* theWindow, glm::vec3 theLightPos, glm::vec3 theLightColor, float width, float height) {
 	//std::cout << "init cloth" << std::endl;
 
+	cloth = theCloth;
 	window = theWindow;
 	lightPos = theLightPos;
 	lightColor = theLightColor;
@@ -315,58 +554,57 @@ Cloth::Cloth(GLFWwindow* theWindow, glm::vec3 theLightPos, glm::vec3 theLightCol
 	SCR_HEIGHT = height;
 	clothShader = new Shader("./cloth_simulation.vs", "./cloth_simulation.fs");
 
-	meshResolution = 20;
-	mass = 1.0;
-	restLength[0] = 4.0 / static_cast<float>(meshResolution - 1);
-	restLength[1] = sqrt(2.0) * 4.0 / static_cast<float>(meshResolution - 1);
-	restLength[2] = 2.0 * restLength[0];
-	K[0] = K[1] = K[2] = 25000.0;
-	initMesh();
-}
-
-
-void Cloth::render(Camera* camera, int step) {
-	float timeStep = 0.001;
-	int n = static_cast<int>(ceil(0.01 / timeStep));
-	for (int i = 0; i < n; i++) {
-		simulate(timeStep);
-	}
-	computeNormals();
-
-	// updateBuffers
-	for (int i = 0; i < meshResolution; i++) {
-		for (int j = 0; j < meshResolution; j++) {
-			int id = i * meshResolution + j;
-			glm::vec3 position = getPosition(i, j);
-			clothVertices[id * 6] = position.x;
-			clothVertices[id * 6 + 1] = position.y;
-			clothVertices[id * 6 + 2] = position.z;
-			glm::vec3 normal = getNormal(i, j);
-			clothVertices[id * 6 + 3] = normal.x;
-			clothVertices[id * 6 + 4] = normal.y;
-			clothVertices[id * 6 + 5] = normal.z;
+	clothVAO = clothEBO = 0;
+	requestedResolution = cloth->resolution();
+	colliderModel = NULL;
+	colliderScale = 1.0f;
+	colliderOffset = glm::vec3(0.0f);
+	playbackTime = 0.0f;
+	playbackClock = 0.0;
+	playbackPaused = false;
+	playbackFrame = -1;
+	initBuffers(cloth->resolution());
+}
+
+void ClothRenderer::render(Camera* camera, int step) {
+	const float* from;
+	const float* to;
+	float blend = 1.0f;
+	int meshResolution;
+	if (playing()) {
+		meshResolution = player.resolution();
+		if (!playbackFrames(from, to, blend))
+			return;
+	} else {
+		// the newest snapshot becomes current, the one it replaces is kept
+		// to blend from
+		if (cloth->snapshots.fresh()) {
+			previousSnapshot = cloth->snapshots.front();
+			cloth->snapshots.update();
 		}
+		const Cloth::Snapshot& current = cloth->snapshots.front();
+		meshResolution = cloth->resolution();
+		if (static_cast<int>(current.vertices.size()) != meshResolution * meshResolution * 6)
+			return;
+
+		// show the cloth one tick in the past, so there is usually a
+		// snapshot on either side of the time drawn
+		if (previousSnapshot.vertices.size() == current.vertices.size() && current.time > previousSnapshot.time) {
+			double shown = cloth->clockTime() - cloth->simulationTick;
+			blend = static_cast<float>((shown - previousSnapshot.time) / (current.time - previousSnapshot.time));
+			blend = std::min(std::max(blend, 0.0f), 1.0f);
+		}
+		from = blend < 1.0f ? previousSnapshot.vertices.data() : current.vertices.data();
+		to = current.vertices.data();
 	}
+	if (bufferResolution != meshResolution)
+		initBuffers(meshResolution);
 
-	// glBufferData(GL_ARRAY_BUFFER, sizeof(clothVertices), clothVertices, GL_STATIC_DRAW);
-	glGenVertexArrays(1, &clothVAO);
-	glGenBuffers(1, &clothVBO);
-	glGenBuffers(1, &clothEBO);
-
-	glBindBuffer(GL_ARRAY_BUFFER, clothVBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(clothVertices), clothVertices, GL_STATIC_DRAW);
-
-	glBindVertexArray(clothVAO);
-
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, clothEBO);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(clothIndices), clothIndices, GL_STATIC_DRAW);
-
-	// position attribute
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
-	glEnableVertexAttribArray(0);
-	// normal attribute
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
-	glEnableVertexAttribArray(1);
+	// updateBuffers: write the next ring region once the GPU is done with it
+	int nodes = meshResolution * meshResolution;
+	int region = ring.wait();
+	if (!ring.write(region, from, to, blend))
+		return;
 
 	glm::vec3 specular(0.2f, 0.2f, 0.2f);
 	float shininess = 32.0f;
@@ -386,43 +624,297 @@ void Cloth::render(Camera* camera, int step) {
 
 	// world transformation
 	glm::mat4 model;
-	float curPos = 0.0f + step * timeStep * 3.0 > 1.0f ? 1.0f : 0.0f + step * timeStep * 3.0;
+	float curPos = 0.0f + step * cloth->simulationTick * 3.0 > 1.0f ? 1.0f : 0.0f + step * cloth->simulationTick * 3.0;
     curPos = 0.0f;
 	glm::vec3 newPos(0.0f, curPos, -2.5f);  // 0.7f
 
 	model = glm::translate(model, newPos);
 	model = glm::scale(model, glm::vec3(0.3f));
+
+	if (colliderModel && (cloth->hasCollider() || cloth->hasColliderField())) {
+		glm::mat4 colliderTransform = glm::translate(glm::mat4(), colliderOffset);
+		colliderTransform = glm::scale(colliderTransform, glm::vec3(colliderScale));
+		clothShader->setVec3("objectColor", 0.6f, 0.6f, 0.6f);
+		clothShader->setMat4("model", model * colliderTransform);
+		colliderModel->Draw(*clothShader);
+		clothShader->setVec3("objectColor", 0.5f, 0.0f, 0.0f);
+	}
 	clothShader->setMat4("model", model);
 
 	glBindVertexArray(clothVAO);
 	// glDrawArrays(GL_TRIANGLES, 0, 36);
 	// glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-	glDrawElements(GL_TRIANGLES, (meshResolution-1) * (meshResolution-1) * 6, GL_UNSIGNED_INT, 0);
+	glDrawElementsBaseVertex(GL_TRIANGLES, (meshResolution-1) * (meshResolution-1) * 6, GL_UNSIGNED_INT, 0, region * nodes);
+	glBindVertexArray(0);
+	ring.fence(region);
+}
 
-	glDeleteVertexArrays(1, &clothVAO);
-	glDeleteBuffers(1, &clothVBO);
-	glDeleteBuffers(1, &clothEBO);
+// The settings belong to the physics thread: the widgets edit copies and
+// any change is applied with the simulation stopped.
+void ClothRenderer::gui() {
+	if (playing()) {
+		ImGui::Text("Playback: frame %d of %d", playbackFrame + 1, player.frameCount());
+		if (ImGui::Button(playbackPaused ? "play" : "pause"))
+			playbackPaused = !playbackPaused;
+		ImGui::SameLine();
+		if (ImGui::Button("back to simulation")) {
+			player.close();
+			cloth->startSimulation();
+			return;
+		}
+		// scrubbing
+		ImGui::SliderFloat("time", &playbackTime, 0.0f, (player.frameCount() - 1) * player.frameTime(), "%.2f s");
+		return;
+	}
+
+	int isa = cloth->simdIsa;
+	ImGui::Text("SIMD kernels:");
+	ImGui::RadioButton("scalar", &isa, cloth_kernels::ISA_SCALAR);
+	if (cloth->bestIsa() >= cloth_kernels::ISA_SSE4) {
+		ImGui::SameLine();
+		ImGui::RadioButton("SSE4.1", &isa, cloth_kernels::ISA_SSE4);
+	}
+	if (cloth->bestIsa() >= cloth_kernels::ISA_AVX2) {
+		ImGui::SameLine();
+		ImGui::RadioButton("AVX2", &isa, cloth_kernels::ISA_AVX2);
+	}
+
+	int mode = cloth->integrator;
+	float implicitStep = cloth->implicitTimeStep, xpbdStep = cloth->xpbdTimeStep;
+	int iterations = cloth->xpbdIterations;
+	bool adaptive = cloth->adaptiveTimeStep, multigrid = cloth->multigrid, sleeping = cloth->sleeping;
+	bool membrane = cloth->membrane;
+	float membraneStiffness[3] = { cloth->warpStiffness, cloth->weftStiffness, cloth->shearStiffness };
+	int maxSubsteps = cloth->maxSubsteps;
+	ImGui::Text("Integrator:");
+	ImGui::RadioButton("explicit Euler", &mode, Cloth::EXPLICIT_EULER);
+	ImGui::SameLine();
+	ImGui::RadioButton("implicit Euler", &mode, Cloth::IMPLICIT_EULER);
+	ImGui::SameLine();
+	ImGui::RadioButton("XPBD", &mode, Cloth::XPBD);
+	if (mode == Cloth::EXPLICIT_EULER) {
+		ImGui::Checkbox("adaptive substeps", &adaptive);
+		if (adaptive)
+			ImGui::SliderInt("max substeps", &maxSubsteps, 1, 200);
+		ImGui::Text("substeps: %d", cloth->snapshots.front().substeps);
+		ImGui::Checkbox("sleeping", &sleeping);
+		if (sleeping) {
+			ImGui::SameLine();
+			ImGui::Text("awake: %.0f%%", cloth->snapshots.front().awake * 100.0f);
+		}
+		ImGui::Checkbox("StVK membrane", &membrane);
+		if (membrane)
+			ImGui::SliderFloat3("warp, weft, shear", membraneStiffness, 1000.0f, 100000.0f, "%.0f");
+	} else if (mode == Cloth::IMPLICIT_EULER) {
+		ImGui::SliderFloat("time step", &implicitStep, 0.001f, 1.0f / 30.0f, "%.4f");
+		ImGui::Checkbox("multigrid", &multigrid);
+		ImGui::Text("CG iterations: %d", cloth->snapshots.front().cgIterations);
+	} else if (mode == Cloth::XPBD) {
+		ImGui::SliderFloat("time step", &xpbdStep, 0.001f, 1.0f / 30.0f, "%.4f");
+		ImGui::SliderInt("iterations", &iterations, 1, 100);
+		ImGui::Text("constraint colors: %d", cloth->colorCount());
+	}
+
+	bool pinned = cloth->pinned, selfCollision = cloth->selfCollision;
+	ImGui::Checkbox("pinned", &pinned);
+	ImGui::SameLine();
+	ImGui::Checkbox("self-collision", &selfCollision);
+
+	bool horizontal = cloth->horizontal;
+	ImGui::Checkbox("horizontal", &horizontal);
+	int currentCollider = cloth->hasColliderField() ? FIELD_COLLIDER : cloth->hasCollider() ? TRIANGLE_COLLIDER : NO_COLLIDER;
+	int collider = currentCollider;
+	ImGui::Text("Nanosuit collider:");
+	ImGui::RadioButton("none", &collider, NO_COLLIDER);
+	ImGui::SameLine();
+	ImGui::RadioButton("triangles", &collider, TRIANGLE_COLLIDER);
+	ImGui::SameLine();
+	ImGui::RadioButton("distance field", &collider, FIELD_COLLIDER);
+	bool continuous = cloth->continuousCollision;
+	if (collider == TRIANGLE_COLLIDER)
+		ImGui::Checkbox("continuous collision", &continuous);
+
+	bool resize = false;
+	ImGui::SliderInt("resolution", &requestedResolution, 2, 1024);
+	if (requestedResolution != cloth->resolution()) {
+		ImGui::SameLine();
+		resize = ImGui::Button("resize");
+	}
+
+	int threads = cloth->threadCount();
+	int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+	bool rethread = ImGui::SliderInt("threads", &threads, 1, maxThreads);
+
+	if (isa != cloth->simdIsa || mode != cloth->integrator || implicitStep != cloth->implicitTimeStep
+		|| xpbdStep != cloth->xpbdTimeStep || iterations != cloth->xpbdIterations
+		|| adaptive != cloth->adaptiveTimeStep || multigrid != cloth->multigrid || sleeping != cloth->sleeping
+		|| membrane != cloth->membrane || membraneStiffness[0] != cloth->warpStiffness || membraneStiffness[1] != cloth->weftStiffness
+		|| membraneStiffness[2] != cloth->shearStiffness || maxSubsteps != cloth->maxSubsteps || pinned != cloth->pinned
+		|| selfCollision != cloth->selfCollision || horizontal != cloth->horizontal || collider != currentCollider
+		|| continuous != cloth->continuousCollision
+		|| resize || rethread) {
+		bool running = cloth->stopSimulation();
+		cloth->simdIsa = static_cast<cloth_kernels::Isa>(isa);
+		cloth->integrator = static_cast<Cloth::Integrator>(mode);
+		cloth->implicitTimeStep = implicitStep;
+		cloth->xpbdTimeStep = xpbdStep;
+		cloth->xpbdIterations = iterations;
+		cloth->adaptiveTimeStep = adaptive;
+		cloth->multigrid = multigrid;
+		cloth->sleeping = sleeping;
+		cloth->membrane = membrane;
+		cloth->warpStiffness = membraneStiffness[0];
+		cloth->weftStiffness = membraneStiffness[1];
+		cloth->shearStiffness = membraneStiffness[2];
+		cloth->maxSubsteps = maxSubsteps;
+		cloth->pinned = pinned;
+		cloth->selfCollision = selfCollision;
+		cloth->continuousCollision = continuous;
+		if (collider != currentCollider)
+			setCollider(collider);
+		if (rethread)
+			cloth->setThreadCount(threads);
+		if (horizontal != cloth->horizontal) {
+			// starts over from the new layout
+			cloth->horizontal = horizontal;
+			resize = true;
+		}
+		if (resize)
+			cloth->setResolution(requestedResolution);
+		if (running)
+			cloth->startSimulation();
+	}
+
+	// one checkpoint in the working directory, to come back to a settled
+	// cloth; restoring brings its settings along
+	if (ImGui::Button("save state"))
+		cloth->saveCheckpoint("cloth.checkpoint");
+	ImGui::SameLine();
+	if (ImGui::Button("restore state") && cloth->loadCheckpoint("cloth.checkpoint"))
+		requestedResolution = cloth->resolution();
+
+	// and one recording, which plays back with the simulation stopped
+	bool recording = cloth->isRecording();
+	if (ImGui::Checkbox("record", &recording)) {
+		if (recording)
+			cloth->startRecording("cloth.vcache");
+		else
+			cloth->stopRecording();
+	}
+	ImGui::SameLine();
+	if (ImGui::Button("play recording")) {
+		cloth->stopRecording();
+		if (player.open("cloth.vcache") && player.frameCount() > 0) {
+			cloth->stopSimulation();
+			playbackTime = 0.0f;
+			playbackClock = cloth->clockTime();
+			playbackPaused = false;
+			playbackFrame = -1;
+		} else {
+			player.close();
+		}
+	}
 }
 
-void Cloth::clean() {
-	// code
+// Picks the two recorded frames around playbackTime and how far between
+// them it is. Playing on only decodes the changes of the next frame, a jump
+// decodes from the keyframe before it.
+bool ClothRenderer::playbackFrames(const float*& from, const float*& to, float& blend) {
+	double now = cloth->clockTime();
+	float duration = (player.frameCount() - 1) * player.frameTime();
+	if (!playbackPaused) {
+		playbackTime += static_cast<float>(now - playbackClock);
+		if (playbackTime > duration)
+			playbackTime = duration > 0.0f ? std::fmod(playbackTime, duration) : 0.0f;
+	}
+	playbackClock = now;
+
+	int frame = std::min(static_cast<int>(playbackTime / player.frameTime()), std::max(player.frameCount() - 2, 0));
+	int next = std::min(frame + 1, player.frameCount() - 1);
+	if (frame != playbackFrame) {
+		bool ok;
+		if (playbackFrame >= 0 && frame == playbackFrame + 1) {
+			playFrom.swap(playTo);
+			ok = true;
+		} else {
+			ok = player.readFrame(frame, playFrom);
+		}
+		playbackFrame = ok && player.readFrame(next, playTo) ? frame : -1;
+		if (playbackFrame < 0)
+			return false;
+	}
+	blend = std::min(std::max(playbackTime / player.frameTime() - frame, 0.0f), 1.0f);
+	from = playFrom.data();
+	to = playTo.data();
+	return true;
 }
 
-void Cloth::initMesh() {
-	// code
-	//std::cout << "build mesh" << std::endl;
+void ClothRenderer::clean() {
+	ring.destroy();
+	glDeleteVertexArrays(1, &clothVAO);
+	glDeleteBuffers(1, &clothEBO);
+	clothVAO = clothEBO = 0;
+}
 
-	for (int i = 0; i < meshResolution; i++) {
-		for (int j = 0; j < meshResolution; j++) {
-			glm::vec3 initPosition(-2.0 + 4.0*j / static_cast<float>(meshResolution - 1), -2.0 + 4.0*i / static_cast<float>(meshResolution - 1), 0.0);
-			glm::vec3 initVelocity(0.0f, 0.0f, 0.0f);
-			glm::vec3 initNormal(0.0f, 0.0f, 0.0f);
-			vertexPosition.push_back(initPosition);
-			vertexVelocity.push_back(initVelocity);
-			vertexNormal.push_back(initNormal);
+// Loads the nanosuit and hands it to the cloth in cloth space, either as
+// triangles or as its distance field. The model is scaled to stand 3.5 units
+// tall with the top of its head just under the pinned edge of the cloth.
+// The field is read from nanosuit.sdf next to the model when proj__sdf_bake
+// made one, otherwise it is baked here.
+void ClothRenderer::setCollider(int mode) {
+	cloth->setCollider(std::vector<glm::vec3>(), std::vector<unsigned int>());
+	cloth->setColliderField(SignedDistanceField());
+	if (mode == NO_COLLIDER)
+		return;
+
+	if (!colliderModel) {
+		colliderModel = new Model(FileSystem::getPath("resources/objects/nanosuit/nanosuit.obj"));
+		glm::vec3 lower(FLT_MAX), upper(-FLT_MAX);
+		for (size_t m = 0; m < colliderModel->meshes.size(); m++) {
+			for (size_t v = 0; v < colliderModel->meshes[m].vertices.size(); v++) {
+				lower = glm::min(lower, colliderModel->meshes[m].vertices[v].Position);
+				upper = glm::max(upper, colliderModel->meshes[m].vertices[v].Position);
+			}
 		}
+		colliderScale = upper.y > lower.y ? 3.5f / (upper.y - lower.y) : 1.0f;
+		colliderOffset = glm::vec3(0.0f, 1.5f, 0.0f) - glm::vec3(0.5f * (lower.x + upper.x), upper.y, 0.5f * (lower.z + upper.z)) * colliderScale;
+	}
+
+	std::vector<glm::vec3> vertices;
+	std::vector<unsigned int> indices;
+	for (size_t m = 0; m < colliderModel->meshes.size(); m++) {
+		const Mesh& mesh = colliderModel->meshes[m];
+		unsigned int base = static_cast<unsigned int>(vertices.size());
+		for (size_t v = 0; v < mesh.vertices.size(); v++)
+			vertices.push_back(mesh.vertices[v].Position);
+		for (size_t k = 0; k < mesh.indices.size(); k++)
+			indices.push_back(base + mesh.indices[k]);
+	}
+
+	if (mode == TRIANGLE_COLLIDER) {
+		for (size_t v = 0; v < vertices.size(); v++)
+			vertices[v] = vertices[v] * colliderScale + colliderOffset;
+		cloth->setCollider(vertices, indices);
+		return;
 	}
-	computeNormals();
+	SignedDistanceField field;
+	if (!field.load(FileSystem::getPath("resources/objects/nanosuit/nanosuit.sdf"))) {
+		float cellSize = 3.5f / colliderScale / 256.0f;
+		ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+		field.bake(vertices, indices, cellSize, 4.0f * cellSize, &pool);
+	}
+	field.place(colliderScale, colliderOffset);
+	cloth->setColliderField(field);
+}
+
+// (Re)creates the GL objects for the current resolution. The vertex ring
+// holds a copy of the mesh per region; the indices never change, so they
+// are uploaded once here and the frames pick their region with a base vertex.
+void ClothRenderer::initBuffers(int meshResolution) {
+	clean();
+	bufferResolution = meshResolution;
+
+	std::vector<unsigned int> clothIndices((meshResolution - 1) * (meshResolution - 1) * 6);
 	int k = 0;
 	for (int i = 0; i < meshResolution - 1; i++) {
 		for (int j = 0; j < meshResolution - 1; j++) {
@@ -435,156 +927,372 @@ void Cloth::initMesh() {
 			++k;
 		}
 	}
+
+	glGenVertexArrays(1, &clothVAO);
+	glGenBuffers(1, &clothEBO);
+	glBindVertexArray(clothVAO);
+
+	ring.create(meshResolution * meshResolution * 6);
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, clothEBO);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, clothIndices.size() * sizeof(unsigned int), clothIndices.data(), GL_STATIC_DRAW);
+
+	// position attribute
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
+	glEnableVertexAttribArray(0);
+	// normal attribute
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
+	glEnableVertexAttribArray(1);
+	glBindVertexArray(0);
 }
 
-glm::vec3 Cloth::getPosition(int i, int j) {
-	int index = i * meshResolution + j;
-	return glm::vec3(vertexPosition[index].x, vertexPosition[index].y, vertexPosition[index].z);
+
+// panels
+ClothWorldRenderer::ClothWorldRenderer(ClothWorld* theWorld, glm::vec3 theLightPos, glm::vec3 theLightColor, float width, float height) {
+	world = theWorld;
+	lightPos = theLightPos;
+	lightColor = theLightColor;
+	SCR_WIDTH = width;
+	SCR_HEIGHT = height;
+	worldShader = new Shader("./cloth_world.vs", "./cloth_simulation.fs");
+
+	worldVAO = worldEBO = instanceVBO = indirectBuffer = 0;
+	bufferNodes = bufferCloths = -1;
+	requestedPanels = 24;
+	requestedResolution = 32;
+	buildPanels();
 }
 
-void Cloth::setPosition(int i, int j, glm::vec3 value) {
-	int index = i * meshResolution + j;
-	vertexPosition[index] = value;
+// The panels stand in a grid facing the camera, every other one turned a
+// little about y. Every other panel also has half the resolution, so the
+// bigger ones take more of the pool and the index buffer holds two grids.
+void ClothWorldRenderer::buildPanels() {
+	bool running = world->stopSimulation();
+	world->clear();
+	int columns = static_cast<int>(ceil(sqrt(static_cast<float>(requestedPanels))));
+	int rows = (requestedPanels + columns - 1) / columns;
+	for (int c = 0; c < requestedPanels; c++) {
+		int column = c % columns, row = c / columns;
+		glm::mat4 model;
+		model = glm::translate(model, glm::vec3((column - 0.5f * (columns - 1)) * 5.0f, (0.5f * (rows - 1) - row) * 5.0f, 0.0f));
+		model = glm::rotate(model, c % 2 ? 0.4f : -0.4f, glm::vec3(0.0f, 1.0f, 0.0f));
+		world->addCloth(c % 2 ? std::max(requestedResolution / 2, 2) : requestedResolution, model);
+	}
+	if (running)
+		world->startSimulation();
 }
 
-glm::vec3 Cloth::getNormal(int i, int j) {
-	int index = i * meshResolution + j;
-	return glm::vec3(vertexNormal[index].x, vertexNormal[index].y, vertexNormal[index].z);
+void ClothWorldRenderer::render(Camera* camera) {
+	if (world->snapshots.fresh()) {
+		previousSnapshot = world->snapshots.front();
+		world->snapshots.update();
+	}
+	const ClothWorld::Snapshot& current = world->snapshots.front();
+	int nodes = world->nodeCount();
+	if (nodes == 0 || static_cast<int>(current.vertices.size()) != nodes * 6)
+		return;
+	if (bufferNodes != nodes || bufferCloths != world->clothCount())
+		initBuffers();
+
+	float blend = 1.0f;
+	if (previousSnapshot.vertices.size() == current.vertices.size() && current.time > previousSnapshot.time) {
+		double shown = world->clockTime() - world->simulationTick;
+		blend = static_cast<float>((shown - previousSnapshot.time) / (current.time - previousSnapshot.time));
+		blend = std::min(std::max(blend, 0.0f), 1.0f);
+	}
+	const float* from = blend < 1.0f ? previousSnapshot.vertices.data() : current.vertices.data();
+	const float* to = current.vertices.data();
+
+	int region = ring.wait();
+	if (!ring.write(region, from, to, blend))
+		return;
+
+	worldShader->use();
+	worldShader->setVec3("objectColor", 0.5f, 0.0f, 0.0f);
+	worldShader->setVec3("lightColor", lightColor);
+	worldShader->setVec3("lightPos", lightPos);
+	worldShader->setVec3("viewPos", camera->Position);
+	glm::mat4 projection = glm::perspective(glm::radians(camera->Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
+	glm::mat4 view = glm::mat4(glm::mat3(camera->GetViewMatrix()));
+	worldShader->setMat4("projection", projection);
+	worldShader->setMat4("view", view);
+
+	// the whole grid of panels about as wide as the single cloth
+	int columns = static_cast<int>(ceil(sqrt(static_cast<float>(world->clothCount()))));
+	glm::mat4 model;
+	model = glm::translate(model, glm::vec3(0.0f, 0.0f, -2.5f));
+	model = glm::scale(model, glm::vec3(1.5f / (5.0f * columns)));
+	worldShader->setMat4("model", model);
+
+	int cloths = world->clothCount();
+	glBindVertexArray(worldVAO);
+	if (indirectBuffer) {
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+		glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(region * cloths * sizeof(DrawCommand)), cloths, 0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	} else {
+		// without base instances the matrix goes in as a constant attribute
+		for (int c = 0; c < cloths; c++) {
+			const DrawCommand& command = commands[region * cloths + c];
+			const glm::mat4& panel = world->clothModel(c);
+			for (int column = 0; column < 4; column++)
+				glVertexAttrib4fv(2 + column, glm::value_ptr(panel[column]));
+			glDrawElementsBaseVertex(GL_TRIANGLES, command.count, GL_UNSIGNED_INT,
+				(void*)(command.firstIndex * sizeof(unsigned int)), command.baseVertex);
+		}
+	}
+	glBindVertexArray(0);
+	ring.fence(region);
 }
 
-glm::vec3 Cloth::getVelocity(int i, int j) {
-	int index = i * meshResolution + j;
-	return glm::vec3(vertexVelocity[index].x, vertexVelocity[index].y, vertexVelocity[index].z);
+// The panel layout only changes with the simulation stopped; rendering just
+// picks it up from the next snapshot.
+void ClothWorldRenderer::gui() {
+	ImGui::Text("nodes: %d in %d panels", world->nodeCount(), world->clothCount());
+	ImGui::SliderInt("panels", &requestedPanels, 1, 100);
+	ImGui::SliderInt("resolution", &requestedResolution, 2, 256);
+	ImGui::SameLine();
+	if (ImGui::Button("rebuild"))
+		buildPanels();
+
+	int threads = world->threadCount();
+	int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+	if (ImGui::SliderInt("threads", &threads, 1, maxThreads))
+		world->setThreadCount(threads);
 }
 
-void Cloth::setVelocity(int i, int j, glm::vec3 value) {
-	int index = i * meshResolution + j;
-	vertexVelocity[index] = value;
+void ClothWorldRenderer::clean() {
+	ring.destroy();
+	glDeleteVertexArrays(1, &worldVAO);
+	glDeleteBuffers(1, &worldEBO);
+	glDeleteBuffers(1, &instanceVBO);
+	glDeleteBuffers(1, &indirectBuffer);
+	worldVAO = worldEBO = instanceVBO = indirectBuffer = 0;
+	commands.clear();
 }
 
-void Cloth::computeNormals() {
-	//std::cout << "compute normals" << std::endl;
-	int dx[6] = { 1, 1, 0, -1, -1, 0 }, dy[6] = { 0, 1, 1, 0, -1, -1 };
-	glm::vec3 e1, e2;
-	int k = 0;
-	for (int i = 0; i < meshResolution; i++) {
-		for (int j = 0; j < meshResolution; j++) {
-			glm::vec3 p0 = getPosition(i, j);
-			std::vector<glm::vec3> norms;
-			for (int t = 0; t < 6; t++) {
-				int i1 = i + dy[t], j1 = j + dx[t];
-				int i2 = i + dy[(t + 1) % 6], j2 = j + dx[(t + 1) % 6];
-				if (i1 >= 0 && i1 < meshResolution && j1 >= 0 && j1 < meshResolution &&
-					i2 >= 0 && i2 < meshResolution && j2 >= 0 && j2 < meshResolution) {
-					e1 = getPosition(i1, j1) - p0;
-					e2 = getPosition(i2, j2) - p0;
-					norms.push_back(glm::normalize(glm::cross(e1, e2)));
-				}
+// (Re)creates the GL objects for the current panels. Without OpenGL 4.3
+// there are no indirect draws with base instances, and render() falls back
+// to one draw per panel.
+void ClothWorldRenderer::initBuffers() {
+	clean();
+	int nodes = world->nodeCount(), cloths = world->clothCount();
+	bufferNodes = nodes;
+	bufferCloths = cloths;
+
+	std::vector<unsigned int> indices;
+	std::map<int, unsigned int> gridStart; // first index of the grid of each resolution
+	std::vector<glm::mat4> panels(cloths);
+	for (int c = 0; c < cloths; c++) {
+		int meshResolution = world->clothResolution(c);
+		panels[c] = world->clothModel(c);
+		if (gridStart.count(meshResolution))
+			continue;
+		gridStart[meshResolution] = static_cast<unsigned int>(indices.size());
+		for (int i = 0; i < meshResolution - 1; i++) {
+			for (int j = 0; j < meshResolution - 1; j++) {
+				indices.push_back(i * meshResolution + j);
+				indices.push_back(i * meshResolution + j + 1);
+				indices.push_back((i + 1) * meshResolution + j + 1);
+				indices.push_back(i * meshResolution + j);
+				indices.push_back((i + 1) * meshResolution + j + 1);
+				indices.push_back((i + 1) * meshResolution + j);
 			}
-			e1 = glm::vec3(0.0f, 0.0f, 0.0f);
-			for (int t = 0; t < norms.size(); t++) {
-				e1 = e1 + norms[t];
-			}
-			int index = i * meshResolution + j;
-			vertexNormal[index] = glm::normalize(e1);
 		}
 	}
-}
-
-void Cloth::simulate(float stepSize) {
-	// code
-	glm::vec3 pin1 = getPosition(meshResolution - 1, 0), pin2 = getPosition(meshResolution - 1, meshResolution - 1);
-
-	for (int i = 0; i < meshResolution; i++) {
-		for (int j = 0; j < meshResolution; j++) {
-			glm::vec3 newVelocity = getVelocity(i, j) + getForce(i, j) * stepSize / mass;
-			setVelocity(i, j, newVelocity);
+	commands.resize(VertexRing::regions * cloths);
+	for (int r = 0; r < VertexRing::regions; r++) {
+		for (int c = 0; c < cloths; c++) {
+			DrawCommand& command = commands[r * cloths + c];
+			int meshResolution = world->clothResolution(c);
+			command.count = (meshResolution - 1) * (meshResolution - 1) * 6;
+			command.instanceCount = 1;
+			command.firstIndex = gridStart[meshResolution];
+			command.baseVertex = r * nodes + world->clothFirstNode(c);
+			command.baseInstance = c;
 		}
 	}
 
-	// Notice that the updated velocity above is used for better numerical stability.
-	for (int i = 0; i < meshResolution; i++) {
-		for (int j = 0; j < meshResolution; j++) {
-			glm::vec3 newPosition = getPosition(i, j) + getVelocity(i, j) * stepSize;
-			setPosition(i, j, newPosition);
+	glGenVertexArrays(1, &worldVAO);
+	glGenBuffers(1, &worldEBO);
+	glBindVertexArray(worldVAO);
+
+	ring.create(nodes * 6);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
+	glEnableVertexAttribArray(1);
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, worldEBO);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+
+	if (GLAD_GL_VERSION_4_3) {
+		// one matrix per instance, four vec4 columns
+		glGenBuffers(1, &instanceVBO);
+		glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+		glBufferData(GL_ARRAY_BUFFER, panels.size() * sizeof(glm::mat4), panels.data(), GL_STATIC_DRAW);
+		for (int column = 0; column < 4; column++) {
+			glVertexAttribPointer(2 + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(column * sizeof(glm::vec4)));
+			glEnableVertexAttribArray(2 + column);
+			glVertexAttribDivisor(2 + column, 1);
 		}
-	}
-	
-	glm::vec3 newPin1(pin1.x + stepSize*10, pin1.y, pin1.z);
-	glm::vec3 newPin2(pin2.x + stepSize*10, pin2.y, pin2.z);
 
-	setPosition(meshResolution - 1, 0, pin1);
-	setPosition(meshResolution - 1, meshResolution - 1, pin2);
+		glGenBuffers(1, &indirectBuffer);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawCommand), commands.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+	glBindVertexArray(0);
 }
 
-glm::vec3 Cloth::getForce(int i, int j) {
-	glm::vec3 F_spring = getAllSprings(i, j) + getGravityForce(i, j) + getDampingForce(i, j) + getViscousForce(i, j);
-	return F_spring;
+// triangle mesh
+TriangleClothRenderer::TriangleClothRenderer(TriangleCloth* theCloth, glm::vec3 theLightPos, glm::vec3 theLightColor, float width, float height) {
+	cloth = theCloth;
+	lightPos = theLightPos;
+	lightColor = theLightColor;
+	SCR_WIDTH = width;
+	SCR_HEIGHT = height;
+	clothShader = new Shader("./cloth_simulation.vs", "./cloth_simulation.fs");
+
+	clothVAO = clothEBO = 0;
+	bufferNodes = bufferIndices = -1;
+	requestedRings = 32;
+	modelPath[0] = '\0';
+	pinnedTop = 0.02f;
+	loadDisc();
 }
 
-glm::vec3 Cloth::getAllSprings(int i, int j) {
-	glm::vec3 f = glm::vec3(0.0f, 0.0f, 0.0f);
+void TriangleClothRenderer::loadDisc() {
+	std::vector<glm::vec3> vertices;
+	std::vector<unsigned int> indices;
+	makeDiscMesh(requestedRings, vertices, indices);
+	cloth->setMesh(vertices, indices);
+	cloth->pinTop(pinnedTop);
+}
 
-	// 0.Structural: [i, j+1], [i, j-1], [i+1, j], [i-1, j]
-	if ((j + 1) < meshResolution) {
-		f = f + getSpringForce(getPosition(i, j), getPosition(i, j + 1), 0);
-	}
-	if ((j - 1) >= 0) {
-		f = f + getSpringForce(getPosition(i, j), getPosition(i, j - 1), 0);
-	}
-	if ((i + 1) < meshResolution) {
-		f = f + getSpringForce(getPosition(i, j), getPosition(i + 1, j), 0);
-	}
-	if ((i - 1) >= 0) {
-		f = f + getSpringForce(getPosition(i, j), getPosition(i - 1, j), 0);
+// Every mesh of the model goes in, fitted into the 4 x 4 square the grid
+// cloth hangs in. Vertices the model splits along its seams are welded back
+// together by setMesh.
+bool TriangleClothRenderer::loadModel(const std::string& path) {
+	Model model(FileSystem::getPath(path));
+	std::vector<glm::vec3> vertices;
+	std::vector<unsigned int> indices;
+	glm::vec3 lower(FLT_MAX), upper(-FLT_MAX);
+	for (size_t m = 0; m < model.meshes.size(); m++) {
+		const Mesh& mesh = model.meshes[m];
+		unsigned int base = static_cast<unsigned int>(vertices.size());
+		for (size_t v = 0; v < mesh.vertices.size(); v++) {
+			vertices.push_back(mesh.vertices[v].Position);
+			lower = glm::min(lower, mesh.vertices[v].Position);
+			upper = glm::max(upper, mesh.vertices[v].Position);
+		}
+		for (size_t k = 0; k < mesh.indices.size(); k++)
+			indices.push_back(base + mesh.indices[k]);
 	}
+	if (indices.empty())
+		return false;
+	glm::vec3 extent = upper - lower;
+	float scale = 4.0f / std::max(std::max(extent.x, extent.y), std::max(extent.z, 1e-6f));
+	for (size_t v = 0; v < vertices.size(); v++)
+		vertices[v] = (vertices[v] - 0.5f * (lower + upper)) * scale;
+	cloth->setMesh(vertices, indices);
+	cloth->pinTop(pinnedTop);
+	return true;
+}
 
-	// 1.Shear: [i+1, j+1], [i+1, j-1], [i-1, j-1], [i-1, j+1]
-	if ((i + 1) < meshResolution && (j + 1) < meshResolution) {
-		f = f + getSpringForce(getPosition(i, j), getPosition(i + 1, j + 1), 1);
+void TriangleClothRenderer::render(Camera* camera) {
+	if (cloth->snapshots.fresh()) {
+		previousSnapshot = cloth->snapshots.front();
+		cloth->snapshots.update();
 	}
-	if ((i + 1) < meshResolution && (j - 1) >= 0) {
-		f = f + getSpringForce(getPosition(i, j), getPosition(i + 1, j - 1), 1);
-	}
-	if ((i - 1) >= 0 && (j - 1) >= 0) {
-		f = f + getSpringForce(getPosition(i, j), getPosition(i - 1, j - 1), 1);
-	}
-	if ((i - 1) >= 0 && (j + 1) < meshResolution) {
-		f = f + getSpringForce(getPosition(i, j), getPosition(i - 1, j + 1), 1);
+	const TriangleCloth::Snapshot& current = cloth->snapshots.front();
+	int nodes = cloth->nodeCount();
+	if (nodes == 0 || static_cast<int>(current.vertices.size()) != nodes * 6)
+		return;
+	if (bufferNodes != nodes || bufferIndices != static_cast<int>(cloth->triangles().size()))
+		initBuffers();
+
+	float blend = 1.0f;
+	if (previousSnapshot.vertices.size() == current.vertices.size() && current.time > previousSnapshot.time) {
+		double shown = cloth->clockTime() - cloth->simulationTick;
+		blend = static_cast<float>((shown - previousSnapshot.time) / (current.time - previousSnapshot.time));
+		blend = std::min(std::max(blend, 0.0f), 1.0f);
 	}
+	const float* from = blend < 1.0f ? previousSnapshot.vertices.data() : current.vertices.data();
+	const float* to = current.vertices.data();
 
-	// 2.Flexion: [i, j+2], [i, j-2], [i+2, j], [i-2, j]
-	if ((j + 2) < meshResolution) {
-		f = f + getSpringForce(getPosition(i, j), getPosition(i, j + 2), 2);
-	}
-	if ((j - 2) >= 0) {
-		f = f + getSpringForce(getPosition(i, j), getPosition(i, j - 2), 2);
-	}
-	if ((i + 2) < meshResolution) {
-		f = f + getSpringForce(getPosition(i, j), getPosition(i + 2, j), 2);
-	}
-	if ((i - 2) >= 0) {
-		f = f + getSpringForce(getPosition(i, j), getPosition(i - 2, j), 2);
-	}
-	return f;
-}
-glm::vec3 Cloth::getSpringForce(glm::vec3 p, glm::vec3 q, int type) {
-	glm::vec3 p_q = p - q;
-	float len = glm::length(p_q);
-	glm::vec3 result = p_q * (K[type] * (restLength[type] - len) / len);
-	return result;
+	int region = ring.wait();
+	if (!ring.write(region, from, to, blend))
+		return;
+
+	clothShader->use();
+	clothShader->setVec3("objectColor", 0.5f, 0.0f, 0.0f);
+	clothShader->setVec3("lightColor", lightColor);
+	clothShader->setVec3("lightPos", lightPos);
+	clothShader->setVec3("viewPos", camera->Position);
+	glm::mat4 projection = glm::perspective(glm::radians(camera->Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
+	glm::mat4 view = glm::mat4(glm::mat3(camera->GetViewMatrix()));
+	clothShader->setMat4("projection", projection);
+	clothShader->setMat4("view", view);
+
+	// where ClothRenderer puts the grid cloth
+	glm::mat4 model;
+	model = glm::translate(model, glm::vec3(0.0f, 0.0f, -2.5f));
+	model = glm::scale(model, glm::vec3(0.3f));
+	clothShader->setMat4("model", model);
+
+	glBindVertexArray(clothVAO);
+	glDrawElementsBaseVertex(GL_TRIANGLES, bufferIndices, GL_UNSIGNED_INT, 0, region * nodes);
+	glBindVertexArray(0);
+	ring.fence(region);
 }
-glm::vec3 Cloth::getGravityForce(int i, int j) {
-	float g = 9.8;
-	return glm::vec3(0.0f, - mass * g, 0.0f);
+
+// the mesh only changes with the simulation stopped, setMesh sees to that
+void TriangleClothRenderer::gui() {
+	ImGui::Text("nodes: %d, springs: %d, pinned: %d", cloth->nodeCount(), cloth->springCount(), cloth->pinCount());
+	ImGui::SliderFloat("pinned top", &pinnedTop, 0.0f, 0.2f, "%.3f");
+	ImGui::SliderInt("rings", &requestedRings, 1, 128);
+	ImGui::SameLine();
+	if (ImGui::Button("disc"))
+		loadDisc();
+	ImGui::InputText("model", modelPath, sizeof(modelPath));
+	ImGui::SameLine();
+	if (ImGui::Button("load") && !loadModel(modelPath))
+		loadDisc();
+
+	int threads = cloth->threadCount();
+	int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+	if (ImGui::SliderInt("threads", &threads, 1, maxThreads))
+		cloth->setThreadCount(threads);
 }
-glm::vec3 Cloth::getDampingForce(int i, int j) {
-	float Cd = 0.5;
-	return getVelocity(i, j) * (-Cd);
+
+void TriangleClothRenderer::clean() {
+	ring.destroy();
+	glDeleteVertexArrays(1, &clothVAO);
+	glDeleteBuffers(1, &clothEBO);
+	clothVAO = clothEBO = 0;
 }
-glm::vec3 Cloth::getViscousForce(int i, int j) {
-	float Cv = 0.5;
-	glm::vec3 uf = glm::vec3(0.0f, 0.0f, 1.0f);
-	float factor = Cv * glm::dot(getNormal(i, j), (uf - getVelocity(i, j)));
-	return getNormal(i, j) * factor;
+
+// (Re)creates the GL objects for the current mesh, its triangles go into
+// the EBO once
+void TriangleClothRenderer::initBuffers() {
+	clean();
+	int nodes = cloth->nodeCount();
+	const std::vector<unsigned int>& indices = cloth->triangles();
+	bufferNodes = nodes;
+	bufferIndices = static_cast<int>(indices.size());
+
+	glGenVertexArrays(1, &clothVAO);
+	glGenBuffers(1, &clothEBO);
+	glBindVertexArray(clothVAO);
+
+	ring.create(nodes * 6);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
+	glEnableVertexAttribArray(1);
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, clothEBO);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+	glBindVertexArray(0);
 }
@@ -0,0 +1,292 @@
+#include "cloth_world.h"
+
+#include "cloth.h"
+
+#include <algorithm>
+#include <cmath>
+
+ClothWorld::ClothWorld() {
+	mass = 1.0;
+	K[0] = K[1] = K[2] = 25000.0;
+	gravity = 9.8;
+	Cd = 0.5;
+	Cv = 0.5;
+	flowVelocity = glm::vec3(0.0f, 0.0f, 1.0f);
+	timeStep = 0.001;
+	simulationTick = 0.01;
+	maxSimdIsa = simdIsa = cloth_kernels::detectIsa();
+	pool = NULL;
+	setThreadCount(std::thread::hardware_concurrency());
+}
+
+ClothWorld::~ClothWorld() {
+	stopSimulation();
+	delete pool;
+}
+
+void ClothWorld::setThreadCount(int threads) {
+	bool running = stopSimulation();
+	delete pool;
+	pool = new ThreadPool(threads > 0 ? threads : 1);
+	initBands();
+	if (running)
+		startSimulation();
+}
+
+// The new panel goes after the others in every array, so their nodes keep
+// their indices and only their state has to be carried over.
+int ClothWorld::addCloth(int resolution, const glm::mat4& model) {
+	bool running = stopSimulation();
+	resolution = std::max(resolution, 2);
+	int oldNodes = nodeCount();
+	std::vector<float> position[3], velocity[3];
+	for (int c = 0; c < 3; c++) {
+		position[c].assign(vertexPosition[c].data(), vertexPosition[c].data() + oldNodes);
+		velocity[c].assign(vertexVelocity[c].data(), vertexVelocity[c].data() + oldNodes);
+	}
+
+	Panel cloth;
+	cloth.resolution = resolution;
+	cloth.firstNode = oldNodes;
+	cloth.firstRow = cloths.empty() ? 0 : cloths.back().firstRow + cloths.back().resolution;
+	cloth.firstFace = cloths.empty() ? 0
+		: cloths.back().firstFace + cloths.back().resolution * (cloths.back().resolution + 1) + 1;
+	cloth.model = model;
+	cloth.sceneToPanel = glm::inverse(glm::mat3(model));
+	cloths.push_back(cloth);
+	initArrays(oldNodes + resolution * resolution);
+
+	for (int c = 0; c < 3; c++) {
+		std::copy(position[c].begin(), position[c].end(), &vertexPosition[c][0]);
+		std::copy(velocity[c].begin(), velocity[c].end(), &vertexVelocity[c][0]);
+	}
+	for (int i = 0; i < resolution; i++) {
+		for (int j = 0; j < resolution; j++) {
+			glm::vec3 initPosition(-2.0 + 4.0*j / static_cast<float>(resolution - 1), -2.0 + 4.0*i / static_cast<float>(resolution - 1), 0.0);
+			store3(vertexPosition, oldNodes + i * resolution + j, initPosition);
+		}
+	}
+	cloths.back().pins[0] = load3(vertexPosition, oldNodes + (resolution - 1) * resolution);
+	cloths.back().pins[1] = load3(vertexPosition, oldNodes + resolution * resolution - 1);
+
+	// the springs of every panel, with the nodes numbered across all of them
+	std::vector<int> a, b, type;
+	std::vector<float> rest;
+	springRuns.clear();
+	rowRuns.clear();
+	for (size_t p = 0; p < cloths.size(); p++) {
+		float restLength[3];
+		restLength[0] = 4.0 / static_cast<float>(cloths[p].resolution - 1);
+		restLength[1] = sqrt(2.0) * 4.0 / static_cast<float>(cloths[p].resolution - 1);
+		restLength[2] = 2.0 * restLength[0];
+		appendGridSprings(cloths[p].resolution, cloths[p].firstNode, restLength, a, b, rest, type, springRuns, rowRuns);
+	}
+	rowRuns.push_back(static_cast<int>(springRuns.size()));
+	springA.assign(a.data(), a.size());
+	springB.assign(b.data(), b.size());
+	springRest.assign(rest.data(), rest.size());
+	springType.assign(type.data(), type.size());
+
+	initBands();
+	computeNormals();
+	if (running)
+		startSimulation();
+	return clothCount() - 1;
+}
+
+void ClothWorld::clear() {
+	bool running = stopSimulation();
+	cloths.clear();
+	initArrays(0);
+	springA.resize(0);
+	springB.resize(0);
+	springRest.resize(0);
+	springType.resize(0);
+	springRuns.clear();
+	rowRuns.clear();
+	initBands();
+	if (running)
+		startSimulation();
+}
+
+void ClothWorld::initArrays(int nodes) {
+	for (int c = 0; c < 3; c++) {
+		vertexPosition[c].resize(nodes);
+		vertexVelocity[c].resize(nodes);
+		vertexNormal[c].resize(nodes);
+		vertexForce[c].resize(nodes);
+	}
+	int faces = cloths.empty() ? 0 : cloths.back().firstFace + cloths.back().resolution * (cloths.back().resolution + 1) + 1;
+	for (int c = 0; c < 6; c++)
+		faceNormal[c].resize(faces);
+}
+
+void ClothWorld::initBands() {
+	bands.clear();
+	parityBands[0].clear();
+	parityBands[1].clear();
+	for (int p = 0; p < clothCount(); p++) {
+		for (int row = 0, index = 0; row < cloths[p].resolution; row += bandRows, index++) {
+			Band band;
+			band.cloth = p;
+			band.rowBegin = row;
+			band.rowEnd = std::min(row + bandRows, cloths[p].resolution);
+			bands.push_back(band);
+			parityBands[index % 2].push_back(band);
+		}
+	}
+	groupTasks(bands, bandTasks);
+	groupTasks(parityBands[0], parityTasks[0]);
+	groupTasks(parityBands[1], parityTasks[1]);
+}
+
+void ClothWorld::groupTasks(const std::vector<Band>& list, std::vector<int>& tasks) {
+	int total = 0;
+	for (size_t b = 0; b < list.size(); b++)
+		total += (list[b].rowEnd - list[b].rowBegin) * cloths[list[b].cloth].resolution;
+	int target = std::max(1, total / (4 * pool->size()));
+	tasks.clear();
+	int nodes = 0;
+	for (size_t b = 0; b < list.size(); b++) {
+		if (b == 0 || nodes >= target) {
+			tasks.push_back(static_cast<int>(b));
+			nodes = 0;
+		}
+		nodes += (list[b].rowEnd - list[b].rowBegin) * cloths[list[b].cloth].resolution;
+	}
+	tasks.push_back(static_cast<int>(list.size()));
+}
+
+// fn on every band of list, one task of tasks at a time
+void ClothWorld::parallelBands(const std::vector<Band>& list, const std::vector<int>& tasks,
+	const std::function<void(const Band&)>& fn) {
+	pool->run(static_cast<int>(tasks.size()) - 1, [&](int t) {
+		for (int b = tasks[t]; b < tasks[t + 1]; b++)
+			fn(list[b]);
+	});
+}
+
+void ClothWorld::startSimulation() {
+	if (physics.isRunning())
+		return;
+	publishSnapshot();
+	physics.start(simulationTick, [this] {
+		advance(simulationTick);
+		publishSnapshot();
+	});
+}
+
+void ClothWorld::publishSnapshot() {
+	physics.publish<Snapshot>(snapshots, [this](Snapshot& snapshot) {
+		snapshot.vertices.resize(nodeCount() * 6);
+		float* vertices = snapshot.vertices.data();
+		parallelBands(bands, bandTasks, [&](const Band& band) {
+			const Panel& cloth = cloths[band.cloth];
+			interleaveVertices(vertexPosition, vertexNormal, cloth.firstNode + band.rowBegin * cloth.resolution,
+				cloth.firstNode + band.rowEnd * cloth.resolution, vertices);
+		});
+	});
+}
+
+int ClothWorld::advance(float frameTime) {
+	int n = static_cast<int>(ceil(frameTime / timeStep - 1e-4));
+	n = std::max(n, 1);
+	for (int i = 0; i < n; i++)
+		simulate(frameTime / n);
+	computeNormals();
+	return n;
+}
+
+// kinetic plus gravitational plus spring energy of all panels, each in its
+// own space
+double ClothWorld::computeEnergy() {
+	double energy = 0.0;
+	for (int p = 0; p < clothCount(); p++) {
+		const Panel& cloth = cloths[p];
+		int end = cloth.firstNode + cloth.resolution * cloth.resolution;
+		for (int i = cloth.firstNode; i < end; i++) {
+			glm::vec3 v = load3(vertexVelocity, i);
+			if (i != end - 1 && i != end - cloth.resolution)
+				energy += 0.5 * mass * glm::dot(v, v);
+			energy += mass * gravity * vertexPosition[1][i];
+		}
+	}
+	for (int s = 0; s < static_cast<int>(springA.size()); s++) {
+		double stretch = glm::length(load3(vertexPosition, springA[s]) - load3(vertexPosition, springB[s])) - springRest[s];
+		energy += 0.5 * K[springType[s]] * stretch * stretch;
+	}
+	return energy;
+}
+
+// symplectic Euler as in Cloth::simulate. Spring forces are taken by even
+// bands, then odd ones; the node updates only touch their own band, so
+// velocities and positions are integrated in the same pass.
+void ClothWorld::simulate(float stepSize) {
+	ParticleView particles = particleView(0);
+	SpringView springs;
+	springs.a = springA.data();
+	springs.b = springB.data();
+	springs.rest = springRest.data();
+	springs.type = springType.data();
+
+	for (int parity = 0; parity < 2; parity++) {
+		parallelBands(parityBands[parity], parityTasks[parity], [&](const Band& band) {
+			const Panel& cloth = cloths[band.cloth];
+			int firstRun = rowRuns[cloth.firstRow + band.rowBegin], lastRun = rowRuns[cloth.firstRow + band.rowEnd];
+			cloth_kernels::accumulateSprings(simdIsa, particles, springs, K, springRuns.data() + firstRun, lastRun - firstRun);
+		});
+	}
+
+	parallelBands(bands, bandTasks, [&](const Band& band) {
+		const Panel& cloth = cloths[band.cloth];
+		ForceParams params;
+		glm::vec3 flow = cloth.sceneToPanel * flowVelocity;
+		for (int t = 0; t < 3; t++)
+			params.flowVelocity[t] = flow[t];
+		params.mass = mass;
+		params.gravity = gravity;
+		params.Cd = Cd;
+		params.Cv = Cv;
+		params.stepSize = stepSize;
+		int begin = cloth.firstNode + band.rowBegin * cloth.resolution, end = cloth.firstNode + band.rowEnd * cloth.resolution;
+		cloth_kernels::integrateVelocities(simdIsa, particles, params, begin, end);
+		cloth_kernels::integratePositions(simdIsa, particles, stepSize, begin, end);
+	});
+
+	for (int p = 0; p < clothCount(); p++) {
+		const Panel& cloth = cloths[p];
+		store3(vertexPosition, cloth.firstNode + (cloth.resolution - 1) * cloth.resolution, cloth.pins[0]);
+		store3(vertexPosition, cloth.firstNode + cloth.resolution * cloth.resolution - 1, cloth.pins[1]);
+	}
+}
+
+void ClothWorld::computeNormals() {
+	parallelBands(bands, bandTasks, [&](const Band& band) {
+		const Panel& cloth = cloths[band.cloth];
+		cloth_kernels::faceNormals(simdIsa, particleView(cloth.firstNode), faceView(cloth), cloth.resolution,
+			band.rowBegin, std::min(band.rowEnd, cloth.resolution - 1));
+	});
+	parallelBands(bands, bandTasks, [&](const Band& band) {
+		const Panel& cloth = cloths[band.cloth];
+		cloth_kernels::gatherNormals(simdIsa, particleView(cloth.firstNode), faceView(cloth), cloth.resolution,
+			band.rowBegin * cloth.resolution, band.rowEnd * cloth.resolution);
+	});
+}
+
+// the particles from firstNode on, so a panel's kernels can count its nodes from 0
+ParticleView ClothWorld::particleView(int firstNode) {
+	ParticleView p;
+	p.px = vertexPosition[0].data() + firstNode; p.py = vertexPosition[1].data() + firstNode; p.pz = vertexPosition[2].data() + firstNode;
+	p.vx = vertexVelocity[0].data() + firstNode; p.vy = vertexVelocity[1].data() + firstNode; p.vz = vertexVelocity[2].data() + firstNode;
+	p.nx = vertexNormal[0].data() + firstNode; p.ny = vertexNormal[1].data() + firstNode; p.nz = vertexNormal[2].data() + firstNode;
+	p.fx = vertexForce[0].data() + firstNode; p.fy = vertexForce[1].data() + firstNode; p.fz = vertexForce[2].data() + firstNode;
+	return p;
+}
+
+FaceView ClothWorld::faceView(const Panel& cloth) {
+	int first = cloth.firstFace + cloth.resolution + 1;
+	FaceView faces;
+	faces.ax = faceNormal[0].data() + first; faces.ay = faceNormal[1].data() + first; faces.az = faceNormal[2].data() + first;
+	faces.bx = faceNormal[3].data() + first; faces.by = faceNormal[4].data() + first; faces.bz = faceNormal[5].data() + first;
+	return faces;
+}
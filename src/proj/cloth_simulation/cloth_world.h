@@ -0,0 +1,139 @@
+#ifndef CLOTH_WORLD_H
+#define CLOTH_WORLD_H
+
+// Many independent cloth panels simulated together. Every panel is a square
+// grid like Cloth's, hanging from its two top corners in its own space, and
+// model places that space in the scene. The panels share one set of
+// particle and spring arrays, panel after panel, so a substep is a single
+// parallel pass over all of them with the explicit integrator.
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <chrono>
+
+#include "aligned_array.h"
+#include "cloth_kernels.h"
+#include "physics_thread.h"
+#include "thread_pool.h"
+#include "triple_buffer.h"
+
+class ClothWorld {
+    public:
+		// one finished tick of the physics thread
+		struct Snapshot {
+			std::vector<float> vertices; // interleaved position and normal of every node, in panel space
+			double time; // clockTime() when the tick was finished
+			Snapshot() : time(0.0) {}
+		};
+
+		// settings, only change these while the simulation is stopped
+		cloth_kernels::Isa simdIsa;
+		float timeStep;
+		float simulationTick;
+		glm::vec3 flowVelocity; // the wind, in scene space
+
+		// written by the physics thread, the read side belongs to whoever
+		// draws the panels
+		TripleBuffer<Snapshot> snapshots;
+
+		ClothWorld();
+		~ClothWorld();
+
+		// Adds a panel of resolution x resolution nodes and returns its index.
+		// Gravity pulls along -y of the panel's own space, so model should only
+		// turn it about y. Panels added earlier keep their state; only call
+		// this while the simulation is stopped.
+		int addCloth(int resolution, const glm::mat4& model);
+		void clear();
+
+		int clothCount() const { return static_cast<int>(cloths.size()); }
+		int nodeCount() const { return static_cast<int>(vertexPosition[0].size()); }
+		int clothResolution(int cloth) const { return cloths[cloth].resolution; }
+		int clothFirstNode(int cloth) const { return cloths[cloth].firstNode; }
+		const glm::mat4& clothModel(int cloth) const { return cloths[cloth].model; }
+
+		int threadCount() const { return pool->size(); }
+		cloth_kernels::Isa bestIsa() const { return maxSimdIsa; }
+		void setThreadCount(int threads);
+
+		// see Cloth::startSimulation
+		void startSimulation();
+		bool stopSimulation() { return physics.stop(); }
+		double clockTime() const { return physics.clockTime(); }
+
+		// advances every panel by frameTime and returns the number of substeps
+		int advance(float frameTime);
+		double computeEnergy();
+
+    private:
+		struct Panel {
+			int resolution;
+			int firstNode;
+			int firstRow; // into rowRuns
+			int firstFace; // into faceNormal, where the panel's padding starts
+			glm::mat4 model;
+			glm::mat3 sceneToPanel; // turns the wind into panel space
+			glm::vec3 pins[2]; // where the top corners are held
+		};
+
+		// bandRows rows of one panel, the unit of work of every pass
+		struct Band {
+			int cloth;
+			int rowBegin;
+			int rowEnd;
+		};
+
+		float mass;
+		float K[3];
+		float gravity;
+		float Cd;
+		float Cv;
+
+		std::vector<Panel> cloths;
+
+		// structure of arrays over the nodes of all panels
+		AlignedArray<float> vertexPosition[3];
+		AlignedArray<float> vertexNormal[3];
+		AlignedArray<float> vertexVelocity[3];
+		AlignedArray<float> vertexForce[3];
+		AlignedArray<float> faceNormal[6]; // see FaceView, one padded grid per panel
+
+		// springs of all panels, with node indices into the shared arrays
+		AlignedArray<int> springA;
+		AlignedArray<int> springB;
+		AlignedArray<float> springRest;
+		AlignedArray<int> springType;
+		std::vector<SpringRun> springRuns;
+		std::vector<int> rowRuns; // first run of every row of every panel, plus the end
+
+		// Bands of all panels, and the same split by the parity of the band
+		// within its panel: springs never reach past the next band, so all
+		// even bands can take their spring forces at once, then all odd ones.
+		// Tasks group consecutive bands into about equal numbers of nodes, a
+		// few per thread, so big and small panels balance out over the pool.
+		static const int bandRows = 4;
+		std::vector<Band> bands;
+		std::vector<Band> parityBands[2];
+		std::vector<int> bandTasks; // first band of every task, plus the end
+		std::vector<int> parityTasks[2];
+		ThreadPool* pool;
+
+		cloth_kernels::Isa maxSimdIsa;
+
+		PhysicsThread physics;
+
+		void initArrays(int nodes);
+		void initBands();
+		void groupTasks(const std::vector<Band>& list, std::vector<int>& tasks);
+		void parallelBands(const std::vector<Band>& list, const std::vector<int>& tasks,
+			const std::function<void(const Band&)>& fn);
+		void computeNormals();
+		void simulate(float timeStep);
+		void publishSnapshot();
+
+		ParticleView particleView(int firstNode);
+		FaceView faceView(const Panel& cloth);
+};
+
+#endif
@@ -0,0 +1,20 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+layout (location = 2) in mat4 aPanel; // per instance, takes locations 2 to 5
+
+out vec3 FragPos;
+out vec3 Normal;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+void main()
+{
+    mat4 panelModel = model * aPanel;
+    FragPos = vec3(panelModel * vec4(aPos, 1.0));
+    Normal = mat3(transpose(inverse(panelModel))) * aNormal;
+
+    gl_Position = projection * view * vec4(FragPos, 1.0);
+}
@@ -0,0 +1,144 @@
+#include "continuous_collision.h"
+
+#include "triangle_bvh.h"
+
+#include <algorithm>
+#include <cmath>
+
+static float tripleProduct(glm::vec3 a, glm::vec3 b, glm::vec3 c) {
+	return glm::dot(glm::cross(a, b), c);
+}
+
+static float evaluate(const float c[4], float t) {
+	return ((c[3] * t + c[2]) * t + c[1]) * t + c[0];
+}
+
+// Roots of c0 + c1 t + c2 t^2 + c3 t^3 in [0, 1], ascending. The interval is
+// cut at the extrema so the cubic is monotone on every piece, and each piece
+// whose ends differ in sign is bisected.
+static int cubicRoots(const float c[4], float roots[4]) {
+	float cuts[4];
+	int cutCount = 0;
+	cuts[cutCount++] = 0.0f;
+	float a = 3.0f * c[3], b = 2.0f * c[2], d = c[1];
+	float extrema[2];
+	int extremaCount = 0;
+	if (a != 0.0f) {
+		float discriminant = b * b - 4.0f * a * d;
+		if (discriminant >= 0.0f) {
+			float q = -0.5f * (b + (b < 0.0f ? -sqrt(discriminant) : sqrt(discriminant)));
+			extrema[extremaCount++] = q / a;
+			if (q != 0.0f)
+				extrema[extremaCount++] = d / q;
+		}
+	} else if (b != 0.0f) {
+		extrema[extremaCount++] = -d / b;
+	}
+	std::sort(extrema, extrema + extremaCount);
+	for (int e = 0; e < extremaCount; e++) {
+		if (extrema[e] > 0.0f && extrema[e] < 1.0f)
+			cuts[cutCount++] = extrema[e];
+	}
+	cuts[cutCount++] = 1.0f;
+
+	int found = 0;
+	for (int i = 0; i + 1 < cutCount; i++) {
+		float lo = cuts[i], hi = cuts[i + 1];
+		float fLo = evaluate(c, lo), fHi = evaluate(c, hi);
+		if (fLo == 0.0f) {
+			if (found == 0 || roots[found - 1] < lo)
+				roots[found++] = lo;
+			continue;
+		}
+		if (fHi == 0.0f || (fLo < 0.0f) == (fHi < 0.0f))
+			continue;
+		for (int iteration = 0; iteration < 32 && hi - lo > 1e-7f; iteration++) {
+			float mid = 0.5f * (lo + hi);
+			float fMid = evaluate(c, mid);
+			if ((fMid < 0.0f) == (fLo < 0.0f)) {
+				lo = mid;
+				fLo = fMid;
+			} else {
+				hi = mid;
+			}
+		}
+		roots[found++] = hi;
+	}
+	if (evaluate(c, 1.0f) == 0.0f && (found == 0 || roots[found - 1] < 1.0f))
+		roots[found++] = 1.0f;
+	return found;
+}
+
+// coefficients of the triple product of p1 - p0, p2 - p0, p3 - p0 over time
+static void coplanarity(const glm::vec3 start[4], const glm::vec3 end[4], float c[4]) {
+	glm::vec3 u0 = start[1] - start[0], v0 = start[2] - start[0], w0 = start[3] - start[0];
+	glm::vec3 u1 = end[1] - end[0] - u0, v1 = end[2] - end[0] - v0, w1 = end[3] - end[0] - w0;
+	c[0] = tripleProduct(u0, v0, w0);
+	c[1] = tripleProduct(u1, v0, w0) + tripleProduct(u0, v1, w0) + tripleProduct(u0, v0, w1);
+	c[2] = tripleProduct(u1, v1, w0) + tripleProduct(u1, v0, w1) + tripleProduct(u0, v1, w1);
+	c[3] = tripleProduct(u1, v1, w1);
+}
+
+bool vertexTriangleImpact(const glm::vec3 start[4], const glm::vec3 end[4], float tolerance, float& t) {
+	float c[4], roots[4];
+	coplanarity(start, end, c);
+	int count = cubicRoots(c, roots);
+	for (int r = 0; r < count; r++) {
+		glm::vec3 x[4];
+		for (int k = 0; k < 4; k++)
+			x[k] = start[k] + (end[k] - start[k]) * roots[r];
+		if (glm::length(x[0] - TriangleBvh::closestOnTriangle(x[0], x[1], x[2], x[3])) <= tolerance) {
+			t = roots[r];
+			return true;
+		}
+	}
+	return false;
+}
+
+bool edgeEdgeImpact(const glm::vec3 start[4], const glm::vec3 end[4], float tolerance, float& t) {
+	float c[4], roots[4];
+	coplanarity(start, end, c);
+	int count = cubicRoots(c, roots);
+	for (int r = 0; r < count; r++) {
+		glm::vec3 x[4];
+		for (int k = 0; k < 4; k++)
+			x[k] = start[k] + (end[k] - start[k]) * roots[r];
+		float s, u;
+		if (segmentDistance(x[0], x[1], x[2], x[3], s, u) <= tolerance) {
+			t = roots[r];
+			return true;
+		}
+	}
+	return false;
+}
+
+// Ericson, Real-Time Collision Detection 5.1.9
+float segmentDistance(glm::vec3 p0, glm::vec3 p1, glm::vec3 q0, glm::vec3 q1, float& s, float& u) {
+	const float epsilon = 1e-12f;
+	glm::vec3 d1 = p1 - p0, d2 = q1 - q0, r = p0 - q0;
+	float a = glm::dot(d1, d1), e = glm::dot(d2, d2), f = glm::dot(d2, r);
+	if (a <= epsilon && e <= epsilon) {
+		s = u = 0.0f;
+	} else if (a <= epsilon) {
+		s = 0.0f;
+		u = glm::clamp(f / e, 0.0f, 1.0f);
+	} else {
+		float c = glm::dot(d1, r);
+		if (e <= epsilon) {
+			u = 0.0f;
+			s = glm::clamp(-c / a, 0.0f, 1.0f);
+		} else {
+			float b = glm::dot(d1, d2), denominator = a * e - b * b;
+			s = denominator != 0.0f ? glm::clamp((b * f - c * e) / denominator, 0.0f, 1.0f) : 0.0f;
+			u = (b * s + f) / e;
+			if (u < 0.0f) {
+				u = 0.0f;
+				s = glm::clamp(-c / a, 0.0f, 1.0f);
+			} else if (u > 1.0f) {
+				u = 1.0f;
+				s = glm::clamp((b - c) / a, 0.0f, 1.0f);
+			}
+		}
+	}
+	return glm::length(p0 + d1 * s - (q0 + d2 * u));
+}
@@ -0,0 +1,21 @@
+#ifndef CONTINUOUS_COLLISION_H
+#define CONTINUOUS_COLLISION_H
+
+#include <glm/glm.hpp>
+
+// Continuous collision tests between primitives whose four points move on
+// straight lines from start (time 0) to end (time 1). The four points become
+// coplanar where a cubic in t vanishes; the roots in [0, 1] are found in
+// order and the first one at which the primitives are within tolerance of
+// each other is the time of impact.
+
+// point 0 against the triangle 1 2 3
+bool vertexTriangleImpact(const glm::vec3 start[4], const glm::vec3 end[4], float tolerance, float& t);
+
+// the edge 0 1 against the edge 2 3
+bool edgeEdgeImpact(const glm::vec3 start[4], const glm::vec3 end[4], float tolerance, float& t);
+
+// closest points s on p0 p1 and u on q0 q1, as parameters along the edges
+float segmentDistance(glm::vec3 p0, glm::vec3 p1, glm::vec3 q0, glm::vec3 q1, float& s, float& u);
+
+#endif
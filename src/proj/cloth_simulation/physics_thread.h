@@ -0,0 +1,101 @@
+#ifndef PHYSICS_THREAD_H
+#define PHYSICS_THREAD_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "aligned_array.h"
+#include "triple_buffer.h"
+
+// The thread a simulation runs on: tick is called once every period seconds
+// of wall clock time until stop. The owner's settings and state only belong
+// to the physics thread while it runs, so stop it before changing them.
+class PhysicsThread {
+public:
+	PhysicsThread() : running(false), clockStart(std::chrono::steady_clock::now()) {}
+	~PhysicsThread() { stop(); }
+
+	bool isRunning() const { return running; }
+
+	void start(double period, const std::function<void()>& tick) {
+		if (running)
+			return;
+		running = true;
+		thread = std::thread(&PhysicsThread::loop, this, period, tick);
+	}
+
+	// returns whether it was running; once this returns the simulation
+	// state may be changed from the calling thread
+	bool stop() {
+		if (!running)
+			return false;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+		}
+		wake.notify_all();
+		thread.join();
+		return true;
+	}
+
+	// seconds since the thread was made, the time snapshots are stamped with
+	double clockTime() const {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - clockStart).count();
+	}
+
+	// fill writes the current state to the back snapshot, which is then
+	// stamped with clockTime() and handed to the reader
+	template <typename Snapshot>
+	void publish(TripleBuffer<Snapshot>& snapshots, const std::function<void(Snapshot&)>& fill) {
+		Snapshot& snapshot = snapshots.back();
+		fill(snapshot);
+		snapshot.time = clockTime();
+		snapshots.publish();
+	}
+
+private:
+	PhysicsThread(const PhysicsThread&);
+	PhysicsThread& operator=(const PhysicsThread&);
+
+	void loop(double period, std::function<void()> tick) {
+		std::chrono::steady_clock::duration step =
+			std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(period));
+		std::chrono::steady_clock::time_point nextTick = std::chrono::steady_clock::now();
+		std::unique_lock<std::mutex> lock(mutex);
+		while (running) {
+			lock.unlock();
+			tick();
+			lock.lock();
+			// a tick that took longer than its slot delays the schedule instead
+			// of making the following ticks race to catch up
+			nextTick = std::max(nextTick + step, std::chrono::steady_clock::now());
+			wake.wait_until(lock, nextTick, [this] { return !running; });
+		}
+	}
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool running;
+	std::chrono::steady_clock::time_point clockStart;
+};
+
+// the snapshot layout of every simulation: position and normal of the nodes
+// [begin, end) interleaved, 6 floats per node
+inline void interleaveVertices(const AlignedArray<float>* position, const AlignedArray<float>* normal,
+	int begin, int end, float* vertices) {
+	for (int id = begin; id < end; id++) {
+		vertices[id * 6] = position[0][id];
+		vertices[id * 6 + 1] = position[1][id];
+		vertices[id * 6 + 2] = position[2][id];
+		vertices[id * 6 + 3] = normal[0][id];
+		vertices[id * 6 + 4] = normal[1][id];
+		vertices[id * 6 + 5] = normal[2][id];
+	}
+}
+
+#endif
@@ -0,0 +1,315 @@
+#include "signed_distance_field.h"
+
+#include "triangle_bvh.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+
+static const int fileVersion = 1;
+static const int brickSamples = SignedDistanceField::brickSize * SignedDistanceField::brickSize * SignedDistanceField::brickSize;
+
+// the bytes from the current position to the end, leaving the position as is
+static long long bytesLeft(FILE* file) {
+#ifdef _WIN32
+	long long position = _ftelli64(file), size = -1;
+	if (position >= 0 && _fseeki64(file, 0, SEEK_END) == 0)
+		size = _ftelli64(file);
+	if (position < 0 || _fseeki64(file, position, SEEK_SET) != 0)
+		return -1;
+#else
+	long long position = static_cast<long long>(ftello(file)), size = -1;
+	if (position >= 0 && fseeko(file, 0, SEEK_END) == 0)
+		size = static_cast<long long>(ftello(file));
+	if (position < 0 || fseeko(file, static_cast<off_t>(position), SEEK_SET) != 0)
+		return -1;
+#endif
+	return size < 0 ? -1 : size - position;
+}
+
+static void forEach(ThreadPool* pool, int count, const std::function<void(int)>& fn) {
+	if (!pool) {
+		for (int i = 0; i < count; i++)
+			fn(i);
+		return;
+	}
+	int threads = pool->size();
+	pool->run(threads, [&](int t) {
+		for (int i = count * t / threads; i < count * (t + 1) / threads; i++)
+			fn(i);
+	});
+}
+
+void SignedDistanceField::clear() {
+	origin = glm::vec3(0.0f);
+	cellSize = 1.0f;
+	band = 0.0f;
+	bricks[0] = bricks[1] = bricks[2] = 0;
+	brickIndex.clear();
+	samples.clear();
+}
+
+// Angle weighted pseudonormals (Baerentzen and Aanaes 2005). The sign of
+// p against the face normal of the closest triangle is wrong where the
+// closest point is an edge or a corner shared with a triangle facing another
+// way; against the pseudonormal of that edge or corner it is right. Vertices
+// at the same position are merged first, so seams split for texturing still
+// share their edges and corners.
+struct PseudoNormals {
+	std::vector<glm::vec3> face; // per triangle
+	std::vector<glm::vec3> edge; // per triangle, the edges ab, bc, ca
+	std::vector<glm::vec3> corner; // per merged vertex
+	std::vector<int> merged; // the merged vertex of every vertex
+
+	void build(const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& indices) {
+		std::vector<int> order(vertices.size());
+		for (size_t v = 0; v < order.size(); v++)
+			order[v] = static_cast<int>(v);
+		std::sort(order.begin(), order.end(), [&](int a, int b) {
+			const glm::vec3& x = vertices[a];
+			const glm::vec3& y = vertices[b];
+			return x.x < y.x || (x.x == y.x && (x.y < y.y || (x.y == y.y && x.z < y.z)));
+		});
+		merged.resize(vertices.size());
+		int count = 0;
+		for (size_t k = 0; k < order.size(); k++) {
+			if (k > 0 && vertices[order[k]] != vertices[order[k - 1]])
+				count++;
+			merged[order[k]] = count;
+		}
+		corner.assign(count + 1, glm::vec3(0.0f));
+
+		int triangles = static_cast<int>(indices.size() / 3);
+		face.assign(triangles, glm::vec3(0.0f));
+		edge.assign(3 * triangles, glm::vec3(0.0f));
+		std::map<std::pair<int, int>, glm::vec3> edges;
+		for (int t = 0; t < triangles; t++) {
+			glm::vec3 x[3];
+			for (int c = 0; c < 3; c++)
+				x[c] = vertices[indices[3 * t + c]];
+			// the same degenerate triangles as TriangleBvh::build leaves out
+			glm::vec3 n = glm::cross(x[1] - x[0], x[2] - x[0]);
+			if (glm::length(n) <= 1e-6f * glm::length(x[1] - x[0]) * glm::length(x[2] - x[0]))
+				continue;
+			face[t] = glm::normalize(n);
+			for (int c = 0; c < 3; c++) {
+				glm::vec3 u = glm::normalize(x[(c + 1) % 3] - x[c]), w = glm::normalize(x[(c + 2) % 3] - x[c]);
+				corner[merged[indices[3 * t + c]]] += static_cast<float>(acos(std::min(std::max(glm::dot(u, w), -1.0f), 1.0f))) * face[t];
+				edges[key(indices[3 * t + c], indices[3 * t + (c + 1) % 3])] += face[t];
+			}
+		}
+		for (int t = 0; t < triangles; t++) {
+			for (int e = 0; e < 3; e++)
+				edge[3 * t + e] = edges[key(indices[3 * t + e], indices[3 * t + (e + 1) % 3])];
+		}
+	}
+
+	std::pair<int, int> key(unsigned int a, unsigned int b) const {
+		return std::make_pair(std::min(merged[a], merged[b]), std::max(merged[a], merged[b]));
+	}
+
+	// the pseudonormal of a feature as TriangleBvh::closestFeature reports it
+	glm::vec3 normal(const std::vector<unsigned int>& indices, int triangle, int feature) const {
+		if (feature < 3)
+			return corner[merged[indices[3 * triangle + feature]]];
+		if (feature < 6)
+			return edge[3 * triangle + feature - 3];
+		return face[triangle];
+	}
+};
+
+void SignedDistanceField::bake(const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& indices,
+	float theCellSize, float theBand, ThreadPool* pool) {
+	clear();
+	if (indices.size() < 3 || theCellSize <= 0.0f)
+		return;
+	TriangleBvh bvh;
+	bvh.build(vertices, indices);
+	PseudoNormals pseudo;
+	pseudo.build(vertices, indices);
+
+	glm::vec3 lower(FLT_MAX), upper(-FLT_MAX);
+	for (size_t k = 0; k < indices.size(); k++) {
+		lower = glm::min(lower, vertices[indices[k]]);
+		upper = glm::max(upper, vertices[indices[k]]);
+	}
+	cellSize = theCellSize;
+	band = std::max(theBand, 2.0f * theCellSize);
+	origin = lower - glm::vec3(band + cellSize);
+	glm::vec3 extent = upper + glm::vec3(band + cellSize) - origin;
+	float brickSpan = brickCells * cellSize;
+	for (int a = 0; a < 3; a++)
+		bricks[a] = std::max(1, static_cast<int>(ceil(extent[a] / brickSpan)));
+	int total = bricks[0] * bricks[1] * bricks[2];
+
+	// a brick is kept when the band reaches into it
+	std::vector<char> used(total);
+	float reach = 0.5f * sqrt(3.0f) * brickSpan + band;
+	forEach(pool, total, [&](int b) {
+		glm::vec3 corner(b % bricks[0], b / bricks[0] % bricks[1], b / (bricks[0] * bricks[1]));
+		glm::vec3 point, normal;
+		used[b] = bvh.closestPoint(origin + (corner + 0.5f) * brickSpan, reach, point, normal);
+	});
+	brickIndex.assign(total, -1);
+	int stored = 0;
+	for (int b = 0; b < total; b++) {
+		if (used[b])
+			brickIndex[b] = stored++;
+	}
+	samples.resize(stored * brickSamples);
+
+	// Only the samples within the band need a distance. The ones beyond it
+	// just take the sign of a neighbour: between neighbours the distance
+	// changes by at most cellSize, less than the band, so it cannot cross
+	// the surface. A brick without any sample in the band looks its sign up.
+	float search = sqrt(3.0f) * brickSpan + band;
+	float quantize = 32767.0f / band;
+	forEach(pool, total, [&](int b) {
+		if (brickIndex[b] < 0)
+			return;
+		glm::vec3 corner = origin + glm::vec3(b % bricks[0], b / bricks[0] % bricks[1], b / (bricks[0] * bricks[1])) * brickSpan;
+		float distance[brickSamples];
+		bool known[brickSamples];
+		int unknown = 0;
+		for (int k = 0; k < brickSamples; k++) {
+			glm::vec3 p = corner + glm::vec3(k % brickSize, k / brickSize % brickSize, k / (brickSize * brickSize)) * cellSize;
+			glm::vec3 point;
+			int triangle, feature;
+			known[k] = bvh.closestFeature(p, band, point, triangle, feature);
+			if (known[k])
+				distance[k] = glm::dot(p - point, pseudo.normal(indices, triangle, feature)) < 0.0f ? -glm::length(p - point) : glm::length(p - point);
+			else
+				unknown++;
+		}
+		if (unknown == brickSamples) {
+			glm::vec3 point;
+			int triangle, feature;
+			distance[0] = band;
+			if (bvh.closestFeature(corner, search, point, triangle, feature)
+				&& glm::dot(corner - point, pseudo.normal(indices, triangle, feature)) < 0.0f)
+				distance[0] = -band;
+			known[0] = true;
+			unknown--;
+		}
+		while (unknown > 0) {
+			for (int k = 0; k < brickSamples; k++) {
+				if (known[k])
+					continue;
+				int x = k % brickSize, y = k / brickSize % brickSize, z = k / (brickSize * brickSize);
+				int neighbours[6] = { x > 0 ? k - 1 : -1, x < brickCells ? k + 1 : -1,
+					y > 0 ? k - brickSize : -1, y < brickCells ? k + brickSize : -1,
+					z > 0 ? k - brickSize * brickSize : -1, z < brickCells ? k + brickSize * brickSize : -1 };
+				for (int n = 0; n < 6; n++) {
+					if (neighbours[n] >= 0 && known[neighbours[n]]) {
+						distance[k] = distance[neighbours[n]] < 0.0f ? -band : band;
+						known[k] = true;
+						unknown--;
+						break;
+					}
+				}
+			}
+		}
+		short* out = &samples[brickIndex[b] * brickSamples];
+		for (int k = 0; k < brickSamples; k++)
+			out[k] = static_cast<short>(floor(std::min(std::max(distance[k], -band), band) * quantize + 0.5f));
+	});
+}
+
+bool SignedDistanceField::save(const std::string& path) const {
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file)
+		return false;
+	int brickTotal = brickCount();
+	bool ok = fwrite("CSDF", 1, 4, file) == 4
+		&& fwrite(&fileVersion, sizeof(int), 1, file) == 1
+		&& fwrite(&origin[0], sizeof(float), 3, file) == 3
+		&& fwrite(&cellSize, sizeof(float), 1, file) == 1
+		&& fwrite(&band, sizeof(float), 1, file) == 1
+		&& fwrite(bricks, sizeof(int), 3, file) == 3
+		&& fwrite(&brickTotal, sizeof(int), 1, file) == 1
+		&& fwrite(brickIndex.data(), sizeof(int), brickIndex.size(), file) == brickIndex.size()
+		&& fwrite(samples.data(), sizeof(short), samples.size(), file) == samples.size();
+	return fclose(file) == 0 && ok;
+}
+
+bool SignedDistanceField::load(const std::string& path) {
+	clear();
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file)
+		return false;
+	char magic[4];
+	int version = 0, brickTotal = 0;
+	bool ok = fread(magic, 1, 4, file) == 4 && !memcmp(magic, "CSDF", 4)
+		&& fread(&version, sizeof(int), 1, file) == 1 && version == fileVersion
+		&& fread(&origin[0], sizeof(float), 3, file) == 3
+		&& fread(&cellSize, sizeof(float), 1, file) == 1
+		&& fread(&band, sizeof(float), 1, file) == 1
+		&& fread(bricks, sizeof(int), 3, file) == 3
+		&& fread(&brickTotal, sizeof(int), 1, file) == 1
+		&& bricks[0] > 0 && bricks[1] > 0 && bricks[2] > 0 && brickTotal >= 0 && cellSize > 0.0f && band > 0.0f;
+	// the index and the samples have to fill the rest of the file exactly,
+	// which also bounds the brick counts before they are multiplied out
+	long long left = ok ? bytesLeft(file) : -1, cells = 1;
+	ok = left >= 0;
+	for (int k = 0; ok && k < 3; k++) {
+		ok = bricks[k] <= left / static_cast<long long>(sizeof(int)) / cells;
+		cells *= bricks[k];
+	}
+	ok = ok && cells * static_cast<long long>(sizeof(int)) + brickTotal * static_cast<long long>(brickSamples * sizeof(short)) == left;
+	if (ok) {
+		brickIndex.resize(static_cast<size_t>(bricks[0]) * bricks[1] * bricks[2]);
+		samples.resize(static_cast<size_t>(brickTotal) * brickSamples);
+		ok = fread(brickIndex.data(), sizeof(int), brickIndex.size(), file) == brickIndex.size()
+			&& fread(samples.data(), sizeof(short), samples.size(), file) == samples.size();
+		for (size_t b = 0; ok && b < brickIndex.size(); b++)
+			ok = brickIndex[b] >= -1 && brickIndex[b] < brickTotal;
+	}
+	fclose(file);
+	if (!ok)
+		clear();
+	return ok;
+}
+
+void SignedDistanceField::place(float scale, glm::vec3 offset) {
+	origin = origin * scale + offset;
+	cellSize *= scale;
+	band *= scale;
+}
+
+bool SignedDistanceField::sample(glm::vec3 p, float& distance, glm::vec3& gradient) const {
+	if (samples.empty())
+		return false;
+	glm::vec3 q = (p - origin) / cellSize;
+	int cell[3], local[3], brick[3];
+	float f[3];
+	for (int a = 0; a < 3; a++) {
+		float c = floor(q[a]);
+		if (!(c >= 0.0f && c < static_cast<float>(bricks[a] * brickCells)))
+			return false;
+		cell[a] = static_cast<int>(c);
+		f[a] = q[a] - c;
+		brick[a] = cell[a] / brickCells;
+		local[a] = cell[a] - brick[a] * brickCells;
+	}
+	int index = brickIndex[(brick[2] * bricks[1] + brick[1]) * bricks[0] + brick[0]];
+	if (index < 0)
+		return false;
+
+	const short* s = &samples[index * brickSamples + (local[2] * brickSize + local[1]) * brickSize + local[0]];
+	const int dy = brickSize, dz = brickSize * brickSize;
+	float s000 = s[0], s100 = s[1], s010 = s[dy], s110 = s[dy + 1];
+	float s001 = s[dz], s101 = s[dz + 1], s011 = s[dz + dy], s111 = s[dz + dy + 1];
+	float x00 = s000 + (s100 - s000) * f[0], x10 = s010 + (s110 - s010) * f[0];
+	float x01 = s001 + (s101 - s001) * f[0], x11 = s011 + (s111 - s011) * f[0];
+	float y0 = x00 + (x10 - x00) * f[1], y1 = x01 + (x11 - x01) * f[1];
+	float gx0 = (s100 - s000) + ((s110 - s010) - (s100 - s000)) * f[1];
+	float gx1 = (s101 - s001) + ((s111 - s011) - (s101 - s001)) * f[1];
+
+	float scale = band / 32767.0f;
+	distance = (y0 + (y1 - y0) * f[2]) * scale;
+	gradient = glm::vec3(gx0 + (gx1 - gx0) * f[2], (x10 - x00) + ((x11 - x01) - (x10 - x00)) * f[2], y1 - y0) * (scale / cellSize);
+	return true;
+}
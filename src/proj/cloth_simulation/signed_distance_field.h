@@ -0,0 +1,55 @@
+#ifndef SIGNED_DISTANCE_FIELD_H
+#define SIGNED_DISTANCE_FIELD_H
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+
+#include "thread_pool.h"
+
+// Sparse narrow-band signed distance to a triangle mesh. The volume is cut
+// into bricks of brickSize^3 samples; neighbouring bricks share their border
+// layer, so every cell lies inside one brick and a lookup touches a single
+// brick. Only bricks within band of the surface are stored, as 16-bit
+// distances relative to band; positive is the side the triangles face.
+//
+// File layout (little endian): "CSDF", version, origin[3], cellSize, band,
+// bricks[3], brickCount, brickIndex[bricks[0] * bricks[1] * bricks[2]]
+// (-1 for empty bricks) and brickCount * brickSize^3 samples, x fastest.
+class SignedDistanceField {
+public:
+	static const int brickSize = 8;
+	static const int brickCells = brickSize - 1;
+
+	SignedDistanceField() : origin(0.0f), cellSize(1.0f), band(0.0f) { bricks[0] = bricks[1] = bricks[2] = 0; }
+
+	// samples the distance every cellSize around the triangles, three vertex
+	// indices per triangle; the band is at least two cells wide and pool
+	// spreads the bricks over its threads
+	void bake(const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& indices,
+		float cellSize, float band, ThreadPool* pool = NULL);
+	bool save(const std::string& path) const;
+	bool load(const std::string& path);
+	void clear();
+
+	bool empty() const { return samples.empty(); }
+	int brickCount() const { return static_cast<int>(samples.size()) / (brickSize * brickSize * brickSize); }
+	size_t byteSize() const { return brickIndex.size() * sizeof(int) + samples.size() * sizeof(short); }
+
+	// moves the field along with its mesh from x to x * scale + offset
+	void place(float scale, glm::vec3 offset);
+
+	// trilinear distance and its gradient at p, false where nothing was baked
+	bool sample(glm::vec3 p, float& distance, glm::vec3& gradient) const;
+
+private:
+	glm::vec3 origin; // corner of the first cell
+	float cellSize;
+	float band; // distances are clamped to +-band
+	int bricks[3];
+	std::vector<int> brickIndex;
+	std::vector<short> samples;
+};
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent workers for fork/join style loops. run() hands out the task
+// indices [0, count) to the workers and the calling thread and only returns
+// once every task has finished, so each call doubles as a barrier.
+class ThreadPool {
+public:
+	// threads counts the calling thread, so ThreadPool(1) runs everything inline
+	explicit ThreadPool(int threads) : job(NULL), jobCount(0), next(0), active(0), generation(0), stopping(false) {
+		for (int t = 1; t < threads; t++)
+			workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (size_t t = 0; t < workers.size(); t++)
+			workers[t].join();
+	}
+
+	int size() const { return static_cast<int>(workers.size()) + 1; }
+
+	void run(int count, const std::function<void(int)>& task) {
+		if (workers.empty() || count <= 1) {
+			for (int i = 0; i < count; i++)
+				task(i);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &task;
+			jobCount = count;
+			next = 0;
+			active = static_cast<int>(workers.size());
+			generation++;
+		}
+		wake.notify_all();
+		work();
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this] { return active == 0; });
+		job = NULL;
+	}
+
+private:
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator=(const ThreadPool&);
+
+	void work() {
+		for (;;) {
+			int i = next.fetch_add(1);
+			if (i >= jobCount)
+				return;
+			(*job)(i);
+		}
+	}
+
+	void workerLoop() {
+		unsigned seen = 0;
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this, seen] { return stopping || generation != seen; });
+				if (stopping)
+					return;
+				seen = generation;
+			}
+			work();
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--active == 0)
+				done.notify_one();
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+
+	const std::function<void(int)>* job;
+	int jobCount;
+	std::atomic<int> next;
+	int active;
+	unsigned generation;
+	bool stopping;
+};
+
+#endif
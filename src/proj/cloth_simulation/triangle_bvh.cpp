@@ -0,0 +1,318 @@
+#include "triangle_bvh.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+static float surfaceArea(glm::vec3 lower, glm::vec3 upper) {
+	glm::vec3 e = glm::max(upper - lower, glm::vec3(0.0f));
+	return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+static bool overlaps(const TriangleBvh::Node& node, glm::vec3 lower, glm::vec3 upper) {
+	return node.lower.x <= upper.x && node.lower.y <= upper.y && node.lower.z <= upper.z
+		&& lower.x <= node.upper.x && lower.y <= node.upper.y && lower.z <= node.upper.z;
+}
+
+void TriangleBvh::clear() {
+	nodes.clear();
+	triangleA.clear();
+	triangleB.clear();
+	triangleC.clear();
+	triangleIndex.clear();
+}
+
+void TriangleBvh::build(const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& indices) {
+	clear();
+	int count = static_cast<int>(indices.size() / 3);
+	if (count == 0)
+		return;
+	// Degenerate triangles have no interior and their normal is rounding
+	// noise, which would give the closest point queries a random side.
+	// Leave them out.
+	std::vector<BuildTriangle> triangles;
+	triangles.reserve(count);
+	for (int t = 0; t < count; t++) {
+		glm::vec3 a = vertices[indices[3 * t]], b = vertices[indices[3 * t + 1]], c = vertices[indices[3 * t + 2]];
+		if (glm::length(glm::cross(b - a, c - a)) <= 1e-6f * glm::length(b - a) * glm::length(c - a))
+			continue;
+		BuildTriangle triangle;
+		triangle.lower = glm::min(glm::min(a, b), c);
+		triangle.upper = glm::max(glm::max(a, b), c);
+		triangle.centroid = (triangle.lower + triangle.upper) * 0.5f;
+		triangle.index = t;
+		triangles.push_back(triangle);
+	}
+	count = static_cast<int>(triangles.size());
+	if (count == 0)
+		return;
+	nodes.reserve(2 * count);
+	triangleA.reserve(count);
+	triangleB.reserve(count);
+	triangleC.reserve(count);
+	triangleIndex.reserve(count);
+	buildNode(triangles, 0, count, vertices, indices);
+}
+
+// Binned SAH: the centroids are dropped into bins along the longest axis and
+// the node is split at the bin boundary with the lowest estimated cost, or
+// kept as a leaf when testing all its triangles is cheaper.
+int TriangleBvh::buildNode(std::vector<BuildTriangle>& triangles, int begin, int end,
+	const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& indices) {
+	const int bins = 16, maxLeaf = 8;
+	int index = static_cast<int>(nodes.size());
+	nodes.push_back(Node());
+
+	glm::vec3 lower(FLT_MAX), upper(-FLT_MAX), centroidLower(FLT_MAX), centroidUpper(-FLT_MAX);
+	for (int k = begin; k < end; k++) {
+		lower = glm::min(lower, triangles[k].lower);
+		upper = glm::max(upper, triangles[k].upper);
+		centroidLower = glm::min(centroidLower, triangles[k].centroid);
+		centroidUpper = glm::max(centroidUpper, triangles[k].centroid);
+	}
+	nodes[index].lower = lower;
+	nodes[index].upper = upper;
+
+	int count = end - begin;
+	glm::vec3 extent = centroidUpper - centroidLower;
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	int mid = begin;
+	if (count > 1 && extent[axis] > 0.0f) {
+		glm::vec3 binLower[bins], binUpper[bins];
+		int binCount[bins];
+		for (int b = 0; b < bins; b++) {
+			binLower[b] = glm::vec3(FLT_MAX);
+			binUpper[b] = glm::vec3(-FLT_MAX);
+			binCount[b] = 0;
+		}
+		float scale = bins / extent[axis];
+		for (int k = begin; k < end; k++) {
+			int b = std::min(bins - 1, static_cast<int>((triangles[k].centroid[axis] - centroidLower[axis]) * scale));
+			binLower[b] = glm::min(binLower[b], triangles[k].lower);
+			binUpper[b] = glm::max(binUpper[b], triangles[k].upper);
+			binCount[b]++;
+		}
+
+		// right sides swept from the end, then the left sides from the front
+		float rightArea[bins];
+		int rightCount[bins];
+		glm::vec3 l(FLT_MAX), u(-FLT_MAX);
+		int n = 0;
+		for (int b = bins - 1; b > 0; b--) {
+			l = glm::min(l, binLower[b]);
+			u = glm::max(u, binUpper[b]);
+			n += binCount[b];
+			rightArea[b] = surfaceArea(l, u);
+			rightCount[b] = n;
+		}
+		float bestCost = FLT_MAX;
+		int bestBin = -1;
+		l = glm::vec3(FLT_MAX);
+		u = glm::vec3(-FLT_MAX);
+		n = 0;
+		for (int b = 0; b < bins - 1; b++) {
+			l = glm::min(l, binLower[b]);
+			u = glm::max(u, binUpper[b]);
+			n += binCount[b];
+			if (n == 0 || rightCount[b + 1] == 0)
+				continue;
+			float cost = n * surfaceArea(l, u) + rightCount[b + 1] * rightArea[b + 1];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestBin = b;
+			}
+		}
+
+		// one box test per child against testing every triangle here
+		float leafCost = static_cast<float>(count);
+		float splitCost = 1.0f + bestCost / std::max(surfaceArea(lower, upper), FLT_MIN);
+		if (bestBin >= 0 && (splitCost < leafCost || count > maxLeaf)) {
+			mid = static_cast<int>(std::partition(triangles.begin() + begin, triangles.begin() + end,
+				[&](const BuildTriangle& t) {
+					return std::min(bins - 1, static_cast<int>((t.centroid[axis] - centroidLower[axis]) * scale)) <= bestBin;
+				}) - triangles.begin());
+		}
+	}
+	if (mid == begin && count > maxLeaf) {
+		// all centroids in one spot, split in the middle
+		mid = begin + count / 2;
+		std::nth_element(triangles.begin() + begin, triangles.begin() + mid, triangles.begin() + end,
+			[&](const BuildTriangle& a, const BuildTriangle& b) { return a.centroid[axis] < b.centroid[axis]; });
+	}
+
+	if (mid == begin || mid == end) {
+		nodes[index].first = static_cast<int>(triangleA.size());
+		nodes[index].count = count;
+		for (int k = begin; k < end; k++) {
+			int t = triangles[k].index;
+			triangleA.push_back(vertices[indices[3 * t]]);
+			triangleB.push_back(vertices[indices[3 * t + 1]]);
+			triangleC.push_back(vertices[indices[3 * t + 2]]);
+			triangleIndex.push_back(t);
+		}
+	} else {
+		nodes[index].first = 0;
+		nodes[index].count = 0;
+		buildNode(triangles, begin, mid, vertices, indices);
+		buildNode(triangles, mid, end, vertices, indices);
+	}
+	nodes[index].skip = static_cast<int>(nodes.size());
+	return index;
+}
+
+bool TriangleBvh::intersectSegment(glm::vec3 from, glm::vec3 to, float& t, glm::vec3& normal) const {
+	glm::vec3 d = to - from;
+	glm::vec3 lower = glm::min(from, to), upper = glm::max(from, to);
+	float best = 1.0f;
+	bool hit = false;
+	int i = 0, last = static_cast<int>(nodes.size());
+	while (i < last) {
+		const Node& node = nodes[i];
+		if (!overlaps(node, lower, upper)) {
+			i = node.skip;
+			continue;
+		}
+		for (int k = node.first; k < node.first + node.count; k++) {
+			// Moller-Trumbore
+			glm::vec3 e1 = triangleB[k] - triangleA[k], e2 = triangleC[k] - triangleA[k];
+			glm::vec3 p = glm::cross(d, e2);
+			float det = glm::dot(e1, p);
+			if (fabs(det) < 1e-12f)
+				continue;
+			float inverse = 1.0f / det;
+			glm::vec3 s = from - triangleA[k];
+			float u = glm::dot(s, p) * inverse;
+			if (u < 0.0f || u > 1.0f)
+				continue;
+			glm::vec3 q = glm::cross(s, e1);
+			float v = glm::dot(d, q) * inverse;
+			if (v < 0.0f || u + v > 1.0f)
+				continue;
+			float tk = glm::dot(e2, q) * inverse;
+			if (tk < 0.0f || tk > best)
+				continue;
+			best = tk;
+			normal = glm::normalize(glm::cross(e1, e2));
+			hit = true;
+		}
+		i++;
+	}
+	t = best;
+	return hit;
+}
+
+bool TriangleBvh::closestPoint(glm::vec3 p, float radius, glm::vec3& point, glm::vec3& normal) const {
+	float best = radius * radius;
+	bool found = false;
+	int i = 0, last = static_cast<int>(nodes.size());
+	while (i < last) {
+		const Node& node = nodes[i];
+		// the search box shrinks with the closest point found so far
+		float reach = sqrt(best);
+		if (!overlaps(node, p - glm::vec3(reach), p + glm::vec3(reach))) {
+			i = node.skip;
+			continue;
+		}
+		for (int k = node.first; k < node.first + node.count; k++) {
+			glm::vec3 c = closestOnTriangle(p, triangleA[k], triangleB[k], triangleC[k]);
+			glm::vec3 e = p - c;
+			float d2 = glm::dot(e, e);
+			if (d2 >= best)
+				continue;
+			best = d2;
+			point = c;
+			normal = glm::cross(triangleB[k] - triangleA[k], triangleC[k] - triangleA[k]);
+			found = true;
+		}
+		i++;
+	}
+	if (found && glm::length(normal) > 0.0f)
+		normal = glm::normalize(normal);
+	return found;
+}
+
+bool TriangleBvh::closestFeature(glm::vec3 p, float radius, glm::vec3& point, int& triangle, int& feature) const {
+	float best = radius * radius;
+	bool found = false;
+	int i = 0, last = static_cast<int>(nodes.size());
+	while (i < last) {
+		const Node& node = nodes[i];
+		float reach = sqrt(best);
+		if (!overlaps(node, p - glm::vec3(reach), p + glm::vec3(reach))) {
+			i = node.skip;
+			continue;
+		}
+		for (int k = node.first; k < node.first + node.count; k++) {
+			int f;
+			glm::vec3 c = closestOnTriangle(p, triangleA[k], triangleB[k], triangleC[k], f);
+			glm::vec3 e = p - c;
+			float d2 = glm::dot(e, e);
+			if (d2 >= best)
+				continue;
+			best = d2;
+			point = c;
+			triangle = triangleIndex[k];
+			feature = f;
+			found = true;
+		}
+		i++;
+	}
+	return found;
+}
+
+void TriangleBvh::overlapping(glm::vec3 lower, glm::vec3 upper, std::vector<int>& found) const {
+	int i = 0, last = static_cast<int>(nodes.size());
+	while (i < last) {
+		const Node& node = nodes[i];
+		if (!overlaps(node, lower, upper)) {
+			i = node.skip;
+			continue;
+		}
+		for (int k = node.first; k < node.first + node.count; k++) {
+			glm::vec3 l = glm::min(glm::min(triangleA[k], triangleB[k]), triangleC[k]);
+			glm::vec3 u = glm::max(glm::max(triangleA[k], triangleB[k]), triangleC[k]);
+			if (l.x <= upper.x && l.y <= upper.y && l.z <= upper.z && lower.x <= u.x && lower.y <= u.y && lower.z <= u.z)
+				found.push_back(k);
+		}
+		i++;
+	}
+}
+
+glm::vec3 TriangleBvh::closestOnTriangle(glm::vec3 p, glm::vec3 a, glm::vec3 b, glm::vec3 c) {
+	int feature;
+	return closestOnTriangle(p, a, b, c, feature);
+}
+
+// Ericson, Real-Time Collision Detection 5.1.5
+glm::vec3 TriangleBvh::closestOnTriangle(glm::vec3 p, glm::vec3 a, glm::vec3 b, glm::vec3 c, int& feature) {
+	glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+	float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+	feature = 0;
+	if (d1 <= 0.0f && d2 <= 0.0f)
+		return a;
+	glm::vec3 bp = p - b;
+	float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+	feature = 1;
+	if (d3 >= 0.0f && d4 <= d3)
+		return b;
+	float vc = d1 * d4 - d3 * d2;
+	feature = 3;
+	if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+		return a + ab * (d1 / (d1 - d3));
+	glm::vec3 cp = p - c;
+	float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+	feature = 2;
+	if (d6 >= 0.0f && d5 <= d6)
+		return c;
+	float vb = d5 * d2 - d1 * d6;
+	feature = 5;
+	if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+		return a + ac * (d2 / (d2 - d6));
+	float va = d3 * d6 - d5 * d4;
+	feature = 4;
+	if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f)
+		return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+	feature = 6;
+	float denominator = 1.0f / (va + vb + vc);
+	return a + ab * (vb * denominator) + ac * (vc * denominator);
+}
@@ -0,0 +1,66 @@
+#ifndef TRIANGLE_BVH_H
+#define TRIANGLE_BVH_H
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+// Bounding volume hierarchy over a static triangle soup, built once with the
+// surface area heuristic. Nodes are stored depth first and each one knows
+// where its subtree ends, so queries walk the tree without a stack: enter a
+// node whose box is hit (the next node is its first child), otherwise jump
+// to its skip index.
+class TriangleBvh {
+public:
+	struct Node {
+		glm::vec3 lower;
+		int skip; // first node after this subtree
+		glm::vec3 upper;
+		int first; // leaves: first triangle
+		int count; // leaves: number of triangles, 0 for inner nodes
+	};
+
+	TriangleBvh() {}
+
+	// indices holds three vertex indices per triangle
+	void build(const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& indices);
+	void clear();
+	bool empty() const { return nodes.empty(); }
+	int triangleCount() const { return static_cast<int>(triangleA.size()); }
+	int nodeCount() const { return static_cast<int>(nodes.size()); }
+
+	// first crossing of the segment from -> to: t along the segment and the
+	// unit normal of the triangle crossed
+	bool intersectSegment(glm::vec3 from, glm::vec3 to, float& t, glm::vec3& normal) const;
+
+	// closest point on the surface within radius of p
+	bool closestPoint(glm::vec3 p, float radius, glm::vec3& point, glm::vec3& normal) const;
+	// the same, with the triangle it lies on (its position in the indices
+	// given to build) and the feature of that triangle, see closestOnTriangle
+	bool closestFeature(glm::vec3 p, float radius, glm::vec3& point, int& triangle, int& feature) const;
+
+	// the triangles whose boxes overlap lower, upper, appended to found
+	void overlapping(glm::vec3 lower, glm::vec3 upper, std::vector<int>& found) const;
+	void corners(int k, glm::vec3& a, glm::vec3& b, glm::vec3& c) const { a = triangleA[k]; b = triangleB[k]; c = triangleC[k]; }
+
+	// closest point to p on the triangle abc; feature is 0, 1, 2 for the
+	// corners a, b, c, 3, 4, 5 for the edges ab, bc, ca and 6 inside
+	static glm::vec3 closestOnTriangle(glm::vec3 p, glm::vec3 a, glm::vec3 b, glm::vec3 c);
+	static glm::vec3 closestOnTriangle(glm::vec3 p, glm::vec3 a, glm::vec3 b, glm::vec3 c, int& feature);
+
+private:
+	struct BuildTriangle {
+		glm::vec3 lower, upper, centroid;
+		int index;
+	};
+
+	int buildNode(std::vector<BuildTriangle>& triangles, int begin, int end,
+		const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& indices);
+
+	std::vector<Node> nodes;
+	// triangle corners in leaf order
+	std::vector<glm::vec3> triangleA, triangleB, triangleC;
+	std::vector<int> triangleIndex;
+};
+
+#endif
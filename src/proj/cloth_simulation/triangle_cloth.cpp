@@ -0,0 +1,437 @@
+#include "triangle_cloth.h"
+
+#include "cloth.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+TriangleCloth::TriangleCloth() {
+	mass = 1.0;
+	K[0] = K[1] = K[2] = 25000.0;
+	gravity = 9.8;
+	Cd = 0.5;
+	Cv = 0.5;
+	flowVelocity = glm::vec3(0.0f, 0.0f, 1.0f);
+	simulationTick = 0.01;
+	maxSubsteps = 50;
+	maxSimdIsa = simdIsa = cloth_kernels::detectIsa();
+	pool = NULL;
+	setThreadCount(std::thread::hardware_concurrency());
+}
+
+TriangleCloth::~TriangleCloth() {
+	stopSimulation();
+	delete pool;
+}
+
+void TriangleCloth::setThreadCount(int threads) {
+	bool running = stopSimulation();
+	delete pool;
+	pool = new ThreadPool(threads > 0 ? threads : 1);
+	if (running)
+		startSimulation();
+}
+
+// 10 bits of each coordinate, interleaved
+static unsigned mortonCode(glm::vec3 p) {
+	unsigned code = 0;
+	unsigned x = static_cast<unsigned>(p.x), y = static_cast<unsigned>(p.y), z = static_cast<unsigned>(p.z);
+	for (int bit = 9; bit >= 0; bit--)
+		code = (code << 3) | (((x >> bit) & 1) << 2) | (((y >> bit) & 1) << 1) | ((z >> bit) & 1);
+	return code;
+}
+
+struct MeshEdge {
+	int a, b; // a < b
+	int opposite; // the third corner of the triangle
+	bool operator<(const MeshEdge& other) const {
+		return a != other.a ? a < other.a : b < other.b;
+	}
+};
+
+struct MeshSpring {
+	int a, b; // a < b
+	int type; // indexes K, 0 along an edge, 2 across one
+	float rest;
+	bool operator<(const MeshSpring& other) const {
+		return a != other.a ? a < other.a : b != other.b ? b < other.b : type < other.type;
+	}
+};
+
+void TriangleCloth::setMesh(const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& indices) {
+	bool running = stopSimulation();
+	int vertexCount = static_cast<int>(vertices.size());
+
+	// weld: the vertices sorted by position, equal ones share a node
+	std::vector<int> sorted(vertexCount), weld(vertexCount);
+	for (int v = 0; v < vertexCount; v++)
+		sorted[v] = v;
+	std::sort(sorted.begin(), sorted.end(), [&](int u, int v) {
+		const glm::vec3& p = vertices[u];
+		const glm::vec3& q = vertices[v];
+		return p.x != q.x ? p.x < q.x : p.y != q.y ? p.y < q.y : p.z != q.z ? p.z < q.z : u < v;
+	});
+	std::vector<glm::vec3> points;
+	for (int s = 0; s < vertexCount; s++) {
+		if (s == 0 || vertices[sorted[s]] != vertices[sorted[s - 1]])
+			points.push_back(vertices[sorted[s]]);
+		weld[sorted[s]] = static_cast<int>(points.size()) - 1;
+	}
+	int nodes = static_cast<int>(points.size());
+
+	// then numbered along the Morton curve through their bounding box
+	glm::vec3 lower(0.0f), upper(0.0f);
+	if (nodes > 0)
+		lower = upper = points[0];
+	for (int i = 0; i < nodes; i++) {
+		lower = glm::min(lower, points[i]);
+		upper = glm::max(upper, points[i]);
+	}
+	glm::vec3 extent = upper - lower;
+	float scale = 1023.0f / std::max(std::max(extent.x, extent.y), std::max(extent.z, 1e-20f));
+	std::vector<unsigned> code(nodes);
+	std::vector<int> order(nodes), node(nodes);
+	for (int i = 0; i < nodes; i++) {
+		code[i] = mortonCode((points[i] - lower) * scale);
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&](int u, int v) { return code[u] != code[v] ? code[u] < code[v] : u < v; });
+	for (int i = 0; i < nodes; i++)
+		node[order[i]] = i;
+
+	for (int c = 0; c < 3; c++) {
+		vertexPosition[c].resize(nodes);
+		vertexVelocity[c].resize(nodes);
+		vertexNormal[c].resize(nodes);
+		vertexForce[c].resize(nodes);
+		vertexVelocity[c].fill(0.0f);
+		vertexForce[c].fill(0.0f);
+	}
+	for (int i = 0; i < nodes; i++)
+		store3(vertexPosition, node[i], points[i]);
+
+	// the triangles that survive welding, in the order of their first node
+	std::vector<unsigned int> corners;
+	for (size_t t = 0; t + 2 < indices.size(); t += 3) {
+		if (indices[t] >= vertices.size() || indices[t + 1] >= vertices.size() || indices[t + 2] >= vertices.size())
+			continue;
+		int a = node[weld[indices[t]]], b = node[weld[indices[t + 1]]], c = node[weld[indices[t + 2]]];
+		if (a == b || b == c || c == a)
+			continue;
+		corners.push_back(a);
+		corners.push_back(b);
+		corners.push_back(c);
+	}
+	int triangleCount = static_cast<int>(corners.size()) / 3;
+	std::vector<int> triangleOrder(triangleCount);
+	for (int t = 0; t < triangleCount; t++)
+		triangleOrder[t] = t;
+	std::stable_sort(triangleOrder.begin(), triangleOrder.end(), [&](int s, int t) {
+		return std::min(std::min(corners[3 * s], corners[3 * s + 1]), corners[3 * s + 2])
+			< std::min(std::min(corners[3 * t], corners[3 * t + 1]), corners[3 * t + 2]);
+	});
+	triangleNodes.resize(corners.size());
+	for (int t = 0; t < triangleCount; t++) {
+		for (int k = 0; k < 3; k++)
+			triangleNodes[3 * t + k] = corners[3 * triangleOrder[t] + k];
+	}
+
+	// an edge spring per edge, and a bending spring across every edge two
+	// triangles share; where both join the same nodes the edge spring stays
+	std::vector<MeshEdge> edges;
+	for (int t = 0; t < triangleCount; t++) {
+		for (int k = 0; k < 3; k++) {
+			MeshEdge edge;
+			edge.a = std::min(triangleNodes[3 * t + k], triangleNodes[3 * t + (k + 1) % 3]);
+			edge.b = std::max(triangleNodes[3 * t + k], triangleNodes[3 * t + (k + 1) % 3]);
+			edge.opposite = triangleNodes[3 * t + (k + 2) % 3];
+			edges.push_back(edge);
+		}
+	}
+	std::sort(edges.begin(), edges.end());
+	std::vector<MeshSpring> springs;
+	for (size_t e = 0; e < edges.size(); ) {
+		size_t shared = e + 1;
+		while (shared < edges.size() && edges[shared].a == edges[e].a && edges[shared].b == edges[e].b)
+			shared++;
+		MeshSpring spring;
+		spring.a = edges[e].a;
+		spring.b = edges[e].b;
+		spring.type = 0;
+		spring.rest = glm::length(load3(vertexPosition, spring.a) - load3(vertexPosition, spring.b));
+		springs.push_back(spring);
+		if (shared == e + 2 && edges[e].opposite != edges[e + 1].opposite) {
+			spring.a = std::min(edges[e].opposite, edges[e + 1].opposite);
+			spring.b = std::max(edges[e].opposite, edges[e + 1].opposite);
+			spring.type = 2;
+			spring.rest = glm::length(load3(vertexPosition, spring.a) - load3(vertexPosition, spring.b));
+			springs.push_back(spring);
+		}
+		e = shared;
+	}
+	std::sort(springs.begin(), springs.end());
+	std::vector<MeshSpring> unique;
+	for (size_t s = 0; s < springs.size(); s++) {
+		if (unique.empty() || unique.back().a != springs[s].a || unique.back().b != springs[s].b)
+			unique.push_back(springs[s]);
+	}
+
+	// the rows, both ends of every spring
+	std::vector<int> start(nodes + 1, 0);
+	for (size_t s = 0; s < unique.size(); s++) {
+		start[unique[s].a + 1]++;
+		start[unique[s].b + 1]++;
+	}
+	for (int i = 0; i < nodes; i++)
+		start[i + 1] += start[i];
+	std::vector<int> fill(start.begin(), start.end() - 1);
+	adjacencyStart.assign(start.data(), start.size());
+	adjacencyNode.resize(start[nodes]);
+	adjacencyRest.resize(start[nodes]);
+	adjacencyStiffness.resize(start[nodes]);
+	for (size_t s = 0; s < unique.size(); s++) {
+		const MeshSpring& spring = unique[s];
+		int ends[2] = { spring.a, spring.b };
+		for (int k = 0; k < 2; k++) {
+			int entry = fill[ends[k]]++;
+			adjacencyNode[entry] = ends[1 - k];
+			adjacencyRest[entry] = spring.rest;
+			adjacencyStiffness[entry] = K[spring.type];
+		}
+	}
+
+	// and the triangles around every node
+	std::vector<int> cornerRows(nodes + 1, 0);
+	for (size_t k = 0; k < triangleNodes.size(); k++)
+		cornerRows[triangleNodes[k] + 1]++;
+	for (int i = 0; i < nodes; i++)
+		cornerRows[i + 1] += cornerRows[i];
+	fill.assign(cornerRows.begin(), cornerRows.end() - 1);
+	cornerStart.assign(cornerRows.data(), cornerRows.size());
+	cornerTriangle.resize(cornerRows[nodes]);
+	for (size_t k = 0; k < triangleNodes.size(); k++)
+		cornerTriangle[fill[triangleNodes[k]]++] = static_cast<int>(k / 3);
+	for (int c = 0; c < 3; c++)
+		faceNormal[c].resize(triangleCount);
+
+	pins.clear();
+	pinPositions.clear();
+	computeNormals();
+	if (running)
+		startSimulation();
+}
+
+void TriangleCloth::pinTop(float fraction) {
+	bool running = stopSimulation();
+	int nodes = nodeCount();
+	float top = -FLT_MAX, bottom = FLT_MAX;
+	for (int i = 0; i < nodes; i++) {
+		top = std::max(top, vertexPosition[1][i]);
+		bottom = std::min(bottom, vertexPosition[1][i]);
+	}
+	pins.clear();
+	pinPositions.clear();
+	for (int i = 0; i < nodes; i++) {
+		if (vertexPosition[1][i] >= top - fraction * (top - bottom)) {
+			pins.push_back(i);
+			pinPositions.push_back(load3(vertexPosition, i));
+		}
+	}
+	if (running)
+		startSimulation();
+}
+
+void TriangleCloth::startSimulation() {
+	if (physics.isRunning())
+		return;
+	publishSnapshot();
+	physics.start(simulationTick, [this] {
+		advance(simulationTick);
+		publishSnapshot();
+	});
+}
+
+void TriangleCloth::publishSnapshot() {
+	physics.publish<Snapshot>(snapshots, [this](Snapshot& snapshot) {
+		snapshot.vertices.resize(nodeCount() * 6);
+		float* vertices = snapshot.vertices.data();
+		parallelRange(nodeCount(), [&](int begin, int end) {
+			interleaveVertices(vertexPosition, vertexNormal, begin, end, vertices);
+		});
+	});
+}
+
+int TriangleCloth::advance(float frameTime) {
+	if (nodeCount() == 0)
+		return 0;
+	int n = static_cast<int>(ceil(frameTime / stableTimeStep() - 1e-4));
+	n = std::min(std::max(n, 1), std::max(maxSubsteps, 1));
+	for (int i = 0; i < n; i++)
+		simulate(frameTime / n);
+	computeNormals();
+	return n;
+}
+
+// The same bound as Cloth::stableTimeStep, but taken per node: the
+// springs of a node add up their stiffness, and a compressed one counts
+// rest / length - 1 times over.
+float TriangleCloth::stableTimeStep() {
+	int chunks = (nodeCount() + chunkNodes - 1) / chunkNodes;
+	std::vector<float> chunkStiffness(chunks, 0.0f);
+	parallelRange(nodeCount(), [&](int begin, int end) {
+		float stiffest = 0.0f;
+		for (int i = begin; i < end; i++) {
+			glm::vec3 x = load3(vertexPosition, i);
+			float stiffness = 0.0f;
+			for (int k = adjacencyStart[i]; k < adjacencyStart[i + 1]; k++) {
+				float length = glm::length(load3(vertexPosition, adjacencyNode[k]) - x);
+				float factor = length > 0.0f ? std::max(adjacencyRest[k] / length - 1.0f, 1.0f) : 1.0f;
+				stiffness += adjacencyStiffness[k] * factor;
+			}
+			stiffest = std::max(stiffest, stiffness);
+		}
+		chunkStiffness[begin / chunkNodes] = stiffest;
+	});
+	float stiffest = *std::max_element(chunkStiffness.begin(), chunkStiffness.end());
+	const float safety = 0.8f;
+	return stiffest > 0.0f ? safety * 2.0f / sqrt(2.0f * stiffest / mass) : simulationTick;
+}
+
+// symplectic Euler as in Cloth::simulate. Every node sums the forces of
+// its own springs, each spring is evaluated from both ends, so the force
+// pass writes nothing another chunk reads and the velocity can follow
+// straight away.
+void TriangleCloth::simulate(float stepSize) {
+	ParticleView particles = particleView();
+	ForceParams params = forceParams(stepSize);
+
+	parallelRange(nodeCount(), [&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			glm::vec3 x = load3(vertexPosition, i), f(0.0f);
+			for (int k = adjacencyStart[i]; k < adjacencyStart[i + 1]; k++) {
+				glm::vec3 d = x - load3(vertexPosition, adjacencyNode[k]);
+				float length = glm::length(d);
+				if (length > 0.0f)
+					f += d * (adjacencyStiffness[k] * (adjacencyRest[k] - length) / length);
+			}
+			store3(vertexForce, i, f);
+		}
+		cloth_kernels::integrateVelocities(simdIsa, particles, params, begin, end);
+	});
+
+	parallelRange(nodeCount(), [&](int begin, int end) {
+		cloth_kernels::integratePositions(simdIsa, particles, stepSize, begin, end);
+	});
+
+	for (size_t p = 0; p < pins.size(); p++) {
+		store3(vertexPosition, pins[p], pinPositions[p]);
+		store3(vertexVelocity, pins[p], glm::vec3(0.0f));
+	}
+}
+
+// area weighted triangle normals, summed around every node
+void TriangleCloth::computeNormals() {
+	int triangleCount = static_cast<int>(triangleNodes.size()) / 3;
+	parallelRange(triangleCount, [&](int begin, int end) {
+		for (int t = begin; t < end; t++) {
+			glm::vec3 a = load3(vertexPosition, triangleNodes[3 * t]);
+			glm::vec3 b = load3(vertexPosition, triangleNodes[3 * t + 1]);
+			glm::vec3 c = load3(vertexPosition, triangleNodes[3 * t + 2]);
+			store3(faceNormal, t, glm::cross(b - a, c - a));
+		}
+	});
+	parallelRange(nodeCount(), [&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			glm::vec3 normal(0.0f);
+			for (int k = cornerStart[i]; k < cornerStart[i + 1]; k++)
+				normal += load3(faceNormal, cornerTriangle[k]);
+			float length = glm::length(normal);
+			store3(vertexNormal, i, length > 0.0f ? normal / length : glm::vec3(0.0f, 0.0f, 1.0f));
+		}
+	});
+}
+
+// kinetic plus gravitational plus spring energy
+double TriangleCloth::computeEnergy() {
+	double energy = 0.0;
+	for (int i = 0; i < nodeCount(); i++) {
+		glm::vec3 x = load3(vertexPosition, i), v = load3(vertexVelocity, i);
+		energy += 0.5 * mass * glm::dot(v, v);
+		energy += mass * gravity * x.y;
+		for (int k = adjacencyStart[i]; k < adjacencyStart[i + 1]; k++) {
+			if (adjacencyNode[k] < i)
+				continue;
+			double stretch = glm::length(load3(vertexPosition, adjacencyNode[k]) - x) - adjacencyRest[k];
+			energy += 0.5 * adjacencyStiffness[k] * stretch * stretch;
+		}
+	}
+	return energy;
+}
+
+// fn(begin, end) on chunks of [0, count)
+void TriangleCloth::parallelRange(int count, const std::function<void(int, int)>& fn) {
+	pool->run((count + chunkNodes - 1) / chunkNodes, [&](int chunk) {
+		fn(chunk * chunkNodes, std::min((chunk + 1) * chunkNodes, count));
+	});
+}
+
+ParticleView TriangleCloth::particleView() {
+	ParticleView p;
+	p.px = vertexPosition[0].data(); p.py = vertexPosition[1].data(); p.pz = vertexPosition[2].data();
+	p.vx = vertexVelocity[0].data(); p.vy = vertexVelocity[1].data(); p.vz = vertexVelocity[2].data();
+	p.nx = vertexNormal[0].data(); p.ny = vertexNormal[1].data(); p.nz = vertexNormal[2].data();
+	p.fx = vertexForce[0].data(); p.fy = vertexForce[1].data(); p.fz = vertexForce[2].data();
+	return p;
+}
+
+ForceParams TriangleCloth::forceParams(float timeStep) {
+	ForceParams params;
+	for (int t = 0; t < 3; t++)
+		params.flowVelocity[t] = flowVelocity[t];
+	params.mass = mass;
+	params.gravity = gravity;
+	params.Cd = Cd;
+	params.Cv = Cv;
+	params.stepSize = timeStep;
+	return params;
+}
+
+// Ring r is a hexagon of 6r nodes pushed out onto the circle, so the
+// triangles between two rings stay close to equilateral. Its first node
+// sits at the top.
+void makeDiscMesh(int rings, std::vector<glm::vec3>& vertices, std::vector<unsigned int>& indices) {
+	const float pi = 3.14159265f;
+	rings = std::max(rings, 1);
+	vertices.assign(1, glm::vec3(0.0f));
+	indices.clear();
+	for (int r = 1; r <= rings; r++) {
+		for (int m = 0; m < 6 * r; m++) {
+			int s = m / r;
+			float along = static_cast<float>(m % r) / r;
+			glm::vec2 from(cos(pi / 3.0f * s + pi / 2.0f), sin(pi / 3.0f * s + pi / 2.0f));
+			glm::vec2 to(cos(pi / 3.0f * (s + 1) + pi / 2.0f), sin(pi / 3.0f * (s + 1) + pi / 2.0f));
+			glm::vec2 h = from + (to - from) * along;
+			float angle = atan2(h.y, h.x), radius = 2.0f * r / rings;
+			vertices.push_back(glm::vec3(radius * cos(angle), radius * sin(angle), 0.0f));
+		}
+	}
+	for (int r = 1; r <= rings; r++) {
+		unsigned int outer = 1 + 3 * r * (r - 1), inner = r > 1 ? 1 + 3 * (r - 1) * (r - 2) : 0;
+		int outerCount = 6 * r, innerCount = std::max(6 * (r - 1), 1);
+		for (int s = 0; s < 6; s++) {
+			for (int k = 0; k < r; k++) {
+				unsigned int a = outer + (s * r + k) % outerCount, b = outer + (s * r + k + 1) % outerCount;
+				unsigned int c = inner + (s * (r - 1) + k) % innerCount;
+				indices.push_back(c);
+				indices.push_back(a);
+				indices.push_back(b);
+				if (k + 1 < r) {
+					indices.push_back(c);
+					indices.push_back(b);
+					indices.push_back(inner + (s * (r - 1) + k + 1) % innerCount);
+				}
+			}
+		}
+	}
+}
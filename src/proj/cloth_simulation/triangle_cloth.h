@@ -0,0 +1,126 @@
+#ifndef TRIANGLE_CLOTH_H
+#define TRIANGLE_CLOTH_H
+
+// Cloth on an arbitrary triangle mesh, such as a garment loaded through
+// Model, with the explicit integrator. Vertices at the same position are
+// welded into one node and the nodes are numbered along a Morton curve
+// through the mesh's bounding box, so nodes close in space are close in
+// memory. Every edge is a stretch spring and the two corners opposite an
+// edge shared by two triangles are joined by a bending spring. The springs
+// of each node are kept in compressed sparse rows, and every node gathers
+// its own spring forces, so the force pass needs no coloring or bands.
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <chrono>
+
+#include "aligned_array.h"
+#include "cloth_kernels.h"
+#include "physics_thread.h"
+#include "thread_pool.h"
+#include "triple_buffer.h"
+
+class TriangleCloth {
+    public:
+		// one finished tick of the physics thread
+		struct Snapshot {
+			std::vector<float> vertices; // interleaved position and normal of every node
+			double time; // clockTime() when the tick was finished
+			Snapshot() : time(0.0) {}
+		};
+
+		// settings, only change these while the simulation is stopped
+		cloth_kernels::Isa simdIsa;
+		float simulationTick;
+		int maxSubsteps; // the substep is as large as stays stable, up to this many per advance
+
+		// written by the physics thread, the read side belongs to whoever
+		// draws the cloth
+		TripleBuffer<Snapshot> snapshots;
+
+		TriangleCloth();
+		~TriangleCloth();
+
+		// Builds the cloth from three vertex indices per triangle, at rest in
+		// the given shape; triangles that collapse when welding are dropped.
+		// The cloth starts unpinned. Only call this while the simulation is
+		// stopped.
+		void setMesh(const std::vector<glm::vec3>& vertices, const std::vector<unsigned int>& indices);
+		// pins the nodes less than fraction of the mesh's height below its top
+		void pinTop(float fraction);
+
+		int nodeCount() const { return static_cast<int>(vertexPosition[0].size()); }
+		int springCount() const { return static_cast<int>(adjacencyNode.size()) / 2; }
+		int pinCount() const { return static_cast<int>(pins.size()); }
+		// three node indices per triangle, for drawing the snapshots
+		const std::vector<unsigned int>& triangles() const { return triangleNodes; }
+
+		int threadCount() const { return pool->size(); }
+		cloth_kernels::Isa bestIsa() const { return maxSimdIsa; }
+		void setThreadCount(int threads);
+
+		// see Cloth::startSimulation
+		void startSimulation();
+		bool stopSimulation() { return physics.stop(); }
+		double clockTime() const { return physics.clockTime(); }
+
+		// advances the cloth by frameTime and returns the number of substeps
+		int advance(float frameTime);
+		double computeEnergy();
+
+    private:
+		float mass;
+		float K[3];
+		float gravity;
+		float Cd;
+		float Cv;
+		glm::vec3 flowVelocity;
+
+		// structure of arrays, one array per component
+		AlignedArray<float> vertexPosition[3];
+		AlignedArray<float> vertexNormal[3];
+		AlignedArray<float> vertexVelocity[3];
+		AlignedArray<float> vertexForce[3];
+
+		// The springs of node i are [adjacencyStart[i], adjacencyStart[i + 1])
+		// of the other arrays: the node at the other end, the rest length and
+		// the stiffness. Every spring is stored once from either end.
+		AlignedArray<int> adjacencyStart;
+		AlignedArray<int> adjacencyNode;
+		AlignedArray<float> adjacencyRest;
+		AlignedArray<float> adjacencyStiffness;
+
+		// the triangles, and in the same form the triangles around every node
+		std::vector<unsigned int> triangleNodes;
+		AlignedArray<float> faceNormal[3]; // area weighted
+		AlignedArray<int> cornerStart;
+		AlignedArray<int> cornerTriangle;
+
+		std::vector<int> pins;
+		std::vector<glm::vec3> pinPositions;
+
+		// nodes are handed to the pool in chunks of about this many
+		static const int chunkNodes = 1024;
+		ThreadPool* pool;
+
+		cloth_kernels::Isa maxSimdIsa;
+
+		PhysicsThread physics;
+
+		float stableTimeStep();
+		void simulate(float timeStep);
+		void computeNormals();
+		void publishSnapshot();
+		void parallelRange(int count, const std::function<void(int, int)>& fn);
+
+		ParticleView particleView();
+		ForceParams forceParams(float timeStep);
+};
+
+// A flat round cloth of the given number of rings around its centre,
+// radius 2 in the xy plane, ring r with 6r nodes; for tools without a model
+// loader.
+void makeDiscMesh(int rings, std::vector<glm::vec3>& vertices, std::vector<unsigned int>& indices);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <atomic>
+
+// Lock-free handoff of the latest value from one writer thread to one reader
+// thread. Each side owns one of the three slots; the third sits in the middle
+// and is swapped in by publish() and update(), so neither side ever waits and
+// the reader always sees the most recently published value.
+template <typename T>
+class TripleBuffer {
+public:
+	TripleBuffer() : writeIndex(0), readIndex(1), middle(2) {}
+
+	// writer side: fill back(), then publish() it
+	T& back() { return slots[writeIndex]; }
+
+	void publish() {
+		writeIndex = middle.exchange(writeIndex | freshBit) & indexMask;
+	}
+
+	// reader side: true if a value was published since the last update()
+	bool fresh() const { return (middle.load() & freshBit) != 0; }
+
+	// makes the latest published value front(), returns false if there was none
+	bool update() {
+		if (!fresh())
+			return false;
+		readIndex = middle.exchange(readIndex) & indexMask;
+		return true;
+	}
+
+	const T& front() const { return slots[readIndex]; }
+
+private:
+	TripleBuffer(const TripleBuffer&);
+	TripleBuffer& operator=(const TripleBuffer&);
+
+	enum { indexMask = 3, freshBit = 4 };
+
+	T slots[3];
+	int writeIndex;
+	int readIndex;
+	std::atomic<int> middle;
+};
+
+#endif
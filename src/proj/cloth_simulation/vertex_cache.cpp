@@ -0,0 +1,284 @@
+#include "vertex_cache.h"
+
+#include <cmath>
+#include <cstring>
+
+static const int fileVersion = 1;
+static const int headerBytes = 32;
+static const int footerBytes = 16;
+static const int frameHeaderBytes = 8;
+static const int recordedNormalBits = 12;
+
+static bool seekTo(FILE* file, long long offset) {
+#ifdef _WIN32
+	return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+	return fseeko(file, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+}
+
+static long long fileSize(FILE* file) {
+#ifdef _WIN32
+	if (_fseeki64(file, 0, SEEK_END) != 0)
+		return -1;
+	return _ftelli64(file);
+#else
+	if (fseeko(file, 0, SEEK_END) != 0)
+		return -1;
+	return static_cast<long long>(ftello(file));
+#endif
+}
+
+static int quantize(float value, float scale) {
+	float q = floor(value * scale + 0.5f);
+	return fabs(q) < 2e9f ? static_cast<int>(q) : 0;
+}
+
+static float sign(float value) {
+	return value < 0.0f ? -1.0f : 1.0f;
+}
+
+// the unit normal onto the octahedron |u| + |v| + |w| = 1, with the lower
+// half folded out over the corners of the square
+static void encodeNormal(const float* n, float& u, float& v) {
+	float l1 = fabs(n[0]) + fabs(n[1]) + fabs(n[2]);
+	if (l1 == 0.0f) {
+		u = v = 0.0f;
+		return;
+	}
+	u = n[0] / l1;
+	v = n[1] / l1;
+	if (n[2] < 0.0f) {
+		float folded = (1.0f - fabs(v)) * sign(u);
+		v = (1.0f - fabs(u)) * sign(v);
+		u = folded;
+	}
+}
+
+static void decodeNormal(float u, float v, float* n) {
+	n[0] = u;
+	n[1] = v;
+	n[2] = 1.0f - fabs(u) - fabs(v);
+	if (n[2] < 0.0f) {
+		n[0] = (1.0f - fabs(v)) * sign(u);
+		n[1] = (1.0f - fabs(u)) * sign(v);
+	}
+	float length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+	if (length > 0.0f) {
+		for (int k = 0; k < 3; k++)
+			n[k] /= length;
+	}
+}
+
+// Changes are taken modulo 2^32, so they stay exact whatever the values.
+// Zigzag puts small changes of either sign into small unsigned numbers.
+static void putVarint(std::vector<unsigned char>& out, unsigned delta) {
+	unsigned zigzag = (delta << 1) ^ (0u - (delta >> 31));
+	while (zigzag >= 0x80) {
+		out.push_back(static_cast<unsigned char>(zigzag | 0x80));
+		zigzag >>= 7;
+	}
+	out.push_back(static_cast<unsigned char>(zigzag));
+}
+
+static bool getVarint(const unsigned char*& in, const unsigned char* end, unsigned& delta) {
+	unsigned zigzag = 0;
+	for (int shift = 0; shift < 35; shift += 7) {
+		if (in == end)
+			return false;
+		unsigned char byte = *in++;
+		zigzag |= static_cast<unsigned>(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			delta = (zigzag >> 1) ^ (0u - (zigzag & 1));
+			return true;
+		}
+	}
+	return false;
+}
+
+bool VertexCacheWriter::open(const std::string& path, int resolution, float frameTime) {
+	close();
+	file = fopen(path.c_str(), "wb");
+	if (!file)
+		return false;
+	nodes = resolution * resolution;
+	int version = fileVersion;
+	bool ok = fwrite("CVTX", 1, 4, file) == 4
+		&& fwrite(&version, sizeof(int), 1, file) == 1
+		&& fwrite(&nodes, sizeof(int), 1, file) == 1
+		&& fwrite(&resolution, sizeof(int), 1, file) == 1
+		&& fwrite(&keyframeInterval, sizeof(int), 1, file) == 1
+		&& fwrite(&recordedNormalBits, sizeof(int), 1, file) == 1
+		&& fwrite(&positionStep, sizeof(float), 1, file) == 1
+		&& fwrite(&frameTime, sizeof(float), 1, file) == 1;
+	if (!ok) {
+		fclose(file);
+		file = NULL;
+		return false;
+	}
+	failed = false;
+	written = headerBytes;
+	frameOffsets.clear();
+	previous.assign(nodes * 5, 0);
+	current.resize(nodes * 5);
+	return true;
+}
+
+bool VertexCacheWriter::append(const float* vertices) {
+	if (!file || failed)
+		return false;
+	float positionScale = 1.0f / positionStep, normalScale = static_cast<float>((1 << (recordedNormalBits - 1)) - 1);
+	for (int i = 0; i < nodes; i++) {
+		const float* vertex = vertices + i * 6;
+		int* q = &current[i * 5];
+		for (int k = 0; k < 3; k++)
+			q[k] = quantize(vertex[k], positionScale);
+		float u, v;
+		encodeNormal(vertex + 3, u, v);
+		q[3] = quantize(u, normalScale);
+		q[4] = quantize(v, normalScale);
+	}
+
+	int frame = frameCount();
+	bool keyframe = frame % keyframeInterval == 0;
+	encoded.clear();
+	for (int k = 0; k < nodes * 5; k++)
+		putVarint(encoded, static_cast<unsigned>(current[k]) - (keyframe ? 0u : static_cast<unsigned>(previous[k])));
+	unsigned size = static_cast<unsigned>(encoded.size());
+	if (fwrite(&frame, sizeof(int), 1, file) != 1 || fwrite(&size, sizeof(unsigned), 1, file) != 1
+		|| fwrite(encoded.data(), 1, size, file) != size) {
+		failed = true;
+		return false;
+	}
+	frameOffsets.push_back(written);
+	written += frameHeaderBytes + size;
+	previous.swap(current);
+	return true;
+}
+
+bool VertexCacheWriter::close() {
+	if (!file)
+		return true;
+	int frames = frameCount();
+	long long indexOffset = written;
+	bool ok = fwrite(frameOffsets.data(), sizeof(long long), frameOffsets.size(), file) == frameOffsets.size()
+		&& fwrite(&indexOffset, sizeof(long long), 1, file) == 1
+		&& fwrite(&frames, sizeof(int), 1, file) == 1
+		&& fwrite("CIDX", 1, 4, file) == 4;
+	ok = fclose(file) == 0 && ok && !failed;
+	file = NULL;
+	return ok;
+}
+
+bool VertexCacheReader::open(const std::string& path) {
+	close();
+	file = fopen(path.c_str(), "rb");
+	if (!file)
+		return false;
+	char magic[4];
+	int version = 0, nodeCount = 0;
+	bool ok = fread(magic, 1, 4, file) == 4 && !memcmp(magic, "CVTX", 4)
+		&& fread(&version, sizeof(int), 1, file) == 1 && version == fileVersion
+		&& fread(&nodeCount, sizeof(int), 1, file) == 1
+		&& fread(&meshResolution, sizeof(int), 1, file) == 1
+		&& fread(&keyframeInterval, sizeof(int), 1, file) == 1
+		&& fread(&normalBits, sizeof(int), 1, file) == 1
+		&& fread(&positionStep, sizeof(float), 1, file) == 1
+		&& fread(&time, sizeof(float), 1, file) == 1
+		&& meshResolution >= 2 && meshResolution <= 46340 && nodeCount == meshResolution * meshResolution
+		&& keyframeInterval > 0 && normalBits >= 2 && normalBits <= 24 && positionStep > 0.0f;
+	long long size = ok ? fileSize(file) : -1;
+	if (size < headerBytes) {
+		close();
+		return false;
+	}
+	nodes = nodeCount;
+
+	// the index if the recording was closed, otherwise the frames are
+	// walked one by one and a cut off last frame is dropped
+	long long indexOffset = 0;
+	int frames = 0;
+	char footer[4];
+	if (size >= headerBytes + footerBytes && seekTo(file, size - footerBytes)
+		&& fread(&indexOffset, sizeof(long long), 1, file) == 1 && fread(&frames, sizeof(int), 1, file) == 1
+		&& fread(footer, 1, 4, file) == 4 && !memcmp(footer, "CIDX", 4)
+		&& frames >= 0 && indexOffset >= headerBytes && indexOffset + frames * 8ll + footerBytes == size) {
+		frameOffsets.resize(frames);
+		ok = seekTo(file, indexOffset) && fread(frameOffsets.data(), sizeof(long long), frames, file) == static_cast<size_t>(frames);
+		for (int f = 0; ok && f < frames; f++)
+			ok = frameOffsets[f] >= headerBytes && frameOffsets[f] < indexOffset;
+	} else {
+		long long offset = headerBytes;
+		int frame;
+		unsigned frameBytes;
+		while (offset + frameHeaderBytes <= size && seekTo(file, offset)
+			&& fread(&frame, sizeof(int), 1, file) == 1 && frame == frameCount()
+			&& fread(&frameBytes, sizeof(unsigned), 1, file) == 1 && offset + frameHeaderBytes + frameBytes <= size) {
+			frameOffsets.push_back(offset);
+			offset += frameHeaderBytes + frameBytes;
+		}
+	}
+	if (!ok) {
+		close();
+		return false;
+	}
+	quantized.assign(nodes * 5, 0);
+	decodedFrame = -1;
+	return true;
+}
+
+void VertexCacheReader::close() {
+	if (file)
+		fclose(file);
+	file = NULL;
+	frameOffsets.clear();
+	decodedFrame = -1;
+}
+
+bool VertexCacheReader::decode(int frame) {
+	int number;
+	unsigned size;
+	if (!seekTo(file, frameOffsets[frame]) || fread(&number, sizeof(int), 1, file) != 1 || number != frame
+		|| fread(&size, sizeof(unsigned), 1, file) != 1)
+		return false;
+	encoded.resize(size);
+	if (size > 0 && fread(encoded.data(), 1, size, file) != size)
+		return false;
+	bool keyframe = frame % keyframeInterval == 0;
+	const unsigned char* in = encoded.data();
+	const unsigned char* end = in + size;
+	for (int k = 0; k < nodes * 5; k++) {
+		unsigned delta;
+		if (!getVarint(in, end, delta))
+			return false;
+		quantized[k] = static_cast<int>(delta + (keyframe ? 0u : static_cast<unsigned>(quantized[k])));
+	}
+	if (in != end)
+		return false;
+	decodedFrame = frame;
+	return true;
+}
+
+bool VertexCacheReader::readFrame(int frame, std::vector<float>& vertices) {
+	if (!file || frame < 0 || frame >= frameCount())
+		return false;
+	int keyframe = frame - frame % keyframeInterval;
+	int first = decodedFrame >= keyframe && decodedFrame <= frame ? decodedFrame + 1 : keyframe;
+	for (int f = first; f <= frame; f++) {
+		if (!decode(f)) {
+			decodedFrame = -1;
+			return false;
+		}
+	}
+
+	vertices.resize(nodes * 6);
+	float normalStep = 1.0f / static_cast<float>((1 << (normalBits - 1)) - 1);
+	for (int i = 0; i < nodes; i++) {
+		const int* q = &quantized[i * 5];
+		float* vertex = &vertices[i * 6];
+		for (int k = 0; k < 3; k++)
+			vertex[k] = q[k] * positionStep;
+		decodeNormal(q[3] * normalStep, q[4] * normalStep, vertex + 3);
+	}
+	return true;
+}
@@ -0,0 +1,90 @@
+#ifndef VERTEX_CACHE_H
+#define VERTEX_CACHE_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Recorded cloth frames, in the interleaved position and normal layout of
+// Cloth::Snapshot. Positions are rounded to multiples of positionStep and
+// normals to octahedral coordinates of normalBits bits; every frame then
+// stores, as zigzag varints, how those integers changed since the frame
+// before. Every keyframeInterval-th frame is stored against zero instead,
+// so a frame is never more than that many frames from one that decodes on
+// its own.
+//
+// File layout (little endian): "CVTX", version, nodes, resolution,
+// keyframeInterval, normalBits, positionStep, frameTime, then each frame as
+// its number, byte count and bytes. close() appends the frame offsets (64
+// bit) and a footer of the index offset, the frame count and "CIDX"; a
+// recording that never got its index is scanned instead, up to the first
+// frame that is cut off or out of sequence.
+class VertexCacheWriter {
+public:
+	VertexCacheWriter() : file(NULL), failed(false), nodes(0), keyframeInterval(30), positionStep(1e-4f), written(0) {}
+	~VertexCacheWriter() { close(); }
+
+	// frameTime is the time between frames, kept for playback
+	bool open(const std::string& path, int resolution, float frameTime);
+	// vertices holds 6 floats per node
+	bool append(const float* vertices);
+	bool close();
+
+	bool isOpen() const { return file != NULL; }
+	int frameCount() const { return static_cast<int>(frameOffsets.size()); }
+	long long byteCount() const { return written; }
+
+private:
+	VertexCacheWriter(const VertexCacheWriter&);
+	VertexCacheWriter& operator=(const VertexCacheWriter&);
+
+	FILE* file;
+	bool failed;
+	int nodes;
+	int keyframeInterval;
+	float positionStep;
+	long long written;
+	std::vector<long long> frameOffsets;
+	std::vector<int> previous; // the quantized frame before, 5 per node
+	std::vector<int> current;
+	std::vector<unsigned char> encoded;
+};
+
+class VertexCacheReader {
+public:
+	VertexCacheReader() : file(NULL), nodes(0), meshResolution(0), keyframeInterval(1), normalBits(0),
+		positionStep(0.0f), time(0.0f), decodedFrame(-1) {}
+	~VertexCacheReader() { close(); }
+
+	bool open(const std::string& path);
+	void close();
+
+	int frameCount() const { return static_cast<int>(frameOffsets.size()); }
+	int resolution() const { return meshResolution; }
+	float frameTime() const { return time; }
+
+	// decodes a frame into 6 floats per node; the frame after the last one
+	// read only needs its own changes applied, any other starts over from
+	// the keyframe before it
+	bool readFrame(int frame, std::vector<float>& vertices);
+
+private:
+	VertexCacheReader(const VertexCacheReader&);
+	VertexCacheReader& operator=(const VertexCacheReader&);
+
+	bool decode(int frame);
+
+	FILE* file;
+	int nodes;
+	int meshResolution;
+	int keyframeInterval;
+	int normalBits;
+	float positionStep;
+	float time;
+	std::vector<long long> frameOffsets;
+	std::vector<int> quantized; // of decodedFrame, 5 per node
+	int decodedFrame;
+	std::vector<unsigned char> encoded;
+};
+
+#endif